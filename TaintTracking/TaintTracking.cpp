@@ -11,68 +11,1075 @@
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Transforms/Utils.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/InstVisitor.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/IteratedDominanceFrontier.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include <algorithm>
+#include <chrono>
 #include <map>
+#include <memory>
+#include <set>
 #include <vector>
 #include <iostream>
 using namespace llvm;
 
-namespace {
-    // vector to store the direction of the branch.
-    typedef std::vector<uint8_t> Dir, *DirPtr;
+static cl::opt<bool> ClShadowMemory("taint-shadow-memory",
+        cl::desc("Keep memory labels in a direct-mapped shadow region instead of per-pointer allocas"),
+        cl::Hidden, cl::init(false));
+
+static cl::opt<unsigned> ClShadowGranule("taint-shadow-granule",
+        cl::desc("Bytes of memory per label with -taint-shadow-memory: 4, or 1 to tell every byte apart"),
+        cl::Hidden, cl::init(4));
+
+static cl::opt<bool> ClPrune("taint-prune",
+        cl::desc("Skip label code for values that no taint source can reach"),
+        cl::Hidden, cl::init(true));
+
+static cl::opt<bool> ClFixedLabels("taint-fixed-labels",
+        cl::desc("Carry labels as 64, 128 or 256-bit source sets when the sources fit, instead of runtime label numbers"),
+        cl::Hidden, cl::init(true));
+
+static cl::opt<bool> ClPruneReport("taint-prune-report",
+        cl::desc("Print how many instrumentation sites were pruned"),
+        cl::Hidden, cl::init(false));
+
+static cl::opt<bool> ClBlockTrace("taint-block-trace",
+        cl::desc("Record the id and label of every block each time it runs (see TAINT_SAMPLE in the README)"),
+        cl::Hidden, cl::init(false));
+
+static cl::opt<unsigned> ClThreads("taint-threads",
+        cl::desc("Threads building the per-function analyses, 0 for one per core"),
+        cl::Hidden, cl::init(0));
+
+static cl::opt<bool> ClTimeReport("taint-time-report",
+        cl::desc("Print the size of the module and how long instrumenting it took"),
+        cl::Hidden, cl::init(false));
 
-    // Basic blick information.
+static cl::opt<bool> ClSiteStats("taint-site-stats",
+        cl::desc("Count how often each union and label load or store runs, reported at exit (see TAINT_SITE_STATS)"),
+        cl::Hidden, cl::init(false));
+
+static cl::opt<bool> ClDual("taint-dual",
+        cl::desc("Keep a native clone of every function that cannot reach a source, run until a source switches tracking on"),
+        cl::Hidden, cl::init(false));
+
+static cl::opt<std::string> ClPolicy("taint-policy",
+        cl::desc("File declaring the taint sources and sinks (see test/default.policy), instead of scanf and main"),
+        cl::Hidden, cl::init(""));
+
+// What a sink does when it is called with a tainted argument, must agree with tool/src/trace.rs.
+enum SinkAction { SinkTrace, SinkLog, SinkAbort };
+
+static cl::opt<SinkAction> ClSinkAction("taint-sink-action",
+        cl::desc("What a sink of the -taint-policy file does when an argument it checks is tainted"),
+        cl::values(clEnumValN(SinkTrace, "trace", "record it in the taint trace"),
+                   clEnumValN(SinkLog, "log", "record it and print the sink and the argument's sources to stderr"),
+                   clEnumValN(SinkAbort, "abort", "record it, print it and abort the program")),
+        cl::Hidden, cl::init(SinkTrace));
+
+namespace {
+    // Shadow layout, must agree with tool/src/shadow.rs.
+    // The label of the granule holding addr lives at kShadowBase + (((addr & kShadowAppMask) >> shift) << 2),
+    // where the shift is 2 for 4-byte granules and 0 with -taint-shadow-granule=1.
+    const uint64_t kShadowBase = 0x100000000000ULL;
+    const uint64_t kShadowAppMask = ~0x700000000000ULL;
+    const unsigned kLabelShift = 2;
+    // Values up to this many granules move their labels as one vector; longer ones go to the range kernels.
+    const unsigned kMaxShadowRun = 16;
+
+    // The label a basic block runs under, or the label of the branch or switch that ends one, which is what
+    // the blocks it decides run under.
     class BBInfo {
     public:
-        Value* label;
-        // For branches, it's OK to use bit to represent which direction, but for switch, we have to use > 2 number to represent each branch.
-        DirPtr branches;
-        Instruction* ancestor; // last branch in the main path.
-        BBInfo* parent;
+        Value* label; // null for a branch that is not visited yet, its slot holds the label it last had.
+        AllocaInst* slot; // entry-block copy of label, for uses the label does not dominate.
 
-        BBInfo(Value* label, DirPtr ptr, Instruction* ancestor, BBInfo* parent): label(label), branches(ptr), ancestor(ancestor), parent(parent) {};
-        ~BBInfo() {
-            delete branches;
-        }
+        explicit BBInfo(Value* label): label(label), slot(nullptr) {};
     };
 
-    // For easy use of current basic block information
-    BBInfo* curBBInfo_ptr;
-
     // Rust lib function address.
-    Constant *tree_new, *table_new, *bitvec_new, *insert_c, *union_c, *bitvec_set, *bitvec_print, *tree_free, *table_free, *bitvec_free;
-    StructType *tree_type, *table_type, *bitvec_type;
-    PointerType *tree_ptr, *table_ptr, *bitvec_ptr;
-    Type *int32_type, *void_type;
+    Constant *tree_new, *table_new, *union_c, *trace_label, *tree_free, *table_free;
+    Constant *shadow_copy, *shadow_fill, *shadow_union_range, *shadow_range_label;
+    Constant *shadow_init, *trace_bitset, *sources_init, *block_enter, *block_enter_set, *sink_check, *sink_check_set;
+    Constant *sites_init, *site_enter;
+    StructType *tree_type, *table_type;
+    PointerType *tree_ptr, *table_ptr, *label_ptr;
+    Type *int32_type, *int64_type, *void_type;
+    // i32 label numbers into the runtime table, or the source set itself when it fits in a
+    // fixed-width integer or vector. LabelWords is the number of 64-bit words of that set, 0 for the runtime.
+    Type *label_type;
+    unsigned LabelWords;
+    const DataLayout *data_layout;
     GlobalVariable *root, *nodes;
-    Value *root_ptr, *nodes_ptr;
     Constant* zero;
 
-    std::map<Function*, GlobalVariable*> FcnToBBLabelMap;
-    std::map<Function*, std::vector<GlobalVariable*>*> FcnToArgsTaintsMap;
-    std::map<Function*, GlobalVariable*> FcnToRtnTaintMap;
+    // Module-local wrapper of union_c with the trivial cases decided inline, and the same for the
+    // label of a run of shadow granules that are not all equal.
+    Function* union_inline;
+    Function* run_inline;
+    unsigned ShadowGranuleShift;
+
+    // Labels go along with a call through thread-local slots that every function of the module shares: the
+    // caller stores the labels of the arguments and of the calling block right before the call, and the
+    // callee loads them first thing; the label of the return value goes back the same way. Nothing runs
+    // between the store and the load, so a recursive call or another thread never sees them, and once the
+    // callee is inlined each load meets its store and the label stays in a register. Arguments from the last
+    // slot on share it, holding the union of their labels.
+    const unsigned kArgSlots = 64;
+    GlobalVariable *ArgLabels, *ReturnLabel, *EntryLabel;
+
+    // With -taint-dual a function that cannot reach a source keeps its native body in a clone, and runs the
+    // instrumented one only while the calling thread's tracking flag is up. A source call raises the flag, and
+    // taint_tracking(on) calls are turned into stores to it; it starts down on every thread.
+    GlobalVariable *Tracking;
+    std::map<Function*, Function*> NativeClones;
+    const char *const kTrackingCall = "taint_tracking";
+
+    Constant* argLabelSlot(unsigned index) {
+        Constant* indices[] = { ConstantInt::get(int32_type, 0), ConstantInt::get(int32_type, std::min(index, kArgSlots - 1)) };
+        return ConstantExpr::getInBoundsGetElementPtr(ArgLabels->getValueType(), ArgLabels, indices);
+    }
+
+    // Global variables are shared by different functions, so their memory labels live in globals as well.
+    std::map<GlobalVariable*, GlobalVariable*> GlobalToLabelMap;
+
+    // Everything learned while instrumenting one function. It is built right before the function is
+    // instrumented and freed right after, so nothing grows with the size of the module. The analyses and
+    // the list of instructions to visit are filled in on the thread pool, before anything is touched.
+    struct FunctionState {
+        Function &F;
+        DominatorTree DT;
+        PostDominatorTree PDT;
+        LoopInfo LI;
+        std::vector<BasicBlock*> FcnBBList;
+        std::vector<std::vector<Instruction*>> FcnInstrList;
+
+        // Control dependence, from the post-dominator tree: for every block, the blocks whose branch or switch
+        // decides whether it runs, in function order, and the blocks that decide anything at all.
+        std::map<BasicBlock*, std::vector<BasicBlock*>> Controllers;
+        std::set<BasicBlock*> Deciding;
+
+        // Indices into FcnBBList in the order the blocks are visited: reverse post-order, so a block comes after
+        // every branch that decides it except one on a path back around a loop, then any unreachable blocks.
+        std::vector<unsigned> Order;
+
+        // For easy use of current basic block information
+        BasicBlock* curBB;
+        BBInfo* curBBInfo_ptr;
+        Value *root_ptr, *nodes_ptr;
+
+        std::map<Value*, Value*> TmpToLabelMap;
+
+        // Must allocate a space to store the label since different branches might access the same mem,
+        // which have different impacts on the label.
+        // So it is impossible for a map to store two label for the same mem in that case.
+        // There is no such problem for register (tmp) since each instruction has its own number.
+        std::map<Value*, Value*> MemToLabelAddrMap;
+
+        // A mapping from BasicBlock pointer to Basic block information.
+        // Since the pointer address might be operated in different branches.
+        std::map<BasicBlock*, BBInfo*> BBToBBInfoMap;
+
+        // The label of the branch or switch that ends each deciding block.
+        std::map<BasicBlock*, BBInfo*> BranchToBBInfoMap;
+
+        // To track branch taint.
+        // The variable can be mutable only via phinode or store.
+        // If the branch use store, the address should go to this map along with the branches that decide whether
+        // the store runs. So when we load that mem block, their taint will be pass to the load value.
+        std::map<Value*, std::vector<BBInfo*>> AddrToBBInfosMap;
+
+        // Calls to union_inline and run_inline emitted into the function, inlined once it is instrumented.
+        std::vector<CallInst*> UnionCalls;
+
+        // Calls to sink_check and sink_check_set with the test of whether their label is tainted, moved under
+        // that test once the function is instrumented.
+        std::vector<std::pair<Value*, CallInst*>> SinkChecks;
+
+        // Label loads and unions emitted into the function, and the slots the loads read.
+        // Only these are candidates for hoisting out of loops.
+        std::set<Instruction*> LabelCode;
+        std::set<Value*> LabelSlots;
+
+        // Label code counted under -taint-site-stats, with its kind and the source line it is for. The code
+        // is only numbered once hoisting is done, so the count sits wherever it ends up running. A slot load or
+        // store that became a register move by then is gone, and so is its count.
+        struct PendingSite {
+            WeakVH code;
+            const char *kind;
+            unsigned line;
+        };
+        std::vector<PendingSite> PendingSites;
+
+        // Phis of loop headers and their label phis, filled in once the whole function is visited.
+        std::vector<std::pair<PHINode*, PHINode*>> PendingPhis;
+
+        // Every BBInfo created for the function, they point at each other freely.
+        std::vector<BBInfo*> BBInfos;
+
+        explicit FunctionState(Function &F): F(F), curBB(nullptr), curBBInfo_ptr(nullptr), root_ptr(nullptr), nodes_ptr(nullptr) {
+            DT.recalculate(F);
+            PDT.recalculate(F);
+            LI.analyze(DT);
+            std::map<BasicBlock*, unsigned> index;
+            for (auto &B: F) {
+                index[&B] = FcnBBList.size();
+                FcnBBList.push_back(&B);
+                FcnInstrList.emplace_back();
+                for (auto &I: B) {
+                    FcnInstrList.back().push_back(&I);
+                }
+            }
 
-    // Must use a whole map for tmp and mem since there might be some global variables shared by different functions.
-    std::map<Value*, Value*> TmpToLabelMap;
+            // Ferrante, Ottenstein and Warren: B depends on the branch ending A when B post-dominates a successor
+            // of A but not A itself, that is, when it lies on the post-dominator tree path from the successor up
+            // to A's immediate post-dominator. Whether a loop goes around again makes its header depend on the
+            // branches inside it.
+            for (auto A: FcnBBList) {
+                Instruction *terminator = A->getTerminator();
+                DomTreeNode *node = PDT.getNode(A);
+                if (!DT.isReachableFromEntry(A) || node == nullptr
+                    || !(isa<BranchInst>(terminator) || isa<SwitchInst>(terminator) || isa<IndirectBrInst>(terminator))) {
+                    continue;
+                }
+                for (auto successor: successors(A)) {
+                    for (DomTreeNode *dependent = PDT.getNode(successor); dependent != nullptr && dependent != node->getIDom()
+                            && dependent->getBlock() != nullptr; dependent = dependent->getIDom()) {
+                        std::vector<BasicBlock*> &controllers = Controllers[dependent->getBlock()];
+                        if (controllers.empty() || controllers.back() != A) {
+                            controllers.push_back(A);
+                            Deciding.insert(A);
+                        }
+                    }
+                }
+            }
 
-    // Must allocate a space to store the label since different branches might access the same mem,
-    // which have different impacts on the label.
-    // So it is impossible for a map to store two label for the same mem in that case.
-    // There is no such problem for register (tmp) since each instruction has its own number.
-    std::map<Value*, Value*> MemToLabelAddrMap;
+            std::vector<bool> ordered(FcnBBList.size(), false);
+            ReversePostOrderTraversal<Function*> RPOT(&F);
+            for (auto B: RPOT) {
+                Order.push_back(index[B]);
+                ordered[index[B]] = true;
+            }
+            for (unsigned position = 0; position < FcnBBList.size(); position++) {
+                if (!ordered[position]) {
+                    Order.push_back(position);
+                }
+            }
+        }
 
-    // A mapping from BasicBlock pointer to Basic block information.
-    // Since the pointer address might be operated in different branches.
-    std::map<BasicBlock*, BBInfo*> BBToBBInfoMap;
+        ~FunctionState() {
+            for (auto bbinfo: BBInfos) {
+                delete bbinfo;
+            }
+        }
+    };
 
-    // To track branch taint.
-    // The variable can be mutable only via phinode or store.
-    // If the branch use store, the address should go to this map and be tainted to the lable of that block.
-    // So when we load that mem block, the taint will be pass to the load value.
-    std::map<Value*, std::vector<BBInfo*>*> AddrToBBInfosMap;
     uint64_t NumOfTaints;
+    // Ids of traced blocks, counted over the whole module.
+    uint64_t NumOfBlocks;
+    // Ids of sink call sites, and the name each sink reports itself with.
+    uint64_t NumOfSinks;
+    std::map<Function*, Value*> SinkNames;
+    // The sources_init call in main, told the source count at the end.
+    CallInst *SourcesInit;
+    // What each site id of -taint-site-stats stands for, and the sites_init call in main that gets the table.
+    struct SiteInfo {
+        const char *kind;
+        std::string function;
+        unsigned block, line;
+    };
+    std::vector<SiteInfo> Sites;
+    CallInst *SitesInit;
+    // Must agree with Site in tool/src/stats.rs.
+    StructType *site_type;
+    // Static source count, known before instrumenting when labels are fixed-width.
+    uint64_t NumOfSources;
+
+    // Instrumentation sites seen, pruned because the analysis proved them clean, and unions of a
+    // compile-time zero label folded away.
+    uint64_t NumOfSites, NumOfPrunedSites, NumOfFoldedUnions;
+    // Label instructions moved from loop bodies into preheaders.
+    uint64_t NumOfHoistedLabels;
+
+    // Functions whose analyses are built together before they are instrumented one by one.
+    const size_t kFunctionBatch = 64;
+    std::chrono::duration<double> AnalysisTime, InstrumentTime;
+
+    // The number of bytes at a pointer argument of a call: argument Len, times argument Scale unless that is
+    // kNoArg. Len is kString for the C string there, or kNoArg for just the type the pointer points to.
+    const unsigned kNoArg = ~0u;
+    const unsigned kString = ~0u - 1;
+    struct Extent {
+        unsigned Len, Scale;
+
+        // Does the call have the integer arguments the size is made of?
+        bool fits(CallInst &I) const {
+            for (unsigned index: {Len, Scale}) {
+                if (index < kString && (index >= I.getNumArgOperands() || !I.getArgOperand(index)->getType()->isIntegerTy())) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    // What a source taints or a sink checks in a call: its arguments First to Last (Last is ~0u for every
+    // argument from First on), whose pointees are written by a source, or its return value.
+    struct PolicyRule {
+        bool Return;
+        unsigned First, Last;
+        Extent Size;
+    };
+    typedef std::vector<PolicyRule> PolicyRules;
+
+    // How a library function moves labels through the memory its arguments point to, a whole range at a time.
+    // Copy gives the range at Dst the labels of the range at Src, Fill gives it the label of argument Src,
+    // and Scan makes the return value depend on every byte of the range at Dst.
+    struct RangeModel {
+        enum Kind { Copy, Fill, Scan } Kind;
+        unsigned Dst, Src;
+        Extent Size;
+
+        bool fits(CallInst &I) const {
+            unsigned args = I.getNumArgOperands();
+            return Dst < args && I.getArgOperand(Dst)->getType()->isPointerTy() && (Src == kNoArg || Src < args)
+                   && (Kind != Copy || I.getArgOperand(Src)->getType()->isPointerTy()) && Size.fits(I);
+        }
+    };
+    typedef std::vector<RangeModel> RangeModels;
+
+    // The taint sources and sinks, by function name. Without a policy file the sources are what they
+    // always were, every target of scanf and every argument of main, and there are no sinks.
+    // A policy file has one rule per line, # starts a comment:
+    //     source <function> ret              the return value of every call is a new source
+    //     source <function> arg <n> [size]   so is what argument n points to after the call
+    //     source <function> args <n>         ... for argument n and every one after it
+    //     sink <function> arg <n>            check the label of argument n, and of what it points to
+    //     sink <function> args <n>
+    //     copy <function> <dst> <src> size   the models of library functions, see RangeModel;
+    //     fill <function> <dst> <value> size     they replace the built-in ones of the same function
+    //     scan <function> <arg> size
+    // where a size is an argument number, two of them as <n>*<m>, or str.
+    // Sources are functions the module only declares, plus main, whose arguments themselves are the sources.
+    class TaintPolicy {
+    public:
+        void setDefault() {
+            Sources.clear();
+            Sinks.clear();
+            Sources["__isoc99_scanf"].push_back({false, 1, ~0u, {kNoArg, kNoArg}});
+            Sources["main"].push_back({false, 0, ~0u, {kNoArg, kNoArg}});
+            setDefaultModels();
+        }
+
+        void load(const std::string &path) {
+            auto buffer = MemoryBuffer::getFile(path);
+            if (!buffer) {
+                report_fatal_error(Twine("taint-policy: cannot read ") + path + ": " + buffer.getError().message(), false);
+            }
+            Sources.clear();
+            Sinks.clear();
+            setDefaultModels();
+            std::set<std::string> modelled;
+
+            SmallVector<StringRef, 32> lines;
+            (*buffer)->getBuffer().split(lines, '\n');
+            for (unsigned number = 0; number < lines.size(); number++) {
+                SmallVector<StringRef, 4> words;
+                SplitString(lines[number].split('#').first, words);
+                if (words.empty()) {
+                    continue;
+                }
+
+                auto fail = [&](const char *message) {
+                    report_fatal_error("taint-policy: " + path + ":" + Twine(number + 1) + ": " + message, false);
+                };
+                auto number_at = [&](unsigned index) {
+                    unsigned value;
+                    if (index >= words.size() || words[index].getAsInteger(10, value)) {
+                        fail("expected an argument number");
+                    }
+                    return value;
+                };
+                auto size_at = [&](unsigned index) {
+                    Extent size = {kNoArg, kNoArg};
+                    if (index >= words.size()) {
+                        fail("expected a size");
+                    } else if (words[index] == "str") {
+                        size.Len = kString;
+                    } else {
+                        std::pair<StringRef, StringRef> factors = words[index].split('*');
+                        if (factors.first.getAsInteger(10, size.Len)
+                            || (!factors.second.empty() && factors.second.getAsInteger(10, size.Scale))) {
+                            fail("expected a size: <n>, <n>*<m> or str");
+                        }
+                    }
+                    return size;
+                };
+
+                if (words[0] == "copy" || words[0] == "fill" || words[0] == "scan") {
+                    if (words.size() != (words[0] == "scan" ? 4 : 5)) {
+                        fail("expected a function, its arguments and a size");
+                    }
+                    std::string name = words[1].str();
+                    if (modelled.insert(name).second) {
+                        Models[name].clear();
+                    }
+                    RangeModel model = {RangeModel::Scan, number_at(2), kNoArg, size_at(words.size() - 1)};
+                    if (words[0] != "scan") {
+                        model.Kind = words[0] == "copy" ? RangeModel::Copy : RangeModel::Fill;
+                        model.Src = number_at(3);
+                    }
+                    Models[name].push_back(model);
+                    continue;
+                }
+
+                if (words.size() < 3 || (words[0] != "source" && words[0] != "sink")) {
+                    fail("expected source, sink, copy, fill or scan");
+                }
+                PolicyRule rule = {false, 0, 0, {kNoArg, kNoArg}};
+                if (words[2] == "ret" && words.size() == 3) {
+                    if (words[0] == "sink") {
+                        fail("a sink checks arguments, not its return value");
+                    }
+                    rule.Return = true;
+                } else if (words[2] == "arg" && (words.size() == 4 || (words.size() == 5 && words[0] == "source"))) {
+                    rule.First = rule.Last = number_at(3);
+                    if (words.size() == 5) {
+                        rule.Size = size_at(4);
+                    }
+                } else if (words[2] == "args" && words.size() == 4) {
+                    rule.First = number_at(3);
+                    rule.Last = ~0u;
+                } else {
+                    fail("expected ret, arg <n> [size] or args <n>");
+                }
+                (words[0] == "source" ? Sources : Sinks)[words[1].str()].push_back(rule);
+            }
+        }
+
+        bool hasSinks() const {
+            return !Sinks.empty();
+        }
+
+        const PolicyRules* source(Function *F) const {
+            if (F == nullptr || (F->hasExactDefinition() && F->getName() != "main")) {
+                return nullptr;
+            }
+            auto iter = Sources.find(F->getName().str());
+            return iter == Sources.end() ? nullptr : &iter->second;
+        }
+
+        const PolicyRules* sink(Function *F) const {
+            if (F == nullptr) {
+                return nullptr;
+            }
+            auto iter = Sinks.find(F->getName().str());
+            return iter == Sinks.end() ? nullptr : &iter->second;
+        }
+
+        // The memory intrinsics share the models of their library functions.
+        const RangeModels* models(Function *F) const {
+            if (F == nullptr || F->hasExactDefinition()) {
+                return nullptr;
+            }
+            std::string name = F->getName().str();
+            switch (F->getIntrinsicID()) {
+                case Intrinsic::memcpy: name = "memcpy"; break;
+                case Intrinsic::memmove: name = "memmove"; break;
+                case Intrinsic::memset: name = "memset"; break;
+                default: break;
+            }
+            auto iter = Models.find(name);
+            return iter == Models.end() || iter->second.empty() ? nullptr : &iter->second;
+        }
+
+        static bool coversArg(const PolicyRules *rules, unsigned index) {
+            return coveringRule(rules, index) != nullptr;
+        }
+
+        static const PolicyRule* coveringRule(const PolicyRules *rules, unsigned index) {
+            if (rules != nullptr) {
+                for (auto &rule: *rules) {
+                    if (!rule.Return && rule.First <= index && index <= rule.Last) {
+                        return &rule;
+                    }
+                }
+            }
+            return nullptr;
+        }
+
+        static bool coversReturn(const PolicyRules *rules) {
+            if (rules != nullptr) {
+                for (auto &rule: *rules) {
+                    if (rule.Return) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        // Is argument index a range the models only read or write through?
+        static bool coversRange(const RangeModels *models, unsigned index) {
+            if (models != nullptr) {
+                for (auto &model: *models) {
+                    if (model.Dst == index || (model.Kind == RangeModel::Copy && model.Src == index)) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+    private:
+        std::map<std::string, PolicyRules> Sources, Sinks;
+        std::map<std::string, RangeModels> Models;
+
+        void setDefaultModels() {
+            const Extent size = {2, kNoArg}, string = {kString, kNoArg};
+            Models.clear();
+            for (auto name: {"memcpy", "memmove", "strncpy"}) {
+                Models[name] = {{RangeModel::Copy, 0, 1, size}};
+            }
+            for (auto name: {"strcpy", "stpcpy"}) {
+                Models[name] = {{RangeModel::Copy, 0, 1, string}};
+            }
+            Models["memset"] = {{RangeModel::Fill, 0, 1, size}};
+            for (auto name: {"memcmp", "strncmp"}) {
+                Models[name] = {{RangeModel::Scan, 0, kNoArg, size}, {RangeModel::Scan, 1, kNoArg, size}};
+            }
+            Models["strcmp"] = {{RangeModel::Scan, 0, kNoArg, string}, {RangeModel::Scan, 1, kNoArg, string}};
+            for (auto name: {"strlen", "atoi", "atol", "atoll", "strtol", "strtoul", "strtoll", "strtoull", "strtod"}) {
+                Models[name] = {{RangeModel::Scan, 0, kNoArg, string}};
+            }
+        }
+    };
+
+    TaintPolicy Policy;
+
+    // Forward reachability from the taint sources of the policy, run on the
+    // whole module before anything is instrumented. It follows the same propagation rules as the
+    // visitor, over def-use chains, memory (by underlying object) and calls. A value it never reaches
+    // carries the empty label on every execution, so no label code is needed for it.
+    // When the policy declares sinks, a second pass walks the same rules backwards from the sink arguments,
+    // and only what lies on both, the slice from the sources to the sinks, is reported tainted.
+    class TaintReachability {
+    public:
+        void run(Module &M, const DataLayout &DL) {
+            this->DL = &DL;
+            computeEscapes(M);
+
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                for (auto &F: M) {
+                    if (F.hasExactDefinition() && !F.getName().startswith("__taint_")) {
+                        changed |= visitFunction(F);
+                    }
+                }
+            }
+
+            Sliced = Policy.hasSinks();
+            changed = Sliced;
+            while (changed) {
+                changed = false;
+                for (auto &F: M) {
+                    if (F.hasExactDefinition() && !F.getName().startswith("__taint_")) {
+                        changed |= sliceFunction(F);
+                    }
+                }
+            }
+        }
+
+        bool isTainted(Value *V) const {
+            return Values.count(V) != 0 && isRelevant(V);
+        }
+
+        // May a load through ptr observe a non-empty label?
+        bool isMemoryTainted(Value *ptr) const {
+            return reachesMemory(ptr) && isMemoryRelevant(ptr);
+        }
+
+        bool isControlTainted(BasicBlock *BB) const {
+            return ControlBlocks.count(BB) != 0 && isControlRelevant(BB->getParent());
+        }
+
+        bool isArgTainted(Function *F, unsigned index) const {
+            return index < F->arg_size() && isTainted(&*(F->arg_begin() + index));
+        }
+
+        bool isReturnTainted(Function *F) const {
+            return ReturnTainted.count(F) != 0 && (!Sliced || RelevantReturns.count(F) != 0);
+        }
+
+        bool isEntryTainted(Function *F) const {
+            return EntryTainted.count(F) != 0 && isControlRelevant(F);
+        }
+
+    private:
+        const DataLayout *DL;
+        std::set<Value*> Values;
+        std::set<Value*> Objects;
+        std::set<Value*> Escaped;
+        std::set<BasicBlock*> ControlBlocks;
+        std::set<Function*> EntryTainted, ReturnTainted;
+        // Functions whose address is taken. A call through a pointer, or from a library function, may reach
+        // any of them with whatever the slots hold, so their arguments, entry and return count as tainted.
+        std::set<Function*> AddressTaken;
+        // A tainted store through a pointer of unknown origin, and a tainted store into an object
+        // whose address escaped. Either one may be observed through any pointer of unknown origin.
+        bool UnknownMemory = false;
+        bool EscapedTainted = false;
+
+        // The backward slice from the sinks, in the same terms. A function is in it once the label of any of
+        // its blocks may reach a sink, which makes every branch of the function, and of its callers, count.
+        bool Sliced = false;
+        std::set<Value*> RelevantValues;
+        std::set<Value*> RelevantObjects;
+        std::set<Function*> RelevantControl, RelevantReturns;
+        bool RelevantUnknown = false;
+        bool RelevantEscaped = false;
+
+        // Allocas and globals are tracked individually, everything else is "unknown memory".
+        Value* underlyingObject(Value *ptr) const {
+            Value *object = GetUnderlyingObject(ptr, *DL);
+            return (isa<AllocaInst>(object) || isa<GlobalVariable>(object)) ? object : nullptr;
+        }
+
+        void computeEscapes(Module &M) {
+            for (auto &F: M) {
+                if (F.hasExactDefinition() && !F.getName().startswith("__taint_") && F.hasAddressTaken()) {
+                    AddressTaken.insert(&F);
+                }
+            }
+            for (auto &G: M.globals()) {
+                if (!G.hasLocalLinkage() || escapes(&G)) {
+                    Escaped.insert(&G);
+                }
+            }
+            for (auto &F: M) {
+                for (auto &B: F) {
+                    for (auto &I: B) {
+                        if (isa<AllocaInst>(I) && escapes(&I)) {
+                            Escaped.insert(&I);
+                        }
+                    }
+                }
+            }
+        }
+
+        // An address escapes once it is used as anything but the address of a load or store.
+        // A source only writes through the arguments it taints, which is modelled as a store, and a modelled
+        // library function only reads or writes the ranges its arguments point to, unless it hands one back.
+        bool escapes(Value *ptr) {
+            for (auto user: ptr->users()) {
+                if (isa<LoadInst>(user)) {
+                    continue;
+                } else if (auto store = dyn_cast<StoreInst>(user)) {
+                    if (store->getValueOperand() == ptr) {
+                        return true;
+                    }
+                } else if (isa<GetElementPtrInst>(user) || isa<BitCastInst>(user)) {
+                    if (escapes(user)) {
+                        return true;
+                    }
+                } else if (auto call = dyn_cast<CallInst>(user)) {
+                    const PolicyRules *rules = Policy.source(call->getCalledFunction());
+                    const RangeModels *models = Policy.models(call->getCalledFunction());
+                    bool handsBack = call->getType()->isPointerTy() && !call->use_empty();
+                    if (call->getCalledValue() == ptr) {
+                        return true;
+                    }
+                    for (unsigned index = 0; index < call->getNumArgOperands(); index++) {
+                        if (call->getArgOperand(index) == ptr && !TaintPolicy::coversArg(rules, index)
+                            && (handsBack || !TaintPolicy::coversRange(models, index))) {
+                            return true;
+                        }
+                    }
+                } else if (auto expr = dyn_cast<ConstantExpr>(user)) {
+                    if (expr->isCast() || expr->getOpcode() == Instruction::GetElementPtr) {
+                        if (escapes(expr)) {
+                            return true;
+                        }
+                    }
+                } else {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool reachesMemory(Value *ptr) const {
+            Value *object = underlyingObject(ptr);
+            if (object == nullptr) {
+                return UnknownMemory || EscapedTainted;
+            }
+            return Objects.count(object) != 0 || (UnknownMemory && Escaped.count(object) != 0);
+        }
+
+        bool taint(Value *V) {
+            return Values.insert(V).second;
+        }
+
+        bool taintMemory(Value *ptr) {
+            Value *object = underlyingObject(ptr);
+            if (object == nullptr) {
+                bool changed = !UnknownMemory;
+                UnknownMemory = true;
+                return changed;
+            }
+            bool changed = Objects.insert(object).second;
+            if (changed && Escaped.count(object) != 0) {
+                EscapedTainted = true;
+            }
+            return changed;
+        }
+
+        // Every block reachable from a tainted branch may see its label, as may the whole
+        // function once its entry label is tainted.
+        bool taintControl(BasicBlock *from) {
+            bool changed = false;
+            std::vector<BasicBlock*> worklist(succ_begin(from), succ_end(from));
+            while (!worklist.empty()) {
+                BasicBlock *BB = worklist.back();
+                worklist.pop_back();
+                if (ControlBlocks.insert(BB).second) {
+                    changed = true;
+                    worklist.insert(worklist.end(), succ_begin(BB), succ_end(BB));
+                }
+            }
+            return changed;
+        }
+
+        bool anyOperandTainted(User &U) {
+            for (auto &operand: U.operands()) {
+                if (Values.count(operand.get())) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool visitFunction(Function &F) {
+            bool changed = false;
+
+            if (F.getName() == "main") {
+                const PolicyRules *rules = Policy.source(&F);
+                for (auto &arg: F.args()) {
+                    if (TaintPolicy::coversArg(rules, arg.getArgNo())) {
+                        changed |= taint(&arg);
+                    }
+                }
+            }
+            if (AddressTaken.count(&F)) {
+                for (auto &arg: F.args()) {
+                    changed |= taint(&arg);
+                }
+                changed |= EntryTainted.insert(&F).second;
+                if (!F.getReturnType()->isVoidTy()) {
+                    changed |= ReturnTainted.insert(&F).second;
+                }
+            }
+            if (EntryTainted.count(&F) && !ControlBlocks.count(&F.getEntryBlock())) {
+                for (auto &B: F) {
+                    ControlBlocks.insert(&B);
+                }
+                changed = true;
+            }
+
+            for (auto &B: F) {
+                for (auto &I: B) {
+                    if (auto store = dyn_cast<StoreInst>(&I)) {
+                        if (Values.count(store->getValueOperand()) || Values.count(store->getPointerOperand())
+                            || ControlBlocks.count(&B)) {
+                            changed |= taintMemory(store->getPointerOperand());
+                        }
+                    } else if (auto load = dyn_cast<LoadInst>(&I)) {
+                        if (Values.count(load->getPointerOperand()) || reachesMemory(load->getPointerOperand())) {
+                            changed |= taint(load);
+                        }
+                    } else if (isa<BinaryOperator>(I) || isa<ICmpInst>(I) || isa<GetElementPtrInst>(I)) {
+                        if (anyOperandTainted(I)) {
+                            changed |= taint(&I);
+                        }
+                    } else if (auto phi = dyn_cast<PHINode>(&I)) {
+                        for (unsigned index = 0; index < phi->getNumIncomingValues(); index++) {
+                            if (Values.count(phi->getIncomingValue(index)) || ControlBlocks.count(phi->getIncomingBlock(index))) {
+                                changed |= taint(phi);
+                            }
+                        }
+                    } else if (auto branch = dyn_cast<BranchInst>(&I)) {
+                        if (branch->isConditional() && Values.count(branch->getCondition())) {
+                            changed |= taintControl(&B);
+                        }
+                    } else if (auto sw = dyn_cast<SwitchInst>(&I)) {
+                        if (Values.count(sw->getCondition())) {
+                            changed |= taintControl(&B);
+                        }
+                    } else if (auto indirect = dyn_cast<IndirectBrInst>(&I)) {
+                        if (Values.count(indirect->getAddress())) {
+                            changed |= taintControl(&B);
+                        }
+                    } else if (auto ret = dyn_cast<ReturnInst>(&I)) {
+                        if (ret->getReturnValue() && Values.count(ret->getReturnValue())) {
+                            changed |= ReturnTainted.insert(&F).second;
+                        }
+                    } else if (auto call = dyn_cast<CallInst>(&I)) {
+                        changed |= visitCall(*call);
+                    }
+                }
+            }
+            return changed;
+        }
+
+        bool visitCall(CallInst &I) {
+            bool changed = false;
+            Function *called = I.getCalledFunction();
+
+            if (called && called->hasExactDefinition()) {
+                unsigned index = 0;
+                for (auto &arg: called->args()) {
+                    if (index < I.getNumArgOperands() && Values.count(I.getArgOperand(index))) {
+                        changed |= taint(&arg);
+                    }
+                    index++;
+                }
+                if (ControlBlocks.count(I.getParent())) {
+                    changed |= EntryTainted.insert(called).second;
+                }
+                if (ReturnTainted.count(called)) {
+                    changed |= taint(&I);
+                }
+            } else if (called == nullptr && !I.isInlineAsm()) {
+                // The callee is one of AddressTaken, whose return is tainted, or a library function.
+                if (!I.getType()->isVoidTy()) {
+                    changed |= taint(&I);
+                }
+            } else if (const PolicyRules *rules = Policy.source(called)) {
+                for (unsigned index = 0; index < I.getNumArgOperands(); index++) {
+                    if (TaintPolicy::coversArg(rules, index)) {
+                        changed |= taintMemory(I.getArgOperand(index));
+                    }
+                }
+                if (TaintPolicy::coversReturn(rules) || anyOperandTainted(I)) {
+                    changed |= taint(&I);
+                }
+            } else if (const RangeModels *models = Policy.models(called)) {
+                for (auto &model: *models) {
+                    if (!model.fits(I)) {
+                        continue;
+                    }
+                    Value *range = I.getArgOperand(model.Dst);
+                    if (model.Kind == RangeModel::Scan) {
+                        if (reachesMemory(range)) {
+                            changed |= taint(&I);
+                        }
+                    } else if (anyOperandTainted(I) || ControlBlocks.count(I.getParent())
+                               || (model.Kind == RangeModel::Copy && reachesMemory(I.getArgOperand(model.Src)))) {
+                        changed |= taintMemory(range);
+                    }
+                }
+                if (anyOperandTainted(I)) {
+                    changed |= taint(&I);
+                }
+            } else if (anyOperandTainted(I)) {
+                changed |= taint(&I);
+            }
+            return changed;
+        }
+
+        bool isRelevant(Value *V) const {
+            return !Sliced || RelevantValues.count(V) != 0;
+        }
+
+        bool isMemoryRelevant(Value *ptr) const {
+            if (!Sliced) {
+                return true;
+            }
+            Value *object = underlyingObject(ptr);
+            if (object == nullptr) {
+                return RelevantUnknown || RelevantEscaped;
+            }
+            return RelevantObjects.count(object) != 0 || (RelevantUnknown && Escaped.count(object) != 0);
+        }
+
+        bool isControlRelevant(Function *F) const {
+            return !Sliced || RelevantControl.count(F) != 0;
+        }
+
+        bool require(Value *V) {
+            return RelevantValues.insert(V).second;
+        }
+
+        bool requireMemory(Value *ptr) {
+            Value *object = underlyingObject(ptr);
+            if (object == nullptr) {
+                bool changed = !RelevantUnknown;
+                RelevantUnknown = true;
+                return changed;
+            }
+            bool changed = RelevantObjects.insert(object).second;
+            if (changed && Escaped.count(object) != 0) {
+                RelevantEscaped = true;
+            }
+            return changed;
+        }
+
+        bool requireOperands(User &U) {
+            bool changed = false;
+            for (auto &operand: U.operands()) {
+                changed |= require(operand.get());
+            }
+            return changed;
+        }
+
+        // Everything whose label the visitor reads to build the label of something in the slice is in the
+        // slice as well. Labels of blocks are read by stores, phis and loads, so those pull in the branches.
+        bool sliceFunction(Function &F) {
+            bool changed = false;
+
+            // Nothing tells which call reaches a function whose address is taken, so all of it is in the slice.
+            if (AddressTaken.count(&F)) {
+                for (auto &arg: F.args()) {
+                    changed |= require(&arg);
+                }
+                changed |= RelevantControl.insert(&F).second;
+                changed |= RelevantReturns.insert(&F).second;
+            }
+
+            for (auto &B: F) {
+                for (auto &I: B) {
+                    if (auto store = dyn_cast<StoreInst>(&I)) {
+                        if (isMemoryRelevant(store->getPointerOperand())) {
+                            changed |= require(store->getValueOperand());
+                            changed |= require(store->getPointerOperand());
+                            changed |= RelevantControl.insert(&F).second;
+                        }
+                    } else if (auto branch = dyn_cast<BranchInst>(&I)) {
+                        if (branch->isConditional() && RelevantControl.count(&F)) {
+                            changed |= require(branch->getCondition());
+                        }
+                    } else if (auto sw = dyn_cast<SwitchInst>(&I)) {
+                        if (RelevantControl.count(&F)) {
+                            changed |= require(sw->getCondition());
+                        }
+                    } else if (auto ret = dyn_cast<ReturnInst>(&I)) {
+                        if (ret->getReturnValue() && RelevantReturns.count(&F)) {
+                            changed |= require(ret->getReturnValue());
+                        }
+                    } else if (auto call = dyn_cast<CallInst>(&I)) {
+                        changed |= sliceCall(*call);
+                    } else if (RelevantValues.count(&I)) {
+                        changed |= RelevantControl.insert(&F).second;
+                        if (auto load = dyn_cast<LoadInst>(&I)) {
+                            changed |= require(load->getPointerOperand());
+                            changed |= requireMemory(load->getPointerOperand());
+                        } else {
+                            changed |= requireOperands(I);
+                        }
+                    }
+                }
+            }
+            return changed;
+        }
+
+        bool sliceCall(CallInst &I) {
+            bool changed = false;
+            Function *called = I.getCalledFunction();
+            Function *caller = I.getFunction();
+
+            if (const PolicyRules *rules = Policy.sink(called)) {
+                for (unsigned index = 0; index < I.getNumArgOperands(); index++) {
+                    if (TaintPolicy::coversArg(rules, index)) {
+                        Value *arg = I.getArgOperand(index);
+                        changed |= require(arg);
+                        if (arg->getType()->isPointerTy()) {
+                            changed |= requireMemory(arg);
+                        }
+                    }
+                }
+                changed |= RelevantControl.insert(caller).second;
+            }
+
+            if (called && called->hasExactDefinition()) {
+                for (auto &arg: called->args()) {
+                    if (arg.getArgNo() < I.getNumArgOperands() && RelevantValues.count(&arg)) {
+                        changed |= require(I.getArgOperand(arg.getArgNo()));
+                    }
+                }
+                if (RelevantControl.count(called)) {
+                    changed |= RelevantControl.insert(caller).second;
+                }
+                if (RelevantValues.count(&I)) {
+                    changed |= RelevantReturns.insert(called).second;
+                }
+            } else if (called == nullptr && !I.isInlineAsm()) {
+                if (!AddressTaken.empty()) {
+                    changed |= requireOperands(I);
+                    changed |= RelevantControl.insert(caller).second;
+                } else if (RelevantValues.count(&I)) {
+                    changed |= requireOperands(I);
+                }
+            } else if (const PolicyRules *rules = Policy.source(called)) {
+                // The address a source writes through taints what it writes.
+                for (unsigned index = 0; index < I.getNumArgOperands(); index++) {
+                    if (TaintPolicy::coversArg(rules, index) && isMemoryRelevant(I.getArgOperand(index))) {
+                        changed |= require(I.getArgOperand(index));
+                    }
+                }
+                if (RelevantValues.count(&I) && !TaintPolicy::coversReturn(rules)) {
+                    changed |= requireOperands(I);
+                }
+            } else if (const RangeModels *models = Policy.models(called)) {
+                for (auto &model: *models) {
+                    if (!model.fits(I)) {
+                        continue;
+                    }
+                    Value *range = I.getArgOperand(model.Dst);
+                    if (model.Kind == RangeModel::Scan) {
+                        if (RelevantValues.count(&I)) {
+                            changed |= requireMemory(range);
+                        }
+                    } else if (isMemoryRelevant(range)) {
+                        changed |= requireOperands(I);
+                        changed |= RelevantControl.insert(caller).second;
+                        if (model.Kind == RangeModel::Copy) {
+                            changed |= requireMemory(I.getArgOperand(model.Src));
+                        }
+                    }
+                }
+                if (RelevantValues.count(&I)) {
+                    changed |= requireOperands(I);
+                }
+            } else if (RelevantValues.count(&I)) {
+                changed |= requireOperands(I);
+            }
+            return changed;
+        }
+    };
+
+    TaintReachability Reachability;
 
     struct TaintTrackingPass : public ModulePass {
         static char ID;
@@ -80,166 +1087,174 @@ namespace {
 
         struct TaintTrackingVisitor: InstVisitor<TaintTrackingVisitor> {
 
-            TaintTrackingVisitor() {}
+            FunctionState &S;
+
+            explicit TaintTrackingVisitor(FunctionState &S): S(S) {}
+
+            // Count an instrumentation site and tell whether it can be skipped.
+            bool prune(bool tainted) {
+                NumOfSites++;
+                if (!ClPrune || tainted) {
+                    return false;
+                }
+                NumOfPrunedSites++;
+                return true;
+            }
 
             // Store will change the state of the program.
             void visitStoreInst(StoreInst &I) {
-                auto reg_iter1 = TmpToLabelMap.find(I.getValueOperand());
-                auto reg_iter2 = TmpToLabelMap.find(I.getPointerOperand());
+                // Nothing tainted is ever stored to this memory, so its label stays empty.
+                if (prune(Reachability.isMemoryTainted(I.getPointerOperand()))) {
+                    return;
+                }
+
+                if (ClShadowMemory) {
+                    visitStoreShadow(I);
+                    return;
+                }
+
+                auto reg_iter1 = S.TmpToLabelMap.find(I.getValueOperand());
+                auto reg_iter2 = S.TmpToLabelMap.find(I.getPointerOperand());
 
                 insertAddrTaint(I.getPointerOperand());
+                useGlobalLabel(I.getPointerOperand());
 
-                Instruction *insert_point = (curBBInfo_ptr->branches->size() == 0)? &I: curBBInfo_ptr->ancestor;
+                Instruction *insert_point = insertPoint(I);
 
-                if (reg_iter1 == TmpToLabelMap.end() && reg_iter2 == TmpToLabelMap.end()) {
-                    auto mem_iter = MemToLabelAddrMap.find(I.getPointerOperand());
-                    if (mem_iter == MemToLabelAddrMap.end()) {
-                        MemToLabelAddrMap[I.getPointerOperand()] = alocaAndStoreLabel(curBBInfo_ptr->label,
+                if (reg_iter1 == S.TmpToLabelMap.end() && reg_iter2 == S.TmpToLabelMap.end()) {
+                    auto mem_iter = S.MemToLabelAddrMap.find(I.getPointerOperand());
+                    if (mem_iter == S.MemToLabelAddrMap.end()) {
+                        S.MemToLabelAddrMap[I.getPointerOperand()] = alocaAndStoreLabel(S.curBBInfo_ptr->label,
                                                                                       insert_point);
                     }
                     return;
                 }
 
-                Value* label = curBBInfo_ptr->label;
-                if (reg_iter1 != TmpToLabelMap.end() && reg_iter2 != TmpToLabelMap.end()) {
+                Value* label = S.curBBInfo_ptr->label;
+                if (reg_iter1 != S.TmpToLabelMap.end() && reg_iter2 != S.TmpToLabelMap.end()) {
                     label = union_taint(label, reg_iter1->second, &I);
                     label = union_taint(label, reg_iter2->second, &I);
-                } else if (reg_iter1 != TmpToLabelMap.end()) {
+                } else if (reg_iter1 != S.TmpToLabelMap.end()) {
                     label = union_taint(label, reg_iter1->second, &I);
                 } else {
                     label = union_taint(label, reg_iter2->second, &I);
                 }
 
-                auto mem_iter = MemToLabelAddrMap.find(I.getPointerOperand());
-                if (mem_iter != MemToLabelAddrMap.end()) {
+                auto mem_iter = S.MemToLabelAddrMap.find(I.getPointerOperand());
+                if (mem_iter != S.MemToLabelAddrMap.end()) {
                     storeLabel(label, mem_iter->second, &I);
                 } else {
-                    MemToLabelAddrMap[I.getPointerOperand()] = alocaAndStoreLabel(label, &I);
+                    S.MemToLabelAddrMap[I.getPointerOperand()] = alocaAndStoreLabel(label, &I);
                 }
             }
 
-            void insertAddrTaint(Value* addr) {
-                auto bbinfos_iter = AddrToBBInfosMap.find(addr);
+            // With shadow memory the label always goes to wherever the pointer points at run time,
+            // so aliasing pointers and pointers computed at run time resolve to the same slot.
+            void visitStoreShadow(StoreInst &I) {
+                insertAddrTaint(I.getPointerOperand());
 
-                if (curBBInfo_ptr->branches->size() == 0) {
-                    // in main path
-                    if (bbinfos_iter == AddrToBBInfosMap.end()) {
-                        return;
-                    } else {
-                        bbinfos_iter->second->clear();
-                        return;
-                    }
-                } else {
-                    // No record.
-                    if (bbinfos_iter == AddrToBBInfosMap.end()) {
-                        std::vector<BBInfo *> *bbinfos_vec = new std::vector<BBInfo *>;
-                        bbinfos_vec->push_back(curBBInfo_ptr);
-                        AddrToBBInfosMap[addr] = bbinfos_vec;
-                    } else if (bbinfos_iter->second->size() == 0) {
-                        bbinfos_iter->second->push_back(curBBInfo_ptr);
-                    } else {
-                        BBInfo *lastbbinfo_ptr = bbinfos_iter->second->back();
-                        if (lastbbinfo_ptr->ancestor == curBBInfo_ptr->ancestor) {
-
-                            if (lastbbinfo_ptr->branches->size() < curBBInfo_ptr->branches->size()) {
-                                if (isEmbeded(curBBInfo_ptr->branches, lastbbinfo_ptr->branches)) {
-                                    bbinfos_iter->second->pop_back();
-                                }
-                                bbinfos_iter->second->push_back(curBBInfo_ptr);
-                            } else if (lastbbinfo_ptr->branches->size() > curBBInfo_ptr->branches->size()) {
-                                if (isEmbeded(lastbbinfo_ptr->branches, curBBInfo_ptr->branches)) {
-                                    bbinfos_iter->second->pop_back();
-                                }
-                                bbinfos_iter->second->push_back(curBBInfo_ptr);
-                            } else {
-                                uint8_t lasttemp = lastbbinfo_ptr->branches->back();
-                                uint8_t curtemp = curBBInfo_ptr->branches->back();
-                                lastbbinfo_ptr->branches->pop_back();
-                                curBBInfo_ptr->branches->pop_back();
+                Value* label = labelAt(S.curBBInfo_ptr, &I);
+                auto reg_iter1 = S.TmpToLabelMap.find(I.getValueOperand());
+                if (reg_iter1 != S.TmpToLabelMap.end()) {
+                    label = union_taint(label, reg_iter1->second, &I);
+                }
+                auto reg_iter2 = S.TmpToLabelMap.find(I.getPointerOperand());
+                if (reg_iter2 != S.TmpToLabelMap.end()) {
+                    label = union_taint(label, reg_iter2->second, &I);
+                }
 
-                                if (!isEmbeded(lastbbinfo_ptr->branches, curBBInfo_ptr->branches)) {
-                                    bbinfos_iter->second->push_back(curBBInfo_ptr);
-                                }
+                storeShadow(label, I.getPointerOperand(), I.getValueOperand()->getType(), &I);
+            }
 
-                                lastbbinfo_ptr->branches->push_back(lasttemp);
-                                curBBInfo_ptr->branches->push_back(curtemp);
-                            }
-                        } else { // Different ancestor
-                            bbinfos_iter->second->push_back(curBBInfo_ptr);
-                        }
-                    }
+            // A global variable keeps its label in its own global, so every function sees the same one.
+            void useGlobalLabel(Value* addr) {
+                auto global = dyn_cast<GlobalVariable>(addr);
+                if (global == nullptr || S.MemToLabelAddrMap.count(addr) != 0) {
+                    return;
+                }
+                auto label_iter = GlobalToLabelMap.find(global);
+                if (label_iter != GlobalToLabelMap.end()) {
+                    S.MemToLabelAddrMap[addr] = label_iter->second;
                 }
             }
 
-            bool isEmbeded(DirPtr LongVec, DirPtr ShortVec) {
-                unsigned int num = ShortVec->size();
-                for (unsigned int index = 0; index < num; index++) {
-                    if (LongVec->at(index) != ShortVec->at(index)) {
-                        return false;
+            // Memory written in a block that only some branches let run keeps the labels of those branches, so a
+            // load after they join sees them whether the store ran or not. A store that runs whenever the function
+            // does starts over.
+            void insertAddrTaint(Value* addr) {
+                auto controllers_iter = S.Controllers.find(S.curBB);
+                if (controllers_iter == S.Controllers.end()) {
+                    S.AddrToBBInfosMap.erase(addr);
+                    return;
+                }
+
+                std::vector<BBInfo*> &bbinfos = S.AddrToBBInfosMap[addr];
+                for (auto controller: controllers_iter->second) {
+                    BBInfo *bbinfo = branchInfo(controller);
+                    if (std::find(bbinfos.begin(), bbinfos.end(), bbinfo) == bbinfos.end()) {
+                        bbinfos.push_back(bbinfo);
                     }
                 }
-                return true;
             }
 
             // x = a[i] means the register is tainted by the pointer a and index i.
             // And we also need to check if the address is tainted in loop.
             void visitLoadInst(LoadInst &I) {
-                auto addr_iter = MemToLabelAddrMap.find(I.getPointerOperand());
-                auto reg_iter = TmpToLabelMap.find(I.getPointerOperand());
-                auto bbinfos_iter = AddrToBBInfosMap.find(I.getPointerOperand());
-                Instruction *insert_point = (curBBInfo_ptr->branches->size() == 0)? &I: curBBInfo_ptr->ancestor;
-
-                if (addr_iter == MemToLabelAddrMap.end() && reg_iter == TmpToLabelMap.end()) {
-                    if (bbinfos_iter == AddrToBBInfosMap.end()) {
-                        return;
-                    }
-                    std::vector<BBInfo*>* bbinfos_ptr = bbinfos_iter->second;
-                    if (bbinfos_ptr->size() == 0) {
-                        return;
-                    } else if (bbinfos_ptr->size() == 1){
-                        TmpToLabelMap[&I] = bbinfos_ptr->back()->label;
-                        return;
-                    } else {
-                        Value* label = bbinfos_ptr->front()->label;
-                        auto vec_iter = bbinfos_ptr->begin();
-                        vec_iter++;
-                        for ( ; vec_iter != bbinfos_ptr->end(); vec_iter++) {
-                            label = union_taint(label, (*vec_iter)->label, insert_point);
-                        }
-                        TmpToLabelMap[&I] = label;
-                        return;
-                    }
+                if (prune(Reachability.isTainted(&I))) {
+                    return;
                 }
 
-                Value* label;
-                if (addr_iter != MemToLabelAddrMap.end() && reg_iter != TmpToLabelMap.end()) {
+                if (ClShadowMemory) {
+                    visitLoadShadow(I);
+                    return;
+                }
+
+                useGlobalLabel(I.getPointerOperand());
+                auto addr_iter = S.MemToLabelAddrMap.find(I.getPointerOperand());
+                auto reg_iter = S.TmpToLabelMap.find(I.getPointerOperand());
+                auto bbinfos_iter = S.AddrToBBInfosMap.find(I.getPointerOperand());
+                Instruction *insert_point = insertPoint(I);
+
+                if (addr_iter == S.MemToLabelAddrMap.end() && reg_iter == S.TmpToLabelMap.end()
+                    && bbinfos_iter == S.AddrToBBInfosMap.end()) {
+                    return;
+                }
+
+                Value* label = zero;
+                if (addr_iter != S.MemToLabelAddrMap.end() && reg_iter != S.TmpToLabelMap.end()) {
                     label = loadLabel(addr_iter->second, insert_point);
                     label = union_taint(label, reg_iter->second, insert_point);
-                } else if (addr_iter != MemToLabelAddrMap.end()) {
+                } else if (addr_iter != S.MemToLabelAddrMap.end()) {
                     label = loadLabel(addr_iter->second, insert_point);
-                } else {
+                } else if (reg_iter != S.TmpToLabelMap.end()) {
                     label = reg_iter->second;
                 }
 
-                if (bbinfos_iter == AddrToBBInfosMap.end()) {
-                    TmpToLabelMap[&I] = label;
-                    return;
+                if (bbinfos_iter != S.AddrToBBInfosMap.end()) {
+                    for (auto bbinfo: bbinfos_iter->second) {
+                        label = union_taint(label, labelAt(bbinfo, insert_point), insert_point);
+                    }
                 }
+                S.TmpToLabelMap[&I] = label;
+            }
 
-                std::vector<BBInfo*>* bbinfos_ptr = bbinfos_iter->second;
-                if (bbinfos_ptr->size() == 0) {
-                    TmpToLabelMap[&I] = label;
-                    return;
-                } else if (bbinfos_ptr->size() == 1){
-                    TmpToLabelMap[&I] = union_taint(label, bbinfos_ptr->front()->label, insert_point);
-                    return;
-                } else {
-                    for ( auto vec_iter = bbinfos_ptr->begin(); vec_iter != bbinfos_ptr->end(); vec_iter++) {
-                        label = union_taint(label, (*vec_iter)->label, insert_point);
+            void visitLoadShadow(LoadInst &I) {
+                Value* label = loadShadow(I.getPointerOperand(), I.getType(), &I);
+
+                auto reg_iter = S.TmpToLabelMap.find(I.getPointerOperand());
+                if (reg_iter != S.TmpToLabelMap.end()) {
+                    label = union_taint(label, reg_iter->second, &I);
+                }
+
+                // Stores under a branch that did not run still taint the value (implicit flow).
+                auto bbinfos_iter = S.AddrToBBInfosMap.find(I.getPointerOperand());
+                if (bbinfos_iter != S.AddrToBBInfosMap.end()) {
+                    for (auto bbinfo: bbinfos_iter->second) {
+                        label = union_taint(label, labelAt(bbinfo, &I), &I);
                     }
-                    TmpToLabelMap[&I] = label;
-                    return;
                 }
+
+                S.TmpToLabelMap[&I] = label;
             }
 
             // TODO: pass taint label of callee basic block
@@ -249,75 +1264,345 @@ namespace {
                 Function* called = I.getCalledFunction();
                 unsigned int total = I.getNumArgOperands();
 
-                // For defined function, we have the chance to track the taint of return value.
-                if (called->hasExactDefinition()) {
-                    storeLabel(curBBInfo_ptr->label, FcnToBBLabelMap.find(called)->second, &I);
+                if (const PolicyRules *rules = Policy.sink(called)) {
+                    checkSink(I, rules);
+                }
 
-                    std::vector<GlobalVariable*>* argsTaint = FcnToArgsTaintsMap[called];
-                    for (unsigned int index = 0; index < total; index++) {
-                        auto reg_iter = TmpToLabelMap.find(I.getArgOperand(index));
-                        if (reg_iter != TmpToLabelMap.end()) {
-                            storeLabel(reg_iter->second, argsTaint->at(index), &I);
-                        } else {
-                            storeLabel(zero, argsTaint->at(index), &I);
-                        }
+                // For defined function, we have the chance to track the taint of return value.
+                // Slots the callee never reads tainted are left alone. Inline asm has no callee to ask and is
+                // treated like a library function.
+                if (called && called->hasExactDefinition()) {
+                    if (!prune(Reachability.isEntryTainted(called))) {
+                        storeLabel(labelAt(S.curBBInfo_ptr, &I), EntryLabel, &I);
                     }
+                    storeArgLabels(I, called);
 
-                    if (called->getReturnType() != void_type) {
+                    if (called->getReturnType() != void_type && !prune(Reachability.isReturnTainted(called))) {
                         IRBuilder<> builder(&I);
                         builder.SetInsertPoint(I.getParent(), ++builder.GetInsertPoint());
-                        GlobalVariable *RtnTaint = FcnToRtnTaintMap[called];
-                        Value *label = builder.CreateLoad(int32_type, RtnTaint);
-                        TmpToLabelMap[&I] = label;
+                        Value *label = builder.CreateLoad(label_type, ReturnLabel);
+                        S.TmpToLabelMap[&I] = label;
                     }
 
-                } else if (called->getName() == "__isoc99_scanf") {
-                    Instruction *insert_point = (curBBInfo_ptr->branches->size() == 0)? &I: curBBInfo_ptr->ancestor;
+                } else if (called == nullptr && !I.isInlineAsm()) {
+                    visitIndirectCall(I);
 
-                    // TODO: consider the scanf is in branch
+                } else if (const PolicyRules *rules = Policy.source(called)) {
+                    Instruction *insert_point = insertPoint(I);
+
+                    // TODO: consider the source is in branch
                     // a[i] = x means the memory block is both tainted by the i and x.
-                    for (unsigned int index = 1; index < total; index++) {
-                        Value *label = insert_taint(insert_point);
+                    // Every source keeps its id, even where nothing it taints reaches a sink.
+                    for (unsigned int index = 0; index < total; index++) {
+                        const PolicyRule *rule = TaintPolicy::coveringRule(rules, index);
+                        if (rule == nullptr) {
+                            continue;
+                        }
                         Value *addr = I.getArgOperand(index);
-                        auto reg_iter = TmpToLabelMap.find(addr);
-                        if (reg_iter != TmpToLabelMap.end()) {
+                        Value *label = insert_taint(insert_point);
+                        if (prune(Reachability.isMemoryTainted(addr))) {
+                            continue;
+                        }
+                        auto reg_iter = S.TmpToLabelMap.find(addr);
+                        if (reg_iter != S.TmpToLabelMap.end()) {
                             label = union_taint(label, reg_iter->second, insert_point);
                         }
-                        auto mem_iter = MemToLabelAddrMap.find(addr);
-                        if (mem_iter != MemToLabelAddrMap.end()) {
-                            storeLabel(label, mem_iter->second, insert_point);
-                        } else {
-                            MemToLabelAddrMap[addr] = alocaAndStoreLabel(label, insert_point);
+
+                        // The label must land after the source has written the value, on every byte it wrote.
+                        if (ClShadowMemory) {
+                            if (rule->Size.Len != kNoArg && rule->Size.fits(I)) {
+                                IRBuilder<> builder(I.getNextNode());
+                                Value* shadow_fill_args[] = {builder.CreatePtrToInt(addr, int64_type),
+                                                             rangeSize(I, rule->Size, builder), label};
+                                builder.CreateCall(shadow_fill, shadow_fill_args);
+                            } else {
+                                storeShadow(label, addr, addr->getType()->getPointerElementType(), I.getNextNode());
+                            }
+                            insertAddrTaint(addr);
+                            continue;
                         }
 
-                        insertAddrTaint(addr);
+                        setMemoryLabel(addr, label, insert_point);
                     }
 
-                } else {
-                    // For extern function, just assume the returned value is Or'ed by all of the function arguments.
-                    Instruction *insert_point = (curBBInfo_ptr->branches->size() == 0)? &I: curBBInfo_ptr->ancestor;
-                    if (called->getReturnType() != void_type) {
-
-                        bool hasTaint = false;
-                        Value *temp;
-
-                        for (unsigned int index = 0; index < total; index++) {
-                            auto reg_iter = TmpToLabelMap.find(I.getArgOperand(index));
-                            if (reg_iter != TmpToLabelMap.end()) {
-                                if (hasTaint) {
-                                    temp = union_taint(temp, reg_iter->second, insert_point);
-                                } else {
-                                    temp = reg_iter->second;
-                                    hasTaint = true;
-                                }
-                            }
+                    if (TaintPolicy::coversReturn(rules)) {
+                        Value *label = insert_taint(insert_point);
+                        if (!prune(Reachability.isTainted(&I))) {
+                            S.TmpToLabelMap[&I] = label;
                         }
+                    } else {
+                        visitExternReturn(I);
+                    }
+
+                } else if (const RangeModels *models = Policy.models(called)) {
+                    for (auto &model: *models) {
+                        if (model.Kind != RangeModel::Scan && model.fits(I)) {
+                            writeRange(I, model);
+                        }
+                    }
+                    visitExternReturn(I, models);
+
+                } else {
+                    visitExternReturn(I);
+                }
+            }
+
+            // The argument labels of a call, in the slots the callee reads them from. Without a callee every slot
+            // is filled, since any function whose address is taken may be the one that runs.
+            void storeArgLabels(CallInst &I, Function *called) {
+                Value *shared = nullptr;
+                for (unsigned int index = 0; index < I.getNumArgOperands(); index++) {
+                    if (called && prune(Reachability.isArgTainted(called, index))) {
+                        continue;
+                    }
+                    Value *label = zero;
+                    auto reg_iter = S.TmpToLabelMap.find(I.getArgOperand(index));
+                    if (reg_iter != S.TmpToLabelMap.end()) {
+                        label = reg_iter->second;
+                    }
+                    if (index < kArgSlots - 1) {
+                        storeLabel(label, argLabelSlot(index), &I);
+                    } else {
+                        shared = shared ? union_taint(shared, label, &I) : label;
+                    }
+                }
+                if (shared) {
+                    storeLabel(shared, argLabelSlot(kArgSlots - 1), &I);
+                }
+            }
+
+            // A call through a pointer runs a function whose address is taken, which reads its labels from the
+            // slots like any callee, or a library function, which does not. So the slots are filled as for a
+            // direct call, and the result has the label in the return slot as well as those of the arguments and
+            // of the pointer, as after a library function. After a library function the return slot still holds
+            // the label of an earlier call, which can only add taint.
+            void visitIndirectCall(CallInst &I) {
+                storeLabel(labelAt(S.curBBInfo_ptr, &I), EntryLabel, &I);
+                storeArgLabels(I, nullptr);
+                if (I.getType() == void_type || prune(Reachability.isTainted(&I))) {
+                    return;
+                }
+
+                visitExternReturn(I);
+                IRBuilder<> builder(&I);
+                builder.SetInsertPoint(I.getParent(), ++builder.GetInsertPoint());
+                Value *label = builder.CreateLoad(label_type, ReturnLabel);
+                auto reg_iter = S.TmpToLabelMap.find(I.getCalledValue());
+                if (reg_iter != S.TmpToLabelMap.end()) {
+                    label = union_taint(label, reg_iter->second, &*builder.GetInsertPoint());
+                }
+                reg_iter = S.TmpToLabelMap.find(&I);
+                if (reg_iter != S.TmpToLabelMap.end()) {
+                    label = union_taint(label, reg_iter->second, &*builder.GetInsertPoint());
+                }
+                S.TmpToLabelMap[&I] = label;
+            }
+
+            // A modelled library function writes a whole range at once. The range takes the labels of every
+            // argument and of the block, and for a copy those of the range it copies from. With shadow memory
+            // the runtime copies or fills the shadow of the range in one go, right after the call.
+            void writeRange(CallInst &I, const RangeModel &model) {
+                Value *range = I.getArgOperand(model.Dst);
+                if (prune(Reachability.isMemoryTainted(range))) {
+                    return;
+                }
+
+                Value *label = labelAt(S.curBBInfo_ptr, &I);
+                for (unsigned int index = 0; index < I.getNumArgOperands(); index++) {
+                    auto reg_iter = S.TmpToLabelMap.find(I.getArgOperand(index));
+                    if (reg_iter != S.TmpToLabelMap.end()) {
+                        label = union_taint(label, reg_iter->second, &I);
+                    }
+                }
+
+                if (!ClShadowMemory) {
+                    if (model.Kind == RangeModel::Copy) {
+                        label = union_taint(label, pointeeLabel(I.getArgOperand(model.Src), &I), &I);
+                    }
+                    setMemoryLabel(range, label, &I);
+                    return;
+                }
 
+                insertAddrTaint(range);
+                IRBuilder<> builder(I.getNextNode());
+                Value *addr = builder.CreatePtrToInt(range, int64_type);
+                Value *size = rangeSize(I, model.Size, builder);
+                if (model.Kind == RangeModel::Fill) {
+                    Value* shadow_fill_args[] = {addr, size, label};
+                    builder.CreateCall(shadow_fill, shadow_fill_args);
+                    return;
+                }
+
+                Value* shadow_copy_args[] = {addr, builder.CreatePtrToInt(I.getArgOperand(model.Src), int64_type), size};
+                builder.CreateCall(shadow_copy, shadow_copy_args);
+                if (label != zero) {
+                    Value* shadow_union_range_args[] = {addr, size, label, S.nodes_ptr, S.root_ptr};
+                    builder.CreateCall(shadow_union_range, shadow_union_range_args);
+                }
+            }
+
+            // The union of the labels of a range a modelled function reads.
+            Value* rangeLabel(CallInst &I, const RangeModel &model) {
+                Value *range = I.getArgOperand(model.Dst);
+                if (!ClShadowMemory) {
+                    return pointeeLabel(range, &I);
+                }
+                IRBuilder<> builder(&I);
+                Value* shadow_range_label_args[] = {builder.CreatePtrToInt(range, int64_type),
+                                                    rangeSize(I, model.Size, builder), S.nodes_ptr, S.root_ptr};
+                return builder.CreateCall(shadow_range_label, shadow_range_label_args);
+            }
+
+            // The byte count of a range as an i64; all ones tells the runtime to measure the C string there.
+            Value* rangeSize(CallInst &I, Extent size, IRBuilder<> &builder) {
+                if (size.Len == kString) {
+                    return ConstantInt::get(int64_type, -1);
+                }
+                Value *len = builder.CreateZExtOrTrunc(I.getArgOperand(size.Len), int64_type);
+                if (size.Scale != kNoArg) {
+                    len = builder.CreateMul(len, builder.CreateZExtOrTrunc(I.getArgOperand(size.Scale), int64_type));
+                }
+                return len;
+            }
+
+            // Gives the memory addr points at a new label, the way a store through addr would.
+            void setMemoryLabel(Value *addr, Value *label, Instruction *I) {
+                useGlobalLabel(addr);
+                auto mem_iter = S.MemToLabelAddrMap.find(addr);
+                if (mem_iter != S.MemToLabelAddrMap.end()) {
+                    storeLabel(label, mem_iter->second, I);
+                } else {
+                    S.MemToLabelAddrMap[addr] = alocaAndStoreLabel(label, I);
+                }
+
+                insertAddrTaint(addr);
+            }
+
+            // For extern function, just assume the returned value is Or'ed by all of the function arguments,
+            // and by the ranges its models scan.
+            void visitExternReturn(CallInst &I, const RangeModels *models = nullptr) {
+                unsigned int total = I.getNumArgOperands();
+                Instruction *insert_point = insertPoint(I);
+                if (I.getType() == void_type || prune(Reachability.isTainted(&I))) {
+                    return;
+                }
+
+                bool hasTaint = false;
+                Value *temp;
+
+                for (unsigned int index = 0; index < total; index++) {
+                    auto reg_iter = S.TmpToLabelMap.find(I.getArgOperand(index));
+                    if (reg_iter != S.TmpToLabelMap.end()) {
                         if (hasTaint) {
-                            TmpToLabelMap[&I] = temp;
+                            temp = union_taint(temp, reg_iter->second, insert_point);
+                        } else {
+                            temp = reg_iter->second;
+                            hasTaint = true;
                         }
                     }
                 }
+
+                if (models != nullptr) {
+                    for (auto &model: *models) {
+                        if (model.Kind != RangeModel::Scan || !model.fits(I)
+                            || !Reachability.isMemoryTainted(I.getArgOperand(model.Dst))) {
+                            continue;
+                        }
+                        Value *label = rangeLabel(I, model);
+                        temp = hasTaint ? union_taint(temp, label, &I) : label;
+                        hasTaint = true;
+                    }
+                }
+
+                if (hasTaint) {
+                    S.TmpToLabelMap[&I] = temp;
+                }
+            }
+
+            // Right before a sink runs, the label of every argument it checks goes to the taint trace, unless it
+            // is empty. A pointer argument carries the label of what it points to as well, and every argument
+            // carries the label of the block making the call. Whether the label is empty is tested inline, label 0
+            // being the only empty one in the table, so an untainted argument costs a compare and a branch.
+            void checkSink(CallInst &I, const PolicyRules *rules) {
+                Constant *site = ConstantInt::get(int32_type, NumOfSinks++);
+                Constant *action = ConstantInt::get(int32_type, ClSinkAction);
+                for (unsigned int index = 0; index < I.getNumArgOperands(); index++) {
+                    if (!TaintPolicy::coversArg(rules, index)) {
+                        continue;
+                    }
+                    Value *arg = I.getArgOperand(index);
+                    bool pointer = arg->getType()->isPointerTy();
+                    if (prune(Reachability.isTainted(arg) || (pointer && Reachability.isMemoryTainted(arg))
+                              || Reachability.isControlTainted(I.getParent()))) {
+                        continue;
+                    }
+
+                    Value *label = labelAt(S.curBBInfo_ptr, &I);
+                    auto reg_iter = S.TmpToLabelMap.find(arg);
+                    if (reg_iter != S.TmpToLabelMap.end()) {
+                        label = union_taint(label, reg_iter->second, &I);
+                    }
+                    if (pointer) {
+                        label = union_taint(label, pointeeLabel(arg, &I), &I);
+                    }
+                    if (isa<Constant>(label) && cast<Constant>(label)->isNullValue()) {
+                        continue;
+                    }
+
+                    IRBuilder<> builder(&I);
+                    auto name_iter = SinkNames.find(I.getCalledFunction());
+                    if (name_iter == SinkNames.end()) {
+                        Value *name = builder.CreateGlobalStringPtr(I.getCalledFunction()->getName());
+                        name_iter = SinkNames.insert(std::make_pair(I.getCalledFunction(), name)).first;
+                    }
+                    Constant *argument = ConstantInt::get(int32_type, index);
+                    Value *tainted;
+                    CallInst *check;
+                    if (!LabelWords) {
+                        tainted = builder.CreateICmpNE(label, zero);
+                        Value* sink_check_args[] = {name_iter->second, site, argument, label, action};
+                        check = builder.CreateCall(sink_check, sink_check_args);
+                    } else {
+                        std::vector<Value*> words = labelWords(label, builder);
+                        Value *any = words[0];
+                        for (unsigned word = 1; word < LabelWords; word++) {
+                            any = builder.CreateOr(any, words[word]);
+                        }
+                        tainted = builder.CreateICmpNE(any, ConstantInt::get(int64_type, 0));
+                        Value* sink_check_set_args[] = {name_iter->second, site, argument, ConstantInt::get(int32_type, LabelWords),
+                                                        words[0], words[1], words[2], words[3], action};
+                        check = builder.CreateCall(sink_check_set, sink_check_set_args);
+                    }
+                    if (!isa<Constant>(tainted)) {
+                        S.SinkChecks.push_back(std::make_pair(tainted, check));
+                    }
+                }
+            }
+
+            // The label of the memory addr points at, as a load through it would see it.
+            Value* pointeeLabel(Value *addr, Instruction *I) {
+                if (ClShadowMemory) {
+                    Type *ty = addr->getType()->getPointerElementType();
+                    return ty->isSized() ? loadShadow(addr, ty, I) : zero;
+                }
+                useGlobalLabel(addr);
+                auto mem_iter = S.MemToLabelAddrMap.find(addr);
+                return mem_iter == S.MemToLabelAddrMap.end() ? zero : loadLabel(mem_iter->second, I);
+            }
+
+            // A fixed-width label as the four 64-bit words the runtime takes by value, zero past LabelWords.
+            std::vector<Value*> labelWords(Value *label, IRBuilder<> &builder) {
+                std::vector<Value*> words(4, ConstantInt::get(int64_type, 0));
+                for (unsigned index = 0; index < LabelWords; index++) {
+                    if (LabelWords == 1) {
+                        words[index] = label;
+                    } else if (LabelWords == 2) {
+                        words[index] = builder.CreateTrunc(builder.CreateLShr(label, index * 64), int64_type);
+                    } else {
+                        words[index] = builder.CreateExtractElement(label, index);
+                    }
+                }
+                return words;
             }
 
             void visitReturnInst(ReturnInst &I) {
@@ -325,22 +1610,21 @@ namespace {
                 // TODO: print out taints of all the blocks
                 if (callee->getName() == "main") {
 //                    Constant* totalNum = ConstantInt::get(int32_type, NumOfTaints);
-//                    for (auto bbinfo_iter = BBToBBInfoMap.begin(); bbinfo_iter != BBToBBInfoMap.end(); bbinfo_iter++) {
+//                    for (auto bbinfo_iter = S.BBToBBInfoMap.begin(); bbinfo_iter != S.BBToBBInfoMap.end(); bbinfo_iter++) {
 //                        IRBuilder<> builder(&I);
-//                        Value* bitvec_print_args[] = {nodes_ptr, bbinfo_iter->second->label, totalNum};
+//                        Value* bitvec_print_args[] = {S.nodes_ptr, bbinfo_iter->second->label, totalNum};
 //                        builder.CreateCall(bitvec_print, bitvec_print_args);
 //                    }
                 } else {
                     // TODO: need to union the old label and new label and store the label.
-                    if (callee->getReturnType() != void_type) {
+                    if (callee->getReturnType() != void_type && !prune(Reachability.isReturnTainted(callee))) {
                         IRBuilder<> builder(&I);
-                        GlobalVariable *RtnTaint = FcnToRtnTaintMap[callee];
 
-                        auto reg_iter = TmpToLabelMap.find(I.getReturnValue());
-                        if (reg_iter != TmpToLabelMap.end()) {
-                            builder.CreateStore(reg_iter->second, RtnTaint);
+                        auto reg_iter = S.TmpToLabelMap.find(I.getReturnValue());
+                        if (reg_iter != S.TmpToLabelMap.end()) {
+                            builder.CreateStore(reg_iter->second, ReturnLabel);
                         } else {
-                            builder.CreateStore(ConstantInt::get(int32_type, 0), RtnTaint);
+                            builder.CreateStore(zero, ReturnLabel);
                         }
                     }
                 }
@@ -351,19 +1635,23 @@ namespace {
             // a + i = a + j
             // But commom things faster and first
             void visitGetElementPtrInst(GetElementPtrInst &I) {
+                if (prune(Reachability.isTainted(&I))) {
+                    return;
+                }
+
                 bool hasTaint = false;
                 Value *temp;
 
-                auto reg_iter = TmpToLabelMap.find(I.getPointerOperand());
-                if (reg_iter != TmpToLabelMap.end()) {
+                auto reg_iter = S.TmpToLabelMap.find(I.getPointerOperand());
+                if (reg_iter != S.TmpToLabelMap.end()) {
                     temp = reg_iter->second;
                     hasTaint = true;
                 }
 
-                Instruction* insert_point = (curBBInfo_ptr->branches->size() == 0)? &I: curBBInfo_ptr->ancestor;
+                Instruction* insert_point = insertPoint(I);
                 for (auto index = I.idx_begin(); index != I.idx_end(); index++) {
-                    reg_iter = TmpToLabelMap.find((Value*) *index);
-                    if (reg_iter != TmpToLabelMap.end()) {
+                    reg_iter = S.TmpToLabelMap.find((Value*) *index);
+                    if (reg_iter != S.TmpToLabelMap.end()) {
                         if (hasTaint) {
                             temp = union_taint(temp, reg_iter->second, insert_point);
                         } else {
@@ -374,71 +1662,111 @@ namespace {
                 }
 
                 if (hasTaint) {
-                    TmpToLabelMap[&I] = temp;
+                    S.TmpToLabelMap[&I] = temp;
                 }
 
             }
 
-            // The BranchAnalysis is not very accurate so far
-            // TODO: add commands to analyze loop.
+            // A branch or switch decides which blocks run, so they run under the label of the block it ends joined
+            // with the label of its condition. Which blocks those are comes from the control dependences computed
+            // with the function's analyses; see blockInfo.
             void visitBranchInst(BranchInst &I) {
-                if (I.isUnconditional()) {
-                    BasicBlock *successor = I.getSuccessor(0);
-                    auto iter = BBToBBInfoMap.find(successor);
-
-                    // If not in the map, the taint is equal to the taint of n-1 level.
-                    // TODO: double check if it's a loop.
-                    // Since loop also has a unconditional branch jumping to it.
-                    if (iter == BBToBBInfoMap.end()) {
-                        if (NumLoops(successor) == 0) {
-                            DirPtr Dirtemp = new Dir(*curBBInfo_ptr->branches);
-                            Dirtemp->pop_back();
-                            BBInfo* BBtemp;
-                            BBtemp = new BBInfo(curBBInfo_ptr->parent->label, Dirtemp, (Dirtemp->size() == 0)? successor->getTerminator(): curBBInfo_ptr->ancestor,
-                                                                  (Dirtemp->size() == 0)? BBtemp: curBBInfo_ptr->parent->parent);
-                            BBToBBInfoMap[successor] = BBtemp;
-                        }
-                    }
+                if (I.isConditional()) {
+                    decide(I, I.getCondition());
+                }
+            }
+
+            void visitSwitchInst(SwitchInst &I) {
+                decide(I, I.getCondition());
+            }
+
+            void visitIndirectBrInst(IndirectBrInst &I) {
+                decide(I, I.getAddress());
+            }
+
+            // Gives the branch that ends I's block its label. A block visited before it (the header of a loop
+            // the branch may send around again) has been reading the branch's slot, so the label goes there too.
+            void decide(Instruction &I, Value *condition) {
+                BasicBlock *from = I.getParent();
+                if (S.Deciding.count(from) == 0) {
+                    return;
+                }
+
+                Value *label = S.curBBInfo_ptr->label;
+                auto reg_iter = S.TmpToLabelMap.find(condition);
+                if (reg_iter != S.TmpToLabelMap.end()) {
+                    label = union_taint(label, reg_iter->second, &I);
+                }
+
+                BBInfo *&bbinfo = S.BranchToBBInfoMap[from];
+                if (bbinfo == nullptr) {
+                    bbinfo = newBBInfo(label);
                 } else {
-                    // An assumption from obsevation: successor1 comes after successor2
-                    BasicBlock *successor0 = I.getSuccessor(0);
-                    BasicBlock *successor1 = I.getSuccessor(1);
+                    bbinfo->label = label;
+                    storeLabel(label, bbinfo->slot, &I);
+                }
+            }
 
-                    // No need since terminator is branch.
-                    // Instruction* insert_point = (curBBInfo_ptr->branches->size() == 0)? &I: curBBInfo_ptr->ancestor;
+            // The label of the branch that ends BB. Until the branch is visited there is only its slot, which
+            // holds the label the branch had the last time it ran, and the empty label before that.
+            BBInfo* branchInfo(BasicBlock *BB) {
+                BBInfo *&bbinfo = S.BranchToBBInfoMap[BB];
+                if (bbinfo == nullptr) {
+                    bbinfo = newBBInfo(nullptr);
+                    bbinfo->slot = labelSlot(*BB->getParent());
+                }
+                return bbinfo;
+            }
 
-                    auto reg_iter = TmpToLabelMap.find(I.getCondition());
-                    Value *label;
-                    if (reg_iter != TmpToLabelMap.end()) {
-                        label = union_taint(curBBInfo_ptr->label, reg_iter->second, curBBInfo_ptr->ancestor);
-                    } else {
-                        label = curBBInfo_ptr->label;
-                    }
-                    // One from current branch, the other from successor1
-                    // TODO: double check if there is a loop.
-                    DirPtr Dirtemp0 = new Dir(*curBBInfo_ptr->branches);
-                    DirPtr Dirtemp1 = new Dir(*curBBInfo_ptr->branches);
+            // A block runs under the labels of the branches it depends on, computed once at its top, or under the
+            // label the function was entered with when none decides it. One it is visited before decides whether
+            // a loop goes around again: the first iteration runs under the label the loop was entered with, and
+            // each one after that under what the branch had when it sent the loop back.
+            BBInfo* blockInfo(BasicBlock *BB) {
+                auto bb_iter = S.BBToBBInfoMap.find(BB);
+                if (bb_iter != S.BBToBBInfoMap.end()) {
+                    return bb_iter->second;
+                }
 
-                    if (successor1->getNumUses() - NumLoops(successor1) >= 2) {
-                        auto iter1 = BBToBBInfoMap.find(successor1);
+                BBInfo *entry = S.BBToBBInfoMap[&S.F.getEntryBlock()];
+                auto controllers_iter = S.Controllers.find(BB);
+                if (controllers_iter == S.Controllers.end()) {
+                    return S.BBToBBInfoMap[BB] = entry;
+                }
 
-                        if (iter1 == BBToBBInfoMap.end()) {
-                            BBInfo* BBtemp1;
-                            BBtemp1 = new BBInfo(curBBInfo_ptr->label, Dirtemp1, (Dirtemp1->size() == 0)? successor1->getTerminator(): curBBInfo_ptr->ancestor,
-                                    (Dirtemp1->size() == 0)? BBtemp1: curBBInfo_ptr->parent);
-                            BBToBBInfoMap[successor1] = BBtemp1;
-                        }
-                    } else {
-                        // Deeper level
-                        Dirtemp1->push_back(1);
-                        BBInfo* BBtemp1 = new BBInfo(label, Dirtemp1, curBBInfo_ptr->ancestor, curBBInfo_ptr);
-                        BBToBBInfoMap[successor1] = BBtemp1;
+                Instruction *at = &*BB->getFirstInsertionPt();
+                Value *label = zero;
+                bool entered = false;
+                for (auto controller: controllers_iter->second) {
+                    auto branch_iter = S.BranchToBBInfoMap.find(controller);
+                    if (branch_iter != S.BranchToBBInfoMap.end() && branch_iter->second->label != nullptr) {
+                        entered = true;
+                    } else if (!branchTainted(controller)) {
+                        continue;
                     }
+                    label = union_taint(label, labelAt(branchInfo(controller), at), at);
+                }
+                if (!entered) {
+                    label = union_taint(label, entry->label, at);
+                }
+                return S.BBToBBInfoMap[BB] = newBBInfo(label);
+            }
 
-                    Dirtemp0->push_back(0);
-                    BBInfo* BBtemp0 = new BBInfo(label, Dirtemp0, curBBInfo_ptr->ancestor, curBBInfo_ptr);
-                    BBToBBInfoMap[successor0] = BBtemp0;
+            // Can the branch that ends BB be decided by, or run under, a tainted value?
+            bool branchTainted(BasicBlock *BB) {
+                if (!ClPrune || Reachability.isControlTainted(BB)) {
+                    return true;
+                }
+                Instruction *terminator = BB->getTerminator();
+                Value *condition = nullptr;
+                if (auto branch = dyn_cast<BranchInst>(terminator)) {
+                    condition = branch->getCondition();
+                } else if (auto sw = dyn_cast<SwitchInst>(terminator)) {
+                    condition = sw->getCondition();
+                } else if (auto indirect = dyn_cast<IndirectBrInst>(terminator)) {
+                    condition = indirect->getAddress();
                 }
+                return condition != nullptr && Reachability.isTainted(condition);
             }
 
             void visitBinaryOperator(BinaryOperator &I) {
@@ -452,92 +1780,268 @@ namespace {
             }
 
             void visitBinOp(Instruction &I) {
+                if (prune(Reachability.isTainted(&I))) {
+                    return;
+                }
+
                 Value *operand1 = I.getOperand(0);
                 Value *operand2 = I.getOperand(1);
 
-                auto reg_iter1 = TmpToLabelMap.find(operand1);
-                auto reg_iter2 = TmpToLabelMap.find(operand2);
+                auto reg_iter1 = S.TmpToLabelMap.find(operand1);
+                auto reg_iter2 = S.TmpToLabelMap.find(operand2);
 
-                Instruction *insert_point = (curBBInfo_ptr->branches->size() == 0)? &I: curBBInfo_ptr->ancestor;
-                if (reg_iter1 != TmpToLabelMap.end() && reg_iter2 != TmpToLabelMap.end()) {
-                    TmpToLabelMap[&I] = union_taint(reg_iter1->second, reg_iter2->second, insert_point);
-                } else if (reg_iter1 != TmpToLabelMap.end()) {
-                    TmpToLabelMap[&I] = reg_iter1->second;
-                } else if (reg_iter2 != TmpToLabelMap.end()) {
-                    TmpToLabelMap[&I] = reg_iter2->second;
+                Instruction *insert_point = insertPoint(I);
+                if (reg_iter1 != S.TmpToLabelMap.end() && reg_iter2 != S.TmpToLabelMap.end()) {
+                    S.TmpToLabelMap[&I] = union_taint(reg_iter1->second, reg_iter2->second, insert_point);
+                } else if (reg_iter1 != S.TmpToLabelMap.end()) {
+                    S.TmpToLabelMap[&I] = reg_iter1->second;
+                } else if (reg_iter2 != S.TmpToLabelMap.end()) {
+                    S.TmpToLabelMap[&I] = reg_iter2->second;
                 }
             }
 
             // TODO: Add another phinode to do dynamic analysis.
             // Since the destination is tainted by all the blocks and one value.
             void visitPHINode(PHINode &I) {
+                if (prune(Reachability.isTainted(&I))) {
+                    return;
+                }
+
+                // A value coming around a back edge has no label yet, so the label is a phi of its own.
+                if (NumLoops(I.getParent()) > 0) {
+                    IRBuilder<> builder(&I);
+                    PHINode *label = builder.CreatePHI(label_type, I.getNumIncomingValues());
+                    S.PendingPhis.push_back(std::make_pair(&I, label));
+                    S.TmpToLabelMap[&I] = label;
+                    return;
+                }
+
                 Value *label = zero;
 
-                Instruction *insert_point = (curBBInfo_ptr->branches->size() == 0)? &I: curBBInfo_ptr->ancestor;
+                Instruction *insert_point = insertPoint(I);
                 unsigned int num = I.getNumIncomingValues();
                 for (unsigned int index = 0; index < num; index++) {
-                    auto reg_iter = TmpToLabelMap.find(I.getIncomingValue(index));
-                    auto bb_iter = BBToBBInfoMap.find(I.getIncomingBlock(index));
-                    if (reg_iter != TmpToLabelMap.end()) {
-                        label = union_taint(label, bb_iter->second->label, insert_point);
-                    } else {
-                        label = union_taint(label, bb_iter->second->label, insert_point);
+                    auto reg_iter = S.TmpToLabelMap.find(I.getIncomingValue(index));
+                    auto bb_iter = S.BBToBBInfoMap.find(I.getIncomingBlock(index));
+                    if (bb_iter != S.BBToBBInfoMap.end()) {
+                        label = union_taint(label, labelAt(bb_iter->second, insert_point), insert_point);
+                    }
+                    if (reg_iter != S.TmpToLabelMap.end()) {
                         label = union_taint(label, reg_iter->second, insert_point);
                     }
                 }
 
-                TmpToLabelMap[&I] = label;
+                S.TmpToLabelMap[&I] = label;
             }
 
-            Value* alocaAndStoreLabel(Value *label, Instruction *I) {
+            // Where the label computation for I goes: right before it, or after the phis for a phi.
+            Instruction* insertPoint(Instruction &I) {
+                return isa<PHINode>(I)? I.getParent()->getFirstNonPHI(): &I;
+            }
+
+            // A block label computed under a nested branch does not dominate every later use, e.g. the
+            // exit block or a load after the join. Those uses read it back from an entry-block slot
+            // that is written right where the label is computed, so it is clean if that never ran.
+            Value* labelAt(BBInfo *bbinfo, Instruction *I) {
+                if (bbinfo->label == nullptr) {
+                    return loadLabel(bbinfo->slot, I);
+                }
+                Instruction *def = dyn_cast<Instruction>(bbinfo->label);
+                if (def == nullptr || S.DT.dominates(def, I)) {
+                    return bbinfo->label;
+                }
+
+                if (bbinfo->slot == nullptr) {
+                    bbinfo->slot = labelSlot(*I->getFunction());
+                    storeLabel(def, bbinfo->slot, def->getNextNode());
+                }
+                return loadLabel(bbinfo->slot, I);
+            }
+
+            // A label slot in the entry block, which reads as the empty label until it is first written.
+            AllocaInst* labelSlot(Function &F) {
+                BasicBlock &entry = F.getEntryBlock();
+                IRBuilder<> builder(&entry, entry.getFirstInsertionPt());
+                AllocaInst *slot = builder.CreateAlloca(label_type);
+                builder.CreateStore(zero, slot);
+                S.LabelSlots.insert(slot);
+                return slot;
+            }
+
+            // Shift-and-add from an application address to the label of its granule.
+            Value* shadowAddr(Value *addr, IRBuilder<> &builder) {
+                Value *shadow = builder.CreatePtrToInt(addr, int64_type);
+                shadow = builder.CreateAnd(shadow, ConstantInt::get(int64_type, kShadowAppMask));
+                shadow = builder.CreateLShr(shadow, ShadowGranuleShift);
+                shadow = builder.CreateShl(shadow, kLabelShift);
+                shadow = builder.CreateAdd(shadow, ConstantInt::get(int64_type, kShadowBase));
+                return builder.CreateIntToPtr(shadow, label_ptr);
+            }
+
+            // Number of granules covered by a value of type ty, assuming it starts on a granule.
+            unsigned shadowGranules(Type *ty) {
+                uint64_t size = data_layout->getTypeStoreSize(ty);
+                uint64_t granule = 1ULL << ShadowGranuleShift;
+                return std::max<uint64_t>(1, (size + granule - 1) / granule);
+            }
+
+            // The labels of a short run are read or written as one vector, so an i64 costs one store of
+            // <8 x i32> with byte granules rather than eight.
+            Value* shadowRun(Value *shadow, Type *run_type, IRBuilder<> &builder) {
+                return builder.CreateBitCast(shadow, run_type->getPointerTo());
+            }
+
+            void storeShadow(Value *label, Value *addr, Type *ty, Instruction *I) {
+                IRBuilder<> builder(I);
+                unsigned granules = shadowGranules(ty);
+                Instruction *store;
+                if (granules == 1) {
+                    store = builder.CreateStore(label, shadowAddr(addr, builder));
+                } else if (granules <= kMaxShadowRun) {
+                    Value *run = shadowRun(shadowAddr(addr, builder), VectorType::get(int32_type, granules), builder);
+                    store = builder.CreateAlignedStore(builder.CreateVectorSplat(granules, label), run, 4);
+                } else {
+                    Value* args[] = { builder.CreatePtrToInt(addr, int64_type),
+                                      ConstantInt::get(int64_type, data_layout->getTypeStoreSize(ty)), label };
+                    store = builder.CreateCall(shadow_fill, args);
+                }
+                countSite(store, "store", I);
+            }
+
+            // A run whose labels all equal the first is the common case and needs no union; anything else
+            // goes to shadow_range_label, behind the inline check.
+            Value* loadShadow(Value *addr, Type *ty, Instruction *I) {
                 IRBuilder<> builder(I);
-                Instruction *addr = builder.CreateAlloca(int32_type);
-                builder.CreateStore(label, addr);
+                unsigned granules = shadowGranules(ty);
+                Value *size = ConstantInt::get(int64_type, data_layout->getTypeStoreSize(ty));
+                if (granules == 1) {
+                    Value *label = builder.CreateLoad(int32_type, shadowAddr(addr, builder));
+                    countSite(label, "load", I);
+                    return label;
+                }
+                if (granules > kMaxShadowRun) {
+                    Value* args[] = { builder.CreatePtrToInt(addr, int64_type), size, S.nodes_ptr, S.root_ptr };
+                    Value *label = builder.CreateCall(shadow_range_label, args);
+                    countSite(label, "load", I);
+                    return label;
+                }
+
+                Type *run_type = VectorType::get(int32_type, granules);
+                Value *run = builder.CreateAlignedLoad(run_type, shadowRun(shadowAddr(addr, builder), run_type, builder), 4);
+                countSite(run, "load", I);
+                Value *first = builder.CreateExtractElement(run, (uint64_t) 0);
+                Value *equal = builder.CreateICmpEQ(run, builder.CreateVectorSplat(granules, first));
+                equal = builder.CreateBitCast(equal, IntegerType::get(I->getContext(), granules));
+                Value *same = builder.CreateICmpEQ(equal, Constant::getAllOnesValue(equal->getType()));
+                Value* args[] = { same, first, builder.CreatePtrToInt(addr, int64_type), size, S.nodes_ptr, S.root_ptr };
+                CallInst *label = builder.CreateCall(run_inline, args);
+                S.UnionCalls.push_back(label);
+                return label;
+            }
+
+            // The slot always goes to the entry block: an alloca anywhere else is a dynamic one, which grows the
+            // stack each time it runs and is never promoted to a register.
+            Value* alocaAndStoreLabel(Value *label, Instruction *I) {
+                AllocaInst *addr = labelSlot(*I->getFunction());
+                storeLabel(label, addr, I);
                 return addr;
             }
 
             void storeLabel(Value *label, Value *addr, Instruction *I) {
                 IRBuilder<> builder(I);
-                builder.CreateStore(label, addr);
+                countSite(builder.CreateStore(label, addr), "store", I);
                 return;
             }
 
             Value* loadLabel(Value *addr, Instruction *I) {
                 IRBuilder<> builder(I);
-                return builder.CreateLoad(int32_type, addr);
+                LoadInst *label = builder.CreateLoad(label_type, addr);
+                S.LabelCode.insert(label);
+                countSite(label, "load", I);
+                return label;
+            }
+
+            // Records label code for -taint-site-stats, along with the line of the instruction it is for.
+            void countSite(Value *code, const char *kind, Instruction *I) {
+                if (!ClSiteStats || !isa<Instruction>(code)) {
+                    return;
+                }
+                const DebugLoc &loc = I->getDebugLoc();
+                S.PendingSites.push_back({ WeakVH(code), kind, loc ? loc.getLine() : 0 });
             }
 
+            // A new source is a constant label, nothing runs for it.
             Value* insert_taint(Instruction *I) {
-                IRBuilder<> builder(I);
-                Value* bitvec = builder.CreateCall(bitvec_new);
-                Value* bitvec_set_args[] = {bitvec, ConstantInt::get(int32_type, 1), ConstantInt::get(int32_type, NumOfTaints++)};
-                builder.CreateCall(bitvec_set, bitvec_set_args);
-                Value* insert_c_args[] = {root_ptr, bitvec, nodes_ptr};
-                Value* label = builder.CreateCall(insert_c, insert_c_args);
-                Value* bitvec_free_args[] = {bitvec};
-                builder.CreateCall(bitvec_free, bitvec_free_args);
-                return label;
+                return sourceLabel(NumOfTaints++);
             }
 
             Value* union_taint(Value *label1, Value *label2, Instruction *I) {
+                // Fold what is known at compile time, the inline fast paths handle the rest at run time.
+                if (label1 == zero || label1 == label2) {
+                    NumOfFoldedUnions++;
+                    return label2;
+                }
+                if (label2 == zero) {
+                    NumOfFoldedUnions++;
+                    return label1;
+                }
+
                 IRBuilder<> builder(I);
-                Value* args[] = { label1, label2, nodes_ptr, root_ptr };
-                return builder.CreateCall(union_c, args);
+                if (LabelWords) {
+                    Value *label = builder.CreateOr(label1, label2);
+                    if (auto inst = dyn_cast<Instruction>(label)) {
+                        S.LabelCode.insert(inst);
+                    }
+                    countSite(label, "union", I);
+                    return label;
+                }
+
+                Value* args[] = { label1, label2, S.nodes_ptr, S.root_ptr };
+                CallInst* label = builder.CreateCall(union_inline, args);
+                S.UnionCalls.push_back(label);
+                S.LabelCode.insert(label);
+                countSite(label, "union", I);
+                return label;
             }
 
-            // TODO:
-            bool NoLoop(BasicBlock* bb) {
-                return true;
+            // The state owns every BBInfo, so they all go away with it.
+            BBInfo* newBBInfo(Value* label) {
+                BBInfo* bbinfo = new BBInfo(label);
+                S.BBInfos.push_back(bbinfo);
+                return bbinfo;
+            }
+
+            // The label of source id, a set with only that bit. The runtime puts every singleton into the table
+            // in order when main starts, right after the empty set, so its number is known now as well.
+            // Must agree with source_label in tool/src/lib.rs.
+            Constant* sourceLabel(uint64_t id) {
+                if (!LabelWords) {
+                    return ConstantInt::get(label_type, id + 1);
+                }
+                if (LabelWords <= 2) {
+                    return ConstantInt::get(label_type, APInt::getOneBitSet(LabelWords * 64, id));
+                }
+                std::vector<Constant*> words(LabelWords, ConstantInt::get(int64_type, 0));
+                words[id / 64] = ConstantInt::get(int64_type, 1ULL << (id % 64));
+                return ConstantVector::get(words);
             }
 
-            // TODO:
+            // Number of back edges into successor, nonzero only for a loop header.
             unsigned NumLoops(BasicBlock* successor) {
-                return 0;
+                Loop *L = S.LI.getLoopFor(successor);
+                if (L == nullptr || L->getHeader() != successor) {
+                    return 0;
+                }
+                unsigned latches = 0;
+                for (auto pred: predecessors(successor)) {
+                    if (L->contains(pred)) {
+                        latches++;
+                    }
+                }
+                return latches;
             }
         };
 
-        TaintTrackingVisitor TaintVisitor;
-
         // Declare all the extern function from rust tool lib
         // Get some necessary stucture and pointer types
         void FuncDeclare(Module &M) {
@@ -545,223 +2049,836 @@ namespace {
 
             // Get necessary types
             int32_type = Type::getInt32Ty(Ctx);
+            int64_type = Type::getInt64Ty(Ctx);
             void_type = Type::getVoidTy(Ctx);
-            bitvec_type = StructType::create(Ctx, "bitvec");
-            bitvec_ptr = bitvec_type->getPointerTo();
+            label_ptr = int32_type->getPointerTo();
             tree_type = StructType::create(Ctx, "tree");
             tree_ptr = tree_type->getPointerTo();
             table_type = StructType::create(Ctx, "table");
             table_ptr = table_type->getPointerTo();
+            label_type = int32_type;
+            LabelWords = 0;
+            zero = ConstantInt::get(int32_type, 0);
 
-            // For extern function bitvec_new()
-            std::vector<Type*> bitvec_new_params;
-            FunctionType *bitvec_new_fn = FunctionType::get(bitvec_ptr, bitvec_new_params, false);
-            bitvec_new = M.getOrInsertFunction("bitvec_new", bitvec_new_fn);
-
-            // For extern function bitvec_set()
-            std::vector<Type*> bitvec_set_params = { bitvec_ptr, int32_type, int32_type };
-            FunctionType *bitvec_set_fn = FunctionType::get(void_type, bitvec_set_params, false);
-            bitvec_set = M.getOrInsertFunction("bitvec_set", bitvec_set_fn);
-
-            // For extern function bitvec_print()
-            std::vector<Type*> bitvec_print_params = { table_ptr, int32_type, int32_type, int32_type };
-            FunctionType *bitvec_print_fn = FunctionType::get(void_type, bitvec_print_params, false);
-            bitvec_print = M.getOrInsertFunction("bitvec_print", bitvec_print_fn);
-
-            // For extern function bitvec_free()
-            std::vector<Type*> bitvec_free_params = { bitvec_ptr };
-            FunctionType *bitvec_free_fn = FunctionType::get(void_type, bitvec_free_params, false);
-            bitvec_free = M.getOrInsertFunction("bitvec_free", bitvec_free_fn);
+            // No runtime function throws. A union reads the table, which only the runtime can reach, and what it
+            // writes there (an interned set, a deferred node, a memo entry or a count) never changes the answer
+            // of any later union or lookup. So it is declared to only read memory the program cannot access,
+            // and reading the label of a shadow range readonly: -O2 can then merge repeated unions, hoist them
+            // out of loops and drop those whose result is never used, but never move one across a call into the
+            // runtime that may write the table, such as sources_init or table_free.
+            AttributeList runtime_attrs = AttributeList::get(Ctx, AttributeList::FunctionIndex,
+                                                             { Attribute::NoUnwind });
+            AttributeList pure_attrs = AttributeList::get(Ctx, AttributeList::FunctionIndex,
+                                                          { Attribute::NoUnwind, Attribute::ReadOnly,
+                                                            Attribute::InaccessibleMemOnly });
+            AttributeList reader_attrs = AttributeList::get(Ctx, AttributeList::FunctionIndex,
+                                                            { Attribute::NoUnwind, Attribute::ReadOnly });
+
+            // For extern function trace_label()
+            std::vector<Type*> trace_label_params = { table_ptr, int32_type, int32_type, int32_type };
+            FunctionType *trace_label_fn = FunctionType::get(void_type, trace_label_params, false);
+            trace_label = M.getOrInsertFunction("trace_label", trace_label_fn, runtime_attrs);
 
             // For extern function tree_new()
             std::vector<Type*> tree_new_params;
             FunctionType *tree_new_fn = FunctionType::get(tree_ptr, tree_new_params, false);
-            tree_new = M.getOrInsertFunction("tree_new", tree_new_fn);
+            tree_new = M.getOrInsertFunction("tree_new", tree_new_fn, runtime_attrs);
 
             // For extern function tree_free()
             std::vector<Type*> tree_free_params = { tree_ptr };
             FunctionType *tree_free_fn = FunctionType::get(void_type, tree_free_params, false);
-            tree_free = M.getOrInsertFunction("tree_free", tree_free_fn);
+            tree_free = M.getOrInsertFunction("tree_free", tree_free_fn, runtime_attrs);
 
             // For extern function table_new()
             std::vector<Type*> table_new_params;
             FunctionType *table_new_fn = FunctionType::get(table_ptr, table_new_params, false);
-            table_new = M.getOrInsertFunction("table_new", table_new_fn);
+            table_new = M.getOrInsertFunction("table_new", table_new_fn, runtime_attrs);
 
             // For extern function table_free()
             std::vector<Type*> table_free_params = { table_ptr };
             FunctionType *table_free_fn = FunctionType::get(void_type, table_free_params, false);
-            table_free = M.getOrInsertFunction("table_free", table_free_fn);
-
-            // For extern function insert_c()
-            std::vector<Type*> insert_c_params = { tree_ptr, bitvec_ptr, table_ptr };
-            FunctionType *insert_c_fn = FunctionType::get(int32_type, insert_c_params, false);
-            insert_c = M.getOrInsertFunction("insert_c", insert_c_fn);
+            table_free = M.getOrInsertFunction("table_free", table_free_fn, runtime_attrs);
+
+            // For extern function sources_init()
+            std::vector<Type*> sources_init_params = { tree_ptr, table_ptr, int32_type };
+            FunctionType *sources_init_fn = FunctionType::get(void_type, sources_init_params, false);
+            sources_init = M.getOrInsertFunction("sources_init", sources_init_fn, runtime_attrs);
+
+            // For extern function block_enter()
+            std::vector<Type*> block_enter_params = { int32_type, int32_type };
+            FunctionType *block_enter_fn = FunctionType::get(void_type, block_enter_params, false);
+            block_enter = M.getOrInsertFunction("block_enter", block_enter_fn, runtime_attrs);
+
+            // For extern function block_enter_set()
+            std::vector<Type*> block_enter_set_params = { int32_type, int32_type, int64_type, int64_type, int64_type, int64_type };
+            FunctionType *block_enter_set_fn = FunctionType::get(void_type, block_enter_set_params, false);
+            block_enter_set = M.getOrInsertFunction("block_enter_set", block_enter_set_fn, runtime_attrs);
+
+            // For extern function sink_check()
+            Type *name_type = Type::getInt8PtrTy(Ctx);
+            std::vector<Type*> sink_check_params = { name_type, int32_type, int32_type, int32_type, int32_type };
+            FunctionType *sink_check_fn = FunctionType::get(void_type, sink_check_params, false);
+            sink_check = M.getOrInsertFunction("sink_check", sink_check_fn, runtime_attrs);
+
+            // For extern function sink_check_set()
+            std::vector<Type*> sink_check_set_params = { name_type, int32_type, int32_type, int32_type,
+                                                         int64_type, int64_type, int64_type, int64_type, int32_type };
+            FunctionType *sink_check_set_fn = FunctionType::get(void_type, sink_check_set_params, false);
+            sink_check_set = M.getOrInsertFunction("sink_check_set", sink_check_set_fn, runtime_attrs);
+
+            // For extern functions sites_init() and site_enter()
+            site_type = StructType::get(Ctx, { name_type, name_type, int32_type, int32_type });
+            std::vector<Type*> sites_init_params = { site_type->getPointerTo(), int32_type };
+            FunctionType *sites_init_fn = FunctionType::get(void_type, sites_init_params, false);
+            sites_init = M.getOrInsertFunction("sites_init", sites_init_fn, runtime_attrs);
+            std::vector<Type*> site_enter_params = { int32_type };
+            FunctionType *site_enter_fn = FunctionType::get(void_type, site_enter_params, false);
+            site_enter = M.getOrInsertFunction("site_enter", site_enter_fn, runtime_attrs);
 
             // For extern function union_c()
             std::vector<Type*> union_c_params = { int32_type, int32_type, table_ptr, tree_ptr };
             FunctionType *union_c_fn = FunctionType::get(int32_type, union_c_params, false);
-            union_c = M.getOrInsertFunction("union_c", union_c_fn);
+            union_c = M.getOrInsertFunction("union_c", union_c_fn, pure_attrs);
+
+            // For extern function shadow_init()
+            std::vector<Type*> shadow_init_params = { int32_type };
+            FunctionType *shadow_init_fn = FunctionType::get(void_type, shadow_init_params, false);
+            shadow_init = M.getOrInsertFunction("shadow_init", shadow_init_fn, runtime_attrs);
+
+            // For extern functions shadow_copy(), shadow_fill(), shadow_union_range() and shadow_range_label()
+            std::vector<Type*> shadow_copy_params = { int64_type, int64_type, int64_type };
+            FunctionType *shadow_copy_fn = FunctionType::get(void_type, shadow_copy_params, false);
+            shadow_copy = M.getOrInsertFunction("shadow_copy", shadow_copy_fn, runtime_attrs);
+            std::vector<Type*> shadow_fill_params = { int64_type, int64_type, int32_type };
+            FunctionType *shadow_fill_fn = FunctionType::get(void_type, shadow_fill_params, false);
+            shadow_fill = M.getOrInsertFunction("shadow_fill", shadow_fill_fn, runtime_attrs);
+            std::vector<Type*> shadow_union_range_params = { int64_type, int64_type, int32_type, table_ptr, tree_ptr };
+            FunctionType *shadow_union_range_fn = FunctionType::get(void_type, shadow_union_range_params, false);
+            shadow_union_range = M.getOrInsertFunction("shadow_union_range", shadow_union_range_fn, runtime_attrs);
+            std::vector<Type*> shadow_range_label_params = { int64_type, int64_type, table_ptr, tree_ptr };
+            FunctionType *shadow_range_label_fn = FunctionType::get(int32_type, shadow_range_label_params, false);
+            shadow_range_label = M.getOrInsertFunction("shadow_range_label", shadow_range_label_fn, reader_attrs);
+
+            // For extern function trace_bitset()
+            std::vector<Type*> trace_bitset_params = { int64_type->getPointerTo(), int32_type, int32_type, int32_type };
+            FunctionType *trace_bitset_fn = FunctionType::get(void_type, trace_bitset_params, false);
+            trace_bitset = M.getOrInsertFunction("trace_bitset", trace_bitset_fn, runtime_attrs);
 
         }
 
-        void AllocGlobalVal(Module &M) {
-            root = new GlobalVariable(M, tree_ptr, false, GlobalValue::ExternalLinkage, 0, "root");
-            nodes = new GlobalVariable(M, table_ptr, false, GlobalValue::ExternalLinkage, 0, "nodes");
-            root->setInitializer(ConstantPointerNull::get(tree_ptr));
-            nodes->setInitializer(ConstantPointerNull::get(table_ptr));
-        }
+        // Every source gets its id at compile time: one per argument of main and per target or return value
+        // of a source call the policy names.
+        // When they all fit in 256 bits, a label is just the set of its sources, carried in an i64, an i128
+        // or a <4 x i64> vector, and a union is an or. Otherwise labels stay numbers into the runtime table.
+        // The shadow memory layout holds 32-bit labels, so it always uses the runtime.
+        void ChooseLabelType(Module &M) {
+            if (!ClFixedLabels || ClShadowMemory) {
+                return;
+            }
 
-        void AllocDefineFcnArgsTaints(Module &M) {
+            uint64_t sources = 0;
             for (auto &F: M) {
-                if (F.hasExactDefinition()) {
-                    if (F.getName() == "main") {
-                        continue;
-                    } else {
-                        std::vector<GlobalVariable*> *currentTaints = new std::vector<GlobalVariable*>();
-                        for(auto arg = F.arg_begin(); arg != F.arg_end(); arg++) {
-                            GlobalVariable* temp = new GlobalVariable(M, int32_type, false, GlobalValue::ExternalLinkage, 0);
-                            temp->setInitializer(zero);
-                            currentTaints->push_back(temp);
+                if (!isInstrumented(F)) {
+                    continue;
+                }
+                if (F.getName() == "main") {
+                    for (auto &arg: F.args()) {
+                        sources += TaintPolicy::coversArg(Policy.source(&F), arg.getArgNo());
+                    }
+                }
+                for (auto &B: F) {
+                    for (auto &I: B) {
+                        auto call = dyn_cast<CallInst>(&I);
+                        Function *called = call ? call->getCalledFunction() : nullptr;
+                        const PolicyRules *rules = Policy.source(called);
+                        if (rules == nullptr || called->hasExactDefinition()) {
+                            continue;
                         }
-                        FcnToArgsTaintsMap[&F] = currentTaints;
+                        for (unsigned index = 0; index < call->getNumArgOperands(); index++) {
+                            sources += TaintPolicy::coversArg(rules, index);
+                        }
+                        sources += TaintPolicy::coversReturn(rules);
                     }
                 }
             }
+
+            NumOfSources = sources;
+            if (sources <= 64) {
+                LabelWords = 1;
+                label_type = int64_type;
+            } else if (sources <= 128) {
+                LabelWords = 2;
+                label_type = IntegerType::get(M.getContext(), 128);
+            } else if (sources <= 256) {
+                LabelWords = 4;
+                label_type = VectorType::get(int64_type, 4);
+            } else {
+                return;
+            }
+            zero = Constant::getNullValue(label_type);
         }
 
-        void AllocDefineFcnRtnTaint(Module &M) {
-            for (auto &F: M) {
-                if (F.hasExactDefinition()) {
-                    if (F.getName() == "main") {
-                        continue;
-                    } else {
-                        GlobalVariable *temp = new GlobalVariable(M, int32_type, false, GlobalValue::ExternalLinkage, 0);
-                        temp->setInitializer(zero);
-                        FcnToRtnTaintMap[&F] = temp;
+        // Define __taint_union(l1, l2, nodes, root): l1 == l2, l2 == 0 and l1 == 0 are answered
+        // without leaving the instrumented code, everything else goes to the memoized union_c.
+        void DefineUnionInline(Module &M) {
+            LLVMContext &Ctx = M.getContext();
+            std::vector<Type*> union_inline_params = { int32_type, int32_type, table_ptr, tree_ptr };
+            FunctionType *union_inline_fn = FunctionType::get(int32_type, union_inline_params, false);
+            union_inline = Function::Create(union_inline_fn, GlobalValue::InternalLinkage, "__taint_union", &M);
+            union_inline->addFnAttr(Attribute::AlwaysInline);
+            union_inline->addFnAttr(Attribute::NoUnwind);
+
+            auto arg = union_inline->arg_begin();
+            Value *label1 = &*arg++;
+            Value *label2 = &*arg++;
+            Value *table = &*arg++;
+            Value *tree = &*arg;
+
+            BasicBlock *entry = BasicBlock::Create(Ctx, "entry", union_inline);
+            BasicBlock *check_label1 = BasicBlock::Create(Ctx, "check_label1", union_inline);
+            BasicBlock *slow = BasicBlock::Create(Ctx, "slow", union_inline);
+            BasicBlock *ret_label1 = BasicBlock::Create(Ctx, "ret_label1", union_inline);
+            BasicBlock *ret_label2 = BasicBlock::Create(Ctx, "ret_label2", union_inline);
+
+            IRBuilder<> builder(entry);
+            Value *same = builder.CreateICmpEQ(label1, label2);
+            Value *label2_zero = builder.CreateICmpEQ(label2, ConstantInt::get(int32_type, 0));
+            builder.CreateCondBr(builder.CreateOr(same, label2_zero), ret_label1, check_label1);
+
+            builder.SetInsertPoint(check_label1);
+            Value *label1_zero = builder.CreateICmpEQ(label1, ConstantInt::get(int32_type, 0));
+            builder.CreateCondBr(label1_zero, ret_label2, slow);
+
+            builder.SetInsertPoint(slow);
+            Value* args[] = { label1, label2, table, tree };
+            builder.CreateRet(builder.CreateCall(union_c, args));
+
+            builder.SetInsertPoint(ret_label1);
+            builder.CreateRet(label1);
+
+            builder.SetInsertPoint(ret_label2);
+            builder.CreateRet(label2);
+        }
+
+        // Define __taint_run(same, first, addr, size, nodes, root): the label of a shadow run, which is its first
+        // label when the instrumented code found them all equal and their union from the runtime otherwise.
+        void DefineRunInline(Module &M) {
+            LLVMContext &Ctx = M.getContext();
+            std::vector<Type*> run_inline_params = { Type::getInt1Ty(Ctx), int32_type, int64_type, int64_type,
+                                                     table_ptr, tree_ptr };
+            FunctionType *run_inline_fn = FunctionType::get(int32_type, run_inline_params, false);
+            run_inline = Function::Create(run_inline_fn, GlobalValue::InternalLinkage, "__taint_run", &M);
+            run_inline->addFnAttr(Attribute::AlwaysInline);
+            run_inline->addFnAttr(Attribute::NoUnwind);
+
+            auto arg = run_inline->arg_begin();
+            Value *same = &*arg++;
+            Value *first = &*arg++;
+            Value *addr = &*arg++;
+            Value *size = &*arg++;
+            Value *table = &*arg++;
+            Value *tree = &*arg;
+
+            BasicBlock *entry = BasicBlock::Create(Ctx, "entry", run_inline);
+            BasicBlock *slow = BasicBlock::Create(Ctx, "slow", run_inline);
+            BasicBlock *ret_first = BasicBlock::Create(Ctx, "ret_first", run_inline);
+
+            IRBuilder<> builder(entry);
+            builder.CreateCondBr(same, ret_first, slow);
+
+            builder.SetInsertPoint(slow);
+            Value* args[] = { addr, size, table, tree };
+            builder.CreateRet(builder.CreateCall(shadow_range_label, args));
+
+            builder.SetInsertPoint(ret_first);
+            builder.CreateRet(first);
+        }
+
+        // Fill in the label phis of loop headers, now that every incoming block and value has a label.
+        // Each incoming label is computed at the end of its block.
+        void FinishLoopPhis(TaintTrackingVisitor &TaintVisitor) {
+            FunctionState &S = TaintVisitor.S;
+            for (auto &pending: S.PendingPhis) {
+                PHINode *phi = pending.first;
+                PHINode *label = pending.second;
+                for (unsigned index = 0; index < phi->getNumIncomingValues(); index++) {
+                    BasicBlock *incoming = phi->getIncomingBlock(index);
+                    Instruction *exit = incoming->getTerminator();
+                    Value *incoming_label = zero;
+                    auto bb_iter = S.BBToBBInfoMap.find(incoming);
+                    if (bb_iter != S.BBToBBInfoMap.end()) {
+                        incoming_label = TaintVisitor.labelAt(bb_iter->second, exit);
+                    }
+                    auto reg_iter = S.TmpToLabelMap.find(phi->getIncomingValue(index));
+                    if (reg_iter != S.TmpToLabelMap.end()) {
+                        incoming_label = TaintVisitor.union_taint(incoming_label, reg_iter->second, exit);
+                    }
+                    label->addIncoming(incoming_label, incoming);
+                }
+            }
+            S.PendingPhis.clear();
+        }
+
+        // Each recorded site gets its id and tells the runtime right before it runs. Blocks are numbered in
+        // function order, as the report shows them.
+        void CountSites(FunctionState &S) {
+            std::map<BasicBlock*, unsigned> blocks;
+            for (auto &B: S.F) {
+                blocks.insert(std::make_pair(&B, blocks.size()));
+            }
+            for (auto &site: S.PendingSites) {
+                Instruction *code = cast_or_null<Instruction>(static_cast<Value*>(site.code));
+                if (code == nullptr) {
+                    continue;
+                }
+                IRBuilder<> builder(code);
+                builder.CreateCall(site_enter, ConstantInt::get(int32_type, Sites.size()));
+                Sites.push_back({ site.kind, S.F.getName().str(), blocks[code->getParent()], site.line });
+            }
+        }
+
+        // Label code that computes the same thing on every iteration runs once in the preheader instead:
+        // unions whose operands all come from outside the loop, and loads of label slots the loop never
+        // writes. Inner loops go first, so what they hoist can move on out of the enclosing loop.
+        void HoistLoopInvariantLabels(FunctionState &S) {
+            SmallVector<Loop*, 4> loops = S.LI.getLoopsInPreorder();
+            for (auto loop_iter = loops.rbegin(); loop_iter != loops.rend(); loop_iter++) {
+                Loop *L = *loop_iter;
+                BasicBlock *preheader = L->getLoopPreheader();
+                if (preheader == nullptr) {
+                    continue;
+                }
+
+                std::set<Value*> stored;
+                for (auto BB: L->blocks()) {
+                    for (auto &I: *BB) {
+                        if (auto store = dyn_cast<StoreInst>(&I)) {
+                            stored.insert(store->getPointerOperand());
+                        }
+                    }
+                }
+
+                bool changed = true;
+                while (changed) {
+                    changed = false;
+                    for (auto BB: L->blocks()) {
+                        for (auto iter = BB->begin(); iter != BB->end(); ) {
+                            Instruction *I = &*iter++;
+                            if (S.LabelCode.count(I) == 0 || !L->hasLoopInvariantOperands(I)) {
+                                continue;
+                            }
+                            auto load = dyn_cast<LoadInst>(I);
+                            if (load && (S.LabelSlots.count(load->getPointerOperand()) == 0
+                                         || stored.count(load->getPointerOperand()) != 0)) {
+                                continue;
+                            }
+                            I->moveBefore(preheader->getTerminator());
+                            NumOfHoistedLabels++;
+                            changed = true;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Nothing but the label code itself ever sees the address of a label slot, so once the function is
+        // instrumented the slots become registers, with label phis where paths that stored different labels
+        // meet. The control flow is still the one the dominator tree was built for. Slots are taken in entry
+        // block order so the output does not depend on where they were allocated. A slot no loop touches
+        // stays in memory if it would need more phis than it has loads and stores, like the label of a deeply
+        // nested branch that only the exit reads, which would otherwise get a phi at every join on the way out.
+        void PromoteLabelSlots(FunctionState &S) {
+            std::vector<AllocaInst*> slots;
+            for (auto &I: S.F.getEntryBlock()) {
+                auto slot = dyn_cast<AllocaInst>(&I);
+                if (slot && S.LabelSlots.count(slot) != 0 && isAllocaPromotable(slot)) {
+                    SmallPtrSet<BasicBlock*, 32> defs;
+                    bool looped = false;
+                    for (auto user: slot->users()) {
+                        BasicBlock *BB = cast<Instruction>(user)->getParent();
+                        if (isa<StoreInst>(user)) {
+                            defs.insert(BB);
+                        }
+                        looped |= S.LI.getLoopFor(BB) != nullptr;
+                    }
+                    SmallVector<BasicBlock*, 32> phis;
+                    if (!looped) {
+                        ForwardIDFCalculator IDF(S.DT);
+                        IDF.setDefiningBlocks(defs);
+                        IDF.calculate(phis);
+                    }
+                    if (phis.size() <= slot->getNumUses()) {
+                        slots.push_back(slot);
                     }
                 }
             }
+            if (!slots.empty()) {
+                PromoteMemToReg(slots, S.DT);
+            }
+            S.LabelSlots.clear();
+        }
+
+        // Every block reports its id and label to the runtime each time it runs, from right before its
+        // terminator, where its label is always available. A fixed-width label is passed as its words.
+        void TraceBlocks(TaintTrackingVisitor &TaintVisitor) {
+            FunctionState &S = TaintVisitor.S;
+            for (auto BB: S.FcnBBList) {
+                Instruction *exit = BB->getTerminator();
+                Value *label = TaintVisitor.labelAt(S.BBToBBInfoMap[BB], exit);
+                IRBuilder<> builder(exit);
+                Constant *block = ConstantInt::get(int32_type, NumOfBlocks++);
+                if (!LabelWords) {
+                    Value* block_enter_args[] = {block, label};
+                    builder.CreateCall(block_enter, block_enter_args);
+                    continue;
+                }
+
+                std::vector<Value*> words = TaintVisitor.labelWords(label, builder);
+                Value* block_enter_set_args[] = {block, ConstantInt::get(int32_type, LabelWords),
+                                                 words[0], words[1], words[2], words[3]};
+                builder.CreateCall(block_enter_set, block_enter_set_args);
+            }
+        }
+
+        // A call that hands a function to a library function (qsort, pthread_create) may come back into the module.
+        bool passesFunction(CallInst *call) {
+            for (unsigned index = 0; index < call->getNumArgOperands(); index++) {
+                if (isa<Function>(call->getArgOperand(index)->stripPointerCasts())) {
+                    return true;
+                }
+            }
+            return false;
         }
 
-        void AllocDefineFcnBBLabel(Module &M) {
+        // Functions that call a source or taint_tracking, or may reach one through a call the pass cannot see,
+        // stay instrumented only, and so does every caller of one. Every frame on the stack when the flag goes
+        // up is then instrumented. The rest are cloned before anything is instrumented, and calls between
+        // clones go straight to the clone without checking the flag again.
+        void CloneNativeFunctions(Module &M) {
+            Tracking = new GlobalVariable(M, Type::getInt8Ty(M.getContext()), false, GlobalValue::InternalLinkage,
+                                          ConstantInt::get(Type::getInt8Ty(M.getContext()), 0), "__taint_tracking",
+                                          nullptr, GlobalVariable::GeneralDynamicTLSModel);
+
+            std::vector<Function*> fcns;
+            std::set<Function*> tracked;
+            std::map<Function*, std::vector<Function*>> callers;
             for (auto &F: M) {
-                if (F.hasExactDefinition()) {
-                    if (F.getName() == "main") {
+                if (!isInstrumented(F)) {
+                    continue;
+                }
+                fcns.push_back(&F);
+                // Nothing tells which indirect call or library function calls a function whose address is taken.
+                if (F.getName() == "main" || F.isVarArg() || F.hasAddressTaken()) {
+                    tracked.insert(&F);
+                }
+                for (auto &B: F) {
+                    for (auto &I: B) {
+                        auto call = dyn_cast<CallInst>(&I);
+                        if (call == nullptr || isa<IntrinsicInst>(call) || call->isInlineAsm()) {
+                            continue;
+                        }
+                        Function *called = call->getCalledFunction();
+                        if (called != nullptr && isInstrumented(*called)) {
+                            callers[called].push_back(&F);
+                        } else if (called == nullptr || Policy.source(called) || called->getName() == kTrackingCall
+                                   || passesFunction(call)) {
+                            tracked.insert(&F);
+                        }
+                    }
+                }
+            }
+
+            std::vector<Function*> worklist(tracked.begin(), tracked.end());
+            while (!worklist.empty()) {
+                Function *F = worklist.back();
+                worklist.pop_back();
+                for (auto caller: callers[F]) {
+                    if (tracked.insert(caller).second) {
+                        worklist.push_back(caller);
+                    }
+                }
+            }
+
+            NativeClones.clear();
+            for (auto F: fcns) {
+                if (tracked.count(F) == 0) {
+                    ValueToValueMapTy VMap;
+                    Function *clone = CloneFunction(F, VMap);
+                    clone->setName("__taint_native." + F->getName());
+                    clone->setLinkage(GlobalValue::InternalLinkage);
+                    NativeClones[F] = clone;
+                }
+            }
+            for (auto &clone: NativeClones) {
+                for (auto &B: *clone.second) {
+                    for (auto &I: B) {
+                        auto call = dyn_cast<CallInst>(&I);
+                        auto callee_iter = call ? NativeClones.find(call->getCalledFunction()) : NativeClones.end();
+                        if (callee_iter != NativeClones.end()) {
+                            call->setCalledFunction(callee_iter->second);
+                        }
+                    }
+                }
+            }
+        }
+
+        // Raise the flag right before every source call, and at the start of main if its arguments are sources.
+        // A function with a native clone first checks the flag, and while it is down clears the return label
+        // it would have set and hands the call to the clone.
+        void SwitchTracking(Function &F) {
+            LLVMContext &Ctx = F.getContext();
+            Type *flag_type = Tracking->getValueType();
+            IRBuilder<> builder(Ctx);
+            std::vector<CallInst*> switches;
+            for (auto &B: F) {
+                for (auto &I: B) {
+                    auto call = dyn_cast<CallInst>(&I);
+                    Function *called = call ? call->getCalledFunction() : nullptr;
+                    if (called == nullptr) {
                         continue;
-                    } else {
-                        GlobalVariable *temp = new GlobalVariable(M, int32_type, false, GlobalValue::ExternalLinkage, 0);
-                        FcnToBBLabelMap[&F] = temp;
+                    }
+                    if (called->getName() == kTrackingCall && call->getNumArgOperands() == 1 && call->use_empty()) {
+                        switches.push_back(call);
+                    } else if (Policy.source(called) && called != &F) {
+                        builder.SetInsertPoint(call);
+                        builder.CreateStore(ConstantInt::get(flag_type, 1), Tracking);
+                    }
+                }
+            }
+            for (auto call: switches) {
+                builder.SetInsertPoint(call);
+                Value *on = call->getArgOperand(0);
+                on = builder.CreateICmpNE(on, Constant::getNullValue(on->getType()));
+                builder.CreateStore(builder.CreateZExt(on, flag_type), Tracking);
+                call->eraseFromParent();
+            }
+
+            if (F.getName() == "main") {
+                for (auto &arg: F.args()) {
+                    if (TaintPolicy::coversArg(Policy.source(&F), arg.getArgNo())) {
+                        builder.SetInsertPoint(&*F.getEntryBlock().getFirstInsertionPt());
+                        builder.CreateStore(ConstantInt::get(flag_type, 1), Tracking);
+                        break;
                     }
                 }
             }
+
+            auto clone_iter = NativeClones.find(&F);
+            if (clone_iter == NativeClones.end()) {
+                return;
+            }
+            // Allocas stay in the entry block, so they remain static.
+            BasicBlock *entry = &F.getEntryBlock();
+            auto first = entry->begin();
+            while (isa<AllocaInst>(first)) {
+                first++;
+            }
+            BasicBlock *tracked = entry->splitBasicBlock(first, "tracked");
+            BasicBlock *native = BasicBlock::Create(Ctx, "native", &F, tracked);
+            entry->getTerminator()->eraseFromParent();
+            builder.SetInsertPoint(entry);
+            Value *on = builder.CreateLoad(flag_type, Tracking);
+            builder.CreateCondBr(builder.CreateICmpNE(on, ConstantInt::get(flag_type, 0)), tracked, native);
+
+            builder.SetInsertPoint(native);
+            builder.CreateStore(zero, ReturnLabel);
+            std::vector<Value*> args;
+            for (auto &arg: F.args()) {
+                args.push_back(&arg);
+            }
+            CallInst *call = builder.CreateCall(clone_iter->second, args);
+            call->setTailCall();
+            if (F.getReturnType()->isVoidTy()) {
+                builder.CreateRetVoid();
+            } else {
+                builder.CreateRet(call);
+            }
         }
 
-        void InitializeMainArgs(Function &F) {
-            NumOfTaints = 0;
+        // Splice the fast paths into the caller so the common cases never make a call.
+        void InlineUnionCalls(FunctionState &S) {
+            for (auto call: S.UnionCalls) {
+                InlineFunctionInfo IFI;
+                InlineFunction(call, IFI);
+            }
+            S.UnionCalls.clear();
+        }
+
+        // Puts every sink check under the test of its label, on a path of its own the branch weights mark as
+        // rarely taken, so a sink called with clean arguments never calls into the runtime. The blocks are only
+        // split once nothing else walks the function's blocks.
+        void GuardSinkChecks(FunctionState &S) {
+            MDNode *weights = MDBuilder(S.F.getContext()).createBranchWeights(1, 1 << 20);
+            for (auto &check: S.SinkChecks) {
+                Instruction *then = SplitBlockAndInsertIfThen(check.first, check.second, false, weights);
+                check.second->moveBefore(then);
+            }
+            S.SinkChecks.clear();
+        }
+
+        // The pass's own helpers are defined in the module but must not be instrumented.
+        bool isInstrumented(Function &F) {
+            return F.hasExactDefinition() && !F.getName().startswith("__taint_");
+        }
+
+        void AllocGlobalVal(Module &M) {
+            root = new GlobalVariable(M, tree_ptr, false, GlobalValue::ExternalLinkage, 0, "root");
+            nodes = new GlobalVariable(M, table_ptr, false, GlobalValue::ExternalLinkage, 0, "nodes");
+            root->setInitializer(ConstantPointerNull::get(tree_ptr));
+            nodes->setInitializer(ConstantPointerNull::get(table_ptr));
+        }
+
+        void DefineSites(Module &M) {
+            IRBuilder<> builder(SitesInit);
+            std::map<StringRef, Constant*> names;
+            std::vector<Constant*> entries;
+            for (auto &site: Sites) {
+                Constant *&function = names[site.function];
+                if (function == nullptr) {
+                    function = cast<Constant>(builder.CreateGlobalStringPtr(site.function));
+                }
+                Constant *&kind = names[site.kind];
+                if (kind == nullptr) {
+                    kind = cast<Constant>(builder.CreateGlobalStringPtr(site.kind));
+                }
+                entries.push_back(ConstantStruct::get(site_type, { kind, function, ConstantInt::get(int32_type, site.block),
+                                                                   ConstantInt::get(int32_type, site.line) }));
+            }
+            ArrayType *table_type = ArrayType::get(site_type, Sites.size());
+            GlobalVariable *table = new GlobalVariable(M, table_type, true, GlobalValue::PrivateLinkage,
+                                                       ConstantArray::get(table_type, entries), "__taint_sites");
+            Constant *indices[] = { ConstantInt::get(int32_type, 0), ConstantInt::get(int32_type, 0) };
+            SitesInit->setArgOperand(0, ConstantExpr::getInBoundsGetElementPtr(table_type, table, indices));
+            SitesInit->setArgOperand(1, ConstantInt::get(int32_type, Sites.size()));
+        }
+
+        void AllocLabelSlots(Module &M) {
+            ArrayType *slots_type = ArrayType::get(label_type, kArgSlots);
+            ArgLabels = new GlobalVariable(M, slots_type, false, GlobalValue::InternalLinkage, Constant::getNullValue(slots_type),
+                                           "__taint_arg_labels", nullptr, GlobalVariable::GeneralDynamicTLSModel);
+            ReturnLabel = new GlobalVariable(M, label_type, false, GlobalValue::InternalLinkage, zero,
+                                             "__taint_return_label", nullptr, GlobalVariable::GeneralDynamicTLSModel);
+            EntryLabel = new GlobalVariable(M, label_type, false, GlobalValue::InternalLinkage, zero,
+                                            "__taint_entry_label", nullptr, GlobalVariable::GeneralDynamicTLSModel);
+        }
+
+        void AllocGlobalLabels(Module &M) {
+            std::vector<GlobalVariable*> globals;
+            for (auto &G: M.globals()) {
+                if (!G.isConstant() && !G.getName().startswith("llvm.") && (!ClPrune || Reachability.isMemoryTainted(&G))) {
+                    globals.push_back(&G);
+                }
+            }
+            for (auto G: globals) {
+                GlobalVariable *temp = new GlobalVariable(M, label_type, false, GlobalValue::ExternalLinkage, 0);
+                temp->setInitializer(zero);
+                GlobalToLabelMap[G] = temp;
+            }
+        }
+
+        void InitializeMainArgs(TaintTrackingVisitor &TaintVisitor) {
+            FunctionState &S = TaintVisitor.S;
+            Function &F = S.F;
 
             BasicBlock &BB = F.getEntryBlock();
             IRBuilder<> builder(&BB, BB.getFirstInsertionPt());
-            root_ptr = builder.CreateCall(tree_new);
-            nodes_ptr = builder.CreateCall(table_new);
-            builder.CreateStore(root_ptr, root);
-            builder.CreateStore(nodes_ptr, nodes);
+            if (ClShadowMemory) {
+                builder.CreateCall(shadow_init, ConstantInt::get(int32_type, ShadowGranuleShift));
+            }
 
-            // Entry block is always untainted.
-            zero = ConstantInt::get(int32_type, 0);
-            Value* bitvec = builder.CreateCall(bitvec_new);
-            Value* bitvec_set_args[] = {bitvec, zero, zero};
-            builder.CreateCall(bitvec_set, bitvec_set_args);
-            Value* insert_c_args[] = {root_ptr, bitvec, nodes_ptr };
-            Value* label = builder.CreateCall(insert_c, insert_c_args);
-            Value* bitvec_free_args[] = {bitvec};
-            builder.CreateCall(bitvec_free, bitvec_free_args);
-
-            DirPtr Dirtemp = new Dir;
-            BBInfo *BBtemp;
-            BBtemp = new BBInfo(label, Dirtemp, BB.getTerminator(), BBtemp);
-            BBToBBInfoMap[&BB] = BBtemp;
+            S.BBToBBInfoMap[&BB] = TaintVisitor.newBBInfo(zero);
+
+            // Fixed-width labels need no table. Otherwise the table gets the empty set as label 0, which lets
+            // the pass fold it as a constant, and one singleton per source; the count is filled in once
+            // every function has been instrumented.
+            if (!LabelWords) {
+                S.root_ptr = builder.CreateCall(tree_new);
+                S.nodes_ptr = builder.CreateCall(table_new);
+                builder.CreateStore(S.root_ptr, root);
+                builder.CreateStore(S.nodes_ptr, nodes);
+                Value* sources_init_args[] = {S.root_ptr, S.nodes_ptr, zero};
+                SourcesInit = builder.CreateCall(sources_init, sources_init_args);
+            }
+            // The table of sites is only complete at the end as well.
+            if (ClSiteStats) {
+                Value* sites_init_args[] = {ConstantPointerNull::get(site_type->getPointerTo()), ConstantInt::get(int32_type, 0)};
+                SitesInit = builder.CreateCall(sites_init, sites_init_args);
+            }
 
+            // Each argument the policy names is its own source.
+            const PolicyRules *rules = Policy.source(&F);
             for (auto arg = F.arg_begin(); arg != F.arg_end(); arg++) {
-                Value* bitvec = builder.CreateCall(bitvec_new);
-                // Type is the basic unit.
-                Value* bitvec_set_args[] = {bitvec, ConstantInt::get(int32_type, 1), ConstantInt::get(int32_type, NumOfTaints++)};
-                builder.CreateCall(bitvec_set, bitvec_set_args);
-                Value* insert_c_args[] = {root_ptr, bitvec, nodes_ptr };
-                Value* label = builder.CreateCall(insert_c, insert_c_args);
-                Value* bitvec_free_args[] = {bitvec};
-                builder.CreateCall(bitvec_free, bitvec_free_args);
-                TmpToLabelMap[arg] = label;
+                if (TaintPolicy::coversArg(rules, arg->getArgNo())) {
+                    S.TmpToLabelMap[arg] = TaintVisitor.sourceLabel(NumOfTaints++);
+                }
             }
-
         }
 
-        void InitializeDefineFcnArgsAndLabel(Function &F) {
+        void InitializeDefineFcnArgsAndLabel(TaintTrackingVisitor &TaintVisitor) {
+            FunctionState &S = TaintVisitor.S;
+            Function &F = S.F;
             BasicBlock & BB = F.getEntryBlock();
 
             IRBuilder<> builder(&BB, BB.getFirstInsertionPt());
 
             // We have to reload the label in case the function is called under a branch.
-            Value* BBlabel = builder.CreateLoad(int32_type, FcnToBBLabelMap[&F]);
+            // Unless no call site is ever under a tainted branch, then it is always zero.
+            Value* BBlabel = zero;
+            if (!TaintVisitor.prune(Reachability.isEntryTainted(&F))) {
+                BBlabel = builder.CreateLoad(label_type, EntryLabel);
+            }
 
-            DirPtr Dirtemp = new Dir;
-            BBInfo *BBtemp;
-            BBtemp = new BBInfo(BBlabel, Dirtemp, BB.getTerminator(), BBtemp);
-            BBToBBInfoMap[&BB] = BBtemp;
+            S.BBToBBInfoMap[&BB] = TaintVisitor.newBBInfo(BBlabel);
 
-            root_ptr = builder.CreateLoad(tree_ptr, root);
-            nodes_ptr = builder.CreateLoad(table_ptr, nodes);
+            if (!LabelWords) {
+                S.root_ptr = builder.CreateLoad(tree_ptr, root);
+                S.nodes_ptr = builder.CreateLoad(table_ptr, nodes);
+            }
 
-            std::vector<GlobalVariable*>* argsTaint = FcnToArgsTaintsMap[&F];
             unsigned int index = 0;
             for (auto arg = F.arg_begin(); arg != F.arg_end(); arg++, index++) {
-                Value* label = builder.CreateLoad(int32_type, argsTaint->at(index));
-                TmpToLabelMap[arg] = label;
+                if (TaintVisitor.prune(Reachability.isTainted(&*arg))) {
+                    continue;
+                }
+                Value* label = builder.CreateLoad(label_type, argLabelSlot(index));
+                S.TmpToLabelMap[arg] = label;
+            }
+        }
+
+        void InstrumentFunction(FunctionState &S) {
+            TaintTrackingVisitor TaintVisitor(S);
+
+            if (S.F.getName() == "main") {
+                InitializeMainArgs(TaintVisitor);
+            } else {
+                InitializeDefineFcnArgsAndLabel(TaintVisitor);
+            }
+            for (auto index: S.Order) {
+                S.curBB = S.FcnBBList[index];
+                S.curBBInfo_ptr = TaintVisitor.blockInfo(S.curBB);
+                for (auto instr_iter = S.FcnInstrList[index].begin(); instr_iter != S.FcnInstrList[index].end(); instr_iter++) {
+                    //(*instr_iter)->print(errs());
+                    //std::cout << std::endl;
+                    TaintVisitor.visit(**instr_iter);
+                }
+            }
+
+            FinishLoopPhis(TaintVisitor);
+            // With sinks the slice leaves most blocks without labels, and the sink reports take their place.
+            if (!Policy.hasSinks()) {
+                display(TaintVisitor);
+            }
+            if (ClBlockTrace) {
+                TraceBlocks(TaintVisitor);
+            }
+            HoistLoopInvariantLabels(S);
+            PromoteLabelSlots(S);
+            if (ClSiteStats) {
+                CountSites(S);
+            }
+            InlineUnionCalls(S);
+            GuardSinkChecks(S);
+            if (ClDual) {
+                SwitchTracking(S.F);
             }
+            //std::cout << "-----------------------" << std::endl;
         }
 
         virtual bool runOnModule(Module &M) {
+            NumOfTaints = 0;
+            NumOfBlocks = 0;
+            NumOfSinks = 0;
+            SinkNames.clear();
+            SourcesInit = nullptr;
+            SitesInit = nullptr;
+            Sites.clear();
+
+            if (ClShadowGranule != 1 && ClShadowGranule != 4) {
+                report_fatal_error("taint-shadow-granule: must be 1 or 4, not " + Twine(ClShadowGranule), false);
+            }
+            ShadowGranuleShift = ClShadowGranule == 1 ? 0 : 2;
+
+            if (ClPolicy.empty()) {
+                Policy.setDefault();
+            } else {
+                Policy.load(ClPolicy);
+            }
+
+            // Decide what needs instrumenting before the module is touched.
+            data_layout = &M.getDataLayout();
+            Reachability.run(M, *data_layout);
+
             // Get the function to call from our runtime library.
             FuncDeclare(M);
+            ChooseLabelType(M);
+            AllocGlobalLabels(M);
             AllocGlobalVal(M);
-            AllocDefineFcnArgsTaints(M);
-            AllocDefineFcnRtnTaint(M);
-            AllocDefineFcnBBLabel(M);
+            AllocLabelSlots(M);
+            DefineUnionInline(M);
+            DefineRunInline(M);
+            if (ClDual) {
+                CloneNativeFunctions(M);
+            }
 
+            // Building the analyses only reads the IR, so it runs on the pool a batch of functions at a time.
+            // Instrumenting creates instructions and constants in the shared LLVMContext, which is not
+            // thread-safe, so that part stays on this thread and consumes the batch in module order.
+            std::vector<Function*> Fcns;
+            unsigned instructions = 0;
             for (auto &F: M) {
-                if (F.hasExactDefinition()) {
-                    std::vector<std::vector<Instruction*>*> FcnInstrList;
-                    std::vector<BasicBlock*> FcnBBList;
+                if (isInstrumented(F)) {
+                    Fcns.push_back(&F);
+                    instructions += F.getInstructionCount();
+                }
+            }
 
-                    for (auto &B: F) {
-                        std::vector<Instruction*>* temp = new std::vector<Instruction*>;
-                        FcnBBList.push_back(&B);
-                        for (auto &I: B) {
-                            temp->push_back(&I);
-                        }
-                        FcnInstrList.push_back(temp);
-                    }
+            ThreadPool Pool(ClThreads == 0 ? hardware_concurrency() : ClThreads);
+            for (size_t begin = 0; begin < Fcns.size(); begin += kFunctionBatch) {
+                size_t end = std::min(Fcns.size(), begin + kFunctionBatch);
+                std::vector<std::unique_ptr<FunctionState>> States(end - begin);
 
-                    if (F.getName() == "main") {
-                        InitializeMainArgs(F);
-                    } else {
-                        InitializeDefineFcnArgsAndLabel(F);
-                    }
-                    auto bb_iter = FcnBBList.begin();
-                    for (auto bbinstr_iter = FcnInstrList.begin(); bbinstr_iter != FcnInstrList.end() && bb_iter
-                            != FcnBBList.end(); bbinstr_iter++, bb_iter++) {
-                        curBBInfo_ptr = BBToBBInfoMap.find(*bb_iter)->second;
-                        std::vector<Instruction*>* bbinstrs = *bbinstr_iter;
-                        for (auto instr_iter = bbinstrs->begin(); instr_iter != bbinstrs->end(); instr_iter++) {
-                            //(*instr_iter)->print(errs());
-                            //std::cout << std::endl;
-                            TaintVisitor.visit(**instr_iter);
-                        }
-                    }
+                auto analysis_start = std::chrono::steady_clock::now();
+                for (size_t index = begin; index < end; index++) {
+                    Pool.async([&States, &Fcns, begin, index]() {
+                        States[index - begin].reset(new FunctionState(*Fcns[index]));
+                    });
+                }
+                Pool.wait();
+                auto analysis_end = std::chrono::steady_clock::now();
+                AnalysisTime += analysis_end - analysis_start;
 
-                    display(FcnBBList);
-                    //std::cout << "-----------------------" << std::endl;
+                for (auto &State: States) {
+                    InstrumentFunction(*State);
+                    State.reset();
                 }
+                InstrumentTime += std::chrono::steady_clock::now() - analysis_end;
+            }
+
+            if (SourcesInit) {
+                SourcesInit->setArgOperand(2, ConstantInt::get(int32_type, NumOfTaints));
+            }
+            if (SitesInit) {
+                DefineSites(M);
+            }
+
+            if (ClPruneReport) {
+                errs() << "TaintTracking: pruned " << NumOfPrunedSites << " of " << NumOfSites
+                       << " instrumentation sites, folded " << NumOfFoldedUnions << " constant unions, hoisted "
+                       << NumOfHoistedLabels << " label instructions out of loops\n";
+            }
+
+            if (ClTimeReport) {
+                errs() << "TaintTracking: " << Fcns.size() << " functions, " << instructions << " instructions,"
+                       << " analyses " << format("%.3f", AnalysisTime.count()) << "s, instrumenting "
+                       << format("%.3f", InstrumentTime.count()) << "s\n";
+            }
+
+            // Every call site has been inlined, the body is dead weight now.
+            if (union_inline->use_empty()) {
+                union_inline->eraseFromParent();
+            }
+            if (run_inline->use_empty()) {
+                run_inline->eraseFromParent();
             }
 
             //print(M);
@@ -785,14 +2902,37 @@ namespace {
             }
         }
 
-        void display(std::vector<BasicBlock*> &B) {
+        // The label of every block goes to the taint trace (tool/src/trace.rs) before the function's last block
+        // returns; taint_decode prints them.
+        void display(TaintTrackingVisitor &TaintVisitor) {
+            FunctionState &S = TaintVisitor.S;
+            Function &F = S.F;
+            std::vector<BasicBlock*> &B = S.FcnBBList;
             unsigned int total = B.size();
-            Constant* totalNum = ConstantInt::get(int32_type, NumOfTaints);
+            Constant* totalNum = ConstantInt::get(int32_type, LabelWords? NumOfSources: NumOfTaints);
+
+            // A fixed-width label is handed to the runtime through memory, as its words.
+            Value *words = nullptr;
+            if (LabelWords) {
+                BasicBlock &entry = F.getEntryBlock();
+                IRBuilder<> builder(&entry, entry.getFirstInsertionPt());
+                words = builder.CreateAlloca(label_type);
+            }
+
             for (unsigned int id = 0; id < total; id++) {
-                auto bbinfo_iter = BBToBBInfoMap.find(B.at(id));
-                IRBuilder<> builder(B[total-1]->getTerminator());
-                Value* bitvec_print_args[] = {nodes_ptr, bbinfo_iter->second->label, totalNum, ConstantInt::get(int32_type, id)};
-                builder.CreateCall(bitvec_print, bitvec_print_args);
+                auto bbinfo_iter = S.BBToBBInfoMap.find(B.at(id));
+                Instruction *exit = B[total-1]->getTerminator();
+                IRBuilder<> builder(exit);
+                Value *label = TaintVisitor.labelAt(bbinfo_iter->second, exit);
+                if (LabelWords) {
+                    builder.CreateStore(label, words);
+                    Value* trace_bitset_args[] = {builder.CreateBitCast(words, int64_type->getPointerTo()),
+                                                  ConstantInt::get(int32_type, LabelWords), totalNum, ConstantInt::get(int32_type, id)};
+                    builder.CreateCall(trace_bitset, trace_bitset_args);
+                } else {
+                    Value* trace_label_args[] = {S.nodes_ptr, label, totalNum, ConstantInt::get(int32_type, id)};
+                    builder.CreateCall(trace_label, trace_label_args);
+                }
             }
         }
 
@@ -803,8 +2943,14 @@ char TaintTrackingPass::ID = 0;
 
 //Automatically enable the pass.
 //http://adriansampson.net/blog/clangpass.html
-static void registerTaintTrackingPass(const PassManagerBuilder &,
+//At -O1 and above the module passes start after the per-function cleanup (SROA, EarlyCSE), so the pass sees
+//values in registers instead of stack slots, and the inliner, GVN, LICM and DCE that follow optimize the label
+//code along with the program. mem2reg catches whatever a driver without that cleanup left in allocas.
+static void registerTaintTrackingPass(const PassManagerBuilder &Builder,
                                  legacy::PassManagerBase &PM) {
+    if (Builder.OptLevel > 0) {
+        PM.add(createPromoteMemoryToRegisterPass());
+    }
     PM.add(new TaintTrackingPass());
 }
 
@@ -0,0 +1,166 @@
+// The C entry points an instrumented program calls, at label widths of 1, 8 and 64 words and at
+// different rates of hitting what the table or the memo already holds. Prints CSV, one line per
+// function, width and hit rate, so runs can be diffed; find, label_has_source and bitvec_print do not
+// depend on the hit rate and leave it empty. union_c_lazy is union_c on a TAINT_LAZY_LABELS table, and
+// resolve_all the cost per label of building its results afterwards. bitvec_print writes to /dev/null while it is timed.
+// Run with `cargo bench --bench api`, or through the bench_runtime target.
+extern crate tool;
+extern crate bit_vec;
+extern crate libc;
+
+use std::hint::black_box;
+use std::time::Instant;
+use bit_vec::BitVec;
+use tool::*;
+
+const WIDTHS: [usize; 3] = [64, 512, 4096];
+const HIT_RATES: [f64; 3] = [0.0, 0.5, 0.95];
+const CALLS: usize = 200_000;
+const PRINTS: usize = 20_000;
+// Sets a program keeps coming back to, like the labels of one hot loop.
+const HOT: usize = 64;
+
+struct Rng(u64);
+
+impl Rng {
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0
+    }
+
+    fn below(&mut self, bound: usize) -> usize {
+        self.next() as usize % bound
+    }
+
+    fn hit(&mut self, rate: f64) -> bool {
+        ((self.next() % 1_000_000) as f64) < rate * 1_000_000.0
+    }
+}
+
+fn report(function: &str, sources: usize, hit_rate: Option<f64>, calls: usize, start: Instant) {
+    let elapsed = start.elapsed();
+    let seconds = elapsed.as_secs() as f64 + elapsed.subsec_nanos() as f64 * 1e-9;
+    let rate = hit_rate.map_or(String::new(), |rate| format!("{:.2}", rate));
+    println!("{},{},{},{:.1}", function, sources, rate, seconds * 1e9 / calls as f64);
+}
+
+// A set of three random sources, the widest of them picking how many words the label takes.
+fn vector(rng: &mut Rng, sources: usize) -> BitVec {
+    let mut vector = BitVec::from_elem(sources, false);
+    for _ in 0..3 {
+        vector.set(rng.below(sources), true);
+    }
+    vector
+}
+
+fn main() {
+    let mut rng = Rng(0x2545f4914f6cdd1d);
+    let mut sink = 0usize;
+    println!("function,sources,hit_rate,ns_per_call");
+
+    for &sources in WIDTHS.iter() {
+        for &rate in HIT_RATES.iter() {
+            let mut tree = Tree::new();
+            let mut nodes = Table::new();
+            init_sources(&tree, &nodes, sources);
+
+            // Every call interns its vector; a hit is one of the hot sets, a miss most likely a new one.
+            let hot: Vec<BitVec> = (0..HOT).map(|_| vector(&mut rng, sources)).collect();
+            for set in hot.iter() {
+                insert(&tree, &mut set.clone(), &nodes);
+            }
+            let mut vectors: Vec<BitVec> = (0..CALLS).map(|_| {
+                if rng.hit(rate) { hot[rng.below(HOT)].clone() } else { vector(&mut rng, sources) }
+            }).collect();
+            let start = Instant::now();
+            for vector in vectors.iter_mut() {
+                sink ^= insert_c(&mut tree, vector, &mut nodes) as usize;
+            }
+            report("insert_c", sources, Some(rate), CALLS, start);
+
+            // A hit unions a hot pair the memo has seen, a miss a label of the table with a random source.
+            let labels = nodes.len();
+            let pairs: Vec<(u32, u32)> = (0..HOT).map(|_| {
+                (rng.below(labels) as u32, source_label(rng.below(sources)) as u32)
+            }).collect();
+            for &(label1, label2) in pairs.iter() {
+                union_c(label1, label2, &mut nodes, &mut tree);
+            }
+            let operands: Vec<(u32, u32)> = (0..CALLS).map(|_| {
+                if rng.hit(rate) {
+                    pairs[rng.below(HOT)]
+                } else {
+                    (rng.below(labels) as u32, source_label(rng.below(sources)) as u32)
+                }
+            }).collect();
+            let start = Instant::now();
+            for &(label1, label2) in operands.iter() {
+                sink ^= union_c(label1, label2, &mut nodes, &mut tree) as usize;
+            }
+            report("union_c", sources, Some(rate), CALLS, start);
+
+            // The same unions on a lazy table holding the same labels: a miss only records the pair, and
+            // resolve_all builds every result afterwards, as the trace does at exit.
+            let mut lazy_tree = Tree::new();
+            let mut lazy = Table::lazy();
+            init_sources(&lazy_tree, &lazy, sources);
+            for set in hot.iter().chain(vectors.iter()) {
+                insert(&lazy_tree, &mut set.clone(), &lazy);
+            }
+            assert_eq!(lazy.len(), labels);
+            for &(label1, label2) in pairs.iter() {
+                union_c(label1, label2, &mut lazy, &mut lazy_tree);
+            }
+            let start = Instant::now();
+            let results: Vec<u32> = operands.iter()
+                .map(|&(label1, label2)| union_c(label1, label2, &mut lazy, &mut lazy_tree))
+                .collect();
+            report("union_c_lazy", sources, Some(rate), CALLS, start);
+            let start = Instant::now();
+            resolve_all(&results, &lazy);
+            report("resolve_all", sources, Some(rate), CALLS, start);
+            sink ^= results.iter().map(|label| lazy.words(*label as usize).len()).sum::<usize>();
+        }
+
+        let tree = Tree::new();
+        let nodes = Table::new();
+        init_sources(&tree, &nodes, sources);
+        for _ in 0..HOT * 16 {
+            insert(&tree, &mut vector(&mut rng, sources), &nodes);
+        }
+        let queries: Vec<usize> = (0..CALLS).map(|_| rng.below(nodes.len())).collect();
+        let start = Instant::now();
+        for &label in queries.iter() {
+            sink ^= black_box(find(label, &nodes)).len();
+        }
+        report("find", sources, None, CALLS, start);
+
+        let table = &nodes as *const Table as *mut Table;
+        let start = Instant::now();
+        for (index, &label) in queries.iter().enumerate() {
+            sink ^= label_has_source(table, label as u32, (index % sources) as u32) as usize;
+        }
+        report("label_has_source", sources, None, CALLS, start);
+
+        let stdout = unsafe {
+            let saved = libc::dup(1);
+            let null = libc::open(b"/dev/null\0".as_ptr() as *const libc::c_char, libc::O_WRONLY);
+            libc::dup2(null, 1);
+            libc::close(null);
+            saved
+        };
+        let start = Instant::now();
+        for (block, &label) in queries.iter().take(PRINTS).enumerate() {
+            bitvec_print(table, label as u32, sources as u32, block as u32);
+        }
+        unsafe {
+            libc::dup2(stdout, 1);
+            libc::close(stdout);
+        }
+        report("bitvec_print", sources, None, PRINTS, start);
+    }
+
+    eprintln!("checksum {}", sink);
+}
@@ -0,0 +1,99 @@
+// Label table footprint and lookup latency: how much the arenas hold per label,
+// and what find and a word-slice read cost once the table is large. Also what a taint
+// source used to cost at run time, against building every singleton once at startup, and what
+// the table holds once it hits a budget.
+// Run with `cargo bench --bench labels`.
+extern crate tool;
+extern crate bit_vec;
+
+use std::time::Instant;
+use bit_vec::BitVec;
+use tool::*;
+
+const SOURCES: usize = 256;
+const LABELS: usize = 200_000;
+const LOOKUPS: usize = 1_000_000;
+
+fn seconds(start: Instant) -> f64 {
+    let elapsed = start.elapsed();
+    elapsed.as_secs() as f64 + elapsed.subsec_nanos() as f64 * 1e-9
+}
+
+fn main() {
+    let mut tree = Box::new(Tree::new());
+    let mut nodes = Box::new(Table::new());
+
+    insert(&mut tree, &mut BitVec::new(), &mut nodes);
+    for source in 0..SOURCES {
+        let mut vector = BitVec::from_elem(source + 1, false);
+        vector.set(source, true);
+        insert(&mut tree, &mut vector, &mut nodes);
+    }
+
+    // Grow the table with unions of a random label and a random source, like a long run does.
+    let mut state: u64 = 0x2545f4914f6cdd1d;
+    let mut next = || {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        state
+    };
+    let start = Instant::now();
+    while nodes.len() < LABELS {
+        let label = next() as usize % nodes.len();
+        let source = 1 + next() as usize % SOURCES;
+        union_uncached(label, source, &mut nodes, &mut tree);
+    }
+    let build = seconds(start);
+
+    let bytes = nodes.memory_bytes() + tree.memory_bytes();
+    println!("{:<24} {:>12}", "labels", nodes.len());
+    println!("{:<24} {:>12} bytes ({:.1} per label)", "memory", bytes, bytes as f64 / nodes.len() as f64);
+    println!("{:<24} {:>12.0} ns/label", "build", build * 1e9 / nodes.len() as f64);
+
+    let queries: Vec<usize> = (0..LOOKUPS).map(|_| next() as usize % nodes.len()).collect();
+    let mut sink = 0;
+
+    let start = Instant::now();
+    for &label in queries.iter() {
+        sink ^= nodes.words(label).iter().fold(0, |acc, word| acc ^ word) as usize;
+    }
+    println!("{:<24} {:>12.1} ns/lookup", "words", seconds(start) * 1e9 / LOOKUPS as f64);
+
+    let start = Instant::now();
+    for &label in queries.iter().take(LOOKUPS / 10) {
+        sink ^= find(label, &nodes).len();
+    }
+    println!("{:<24} {:>12.1} ns/lookup", "find", seconds(start) * 1e9 / (LOOKUPS / 10) as f64);
+
+    // A source through the C entry points, the way the pass used to emit it for every scanf target.
+    let start = Instant::now();
+    for index in 0..LOOKUPS / 10 {
+        let vector = bitvec_new();
+        bitvec_set(vector, 1, (index % SOURCES) as u32);
+        sink ^= insert_c(&mut *tree, vector, &mut *nodes) as usize;
+        bitvec_free(vector);
+    }
+    println!("{:<24} {:>12.1} ns/source", "bitvec source", seconds(start) * 1e9 / (LOOKUPS / 10) as f64);
+
+    // Now a source is a constant label, the only run-time cost left is filling the table at startup.
+    let start = Instant::now();
+    init_sources(&Tree::new(), &Table::new(), SOURCES);
+    println!("{:<24} {:>12.1} ns/source", "init_sources", seconds(start) * 1e9 / SOURCES as f64);
+
+    // The same growth with a quarter of that memory: past the budget new sets get the overflow label.
+    let budget = bytes / 4;
+    let (tree, nodes) = (Tree::new(), Table::with_budget(budget));
+    init_sources(&tree, &nodes, SOURCES);
+    let start = Instant::now();
+    for _ in 0..LABELS {
+        let label = next() as usize % nodes.len();
+        let source = source_label(next() as usize % SOURCES);
+        sink ^= union_uncached(label, source, &nodes, &tree).unwrap();
+    }
+    let stats = nodes.stats(&tree);
+    println!("{:<24} {:>12} labels in {} of {} bytes, {} overflows, {:.0} ns/union", "budget", stats.labels,
+             stats.bytes, budget, stats.overflows, seconds(start) * 1e9 / LABELS as f64);
+
+    println!("checksum {}", sink);
+}
@@ -0,0 +1,99 @@
+// Union throughput with every thread of the program sharing one label table, at 1, 2, 4, 8 and
+// (if the machine has more) all cores. "repeat" unions come from a small working set and hit the
+// per-thread memo; "fresh" unions keep building new sets and go through the sharded index, or on a
+// TAINT_SHARED_LABELS table through its lock-free one.
+// Run with `cargo bench --bench threads`.
+extern crate tool;
+extern crate bit_vec;
+
+use std::sync::Arc;
+use std::thread;
+use std::time::Instant;
+use bit_vec::BitVec;
+use tool::*;
+
+const SOURCES: usize = 256;
+const CALLS: usize = 1_000_000;
+
+fn setup(shared: bool) -> (Arc<Tree>, Arc<Table>, Arc<Vec<usize>>) {
+    let tree = Tree::new();
+    let nodes = if shared { Table::shared(128 << 20).unwrap() } else { Table::new() };
+    let mut labels = Vec::new();
+
+    insert(&tree, &mut BitVec::new(), &nodes);
+    for source in 0..SOURCES {
+        let mut vector = BitVec::from_elem(source + 1, false);
+        vector.set(source, true);
+        labels.push(insert(&tree, &mut vector, &nodes).unwrap());
+    }
+    (Arc::new(tree), Arc::new(nodes), Arc::new(labels))
+}
+
+fn xorshift(state: &mut u64) -> u64 {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    *state
+}
+
+// Pairs of a few hot labels with any source, like the unions of one hot loop.
+fn repeat(tree: &Tree, nodes: &Table, labels: &[usize], seed: u64) -> usize {
+    let mut state = seed;
+    let mut sink = 0;
+    for _ in 0..CALLS {
+        let random = xorshift(&mut state);
+        let a = labels[(random % 8) as usize];
+        let b = labels[((random >> 8) % labels.len() as u64) as usize];
+        sink ^= union(a, b, nodes, tree).unwrap();
+    }
+    sink
+}
+
+// Random sources folded into a running label that is reset now and then, so most sets are new.
+fn fresh(tree: &Tree, nodes: &Table, labels: &[usize], seed: u64) -> usize {
+    let mut state = seed;
+    let mut running = 0;
+    let mut sink = 0;
+    for _ in 0..CALLS / 10 {
+        let random = xorshift(&mut state);
+        if random % 16 == 0 {
+            running = 0;
+        }
+        running = union(running, labels[((random >> 8) % labels.len() as u64) as usize], nodes, tree).unwrap();
+        sink ^= running;
+    }
+    sink
+}
+
+fn run(threads: usize, calls: usize, work: fn(&Tree, &Table, &[usize], u64) -> usize, shared: bool) -> f64 {
+    let (tree, nodes, labels) = setup(shared);
+    let start = Instant::now();
+    let workers: Vec<_> = (0..threads).map(|index| {
+        let (tree, nodes, labels) = (tree.clone(), nodes.clone(), labels.clone());
+        thread::spawn(move || work(&tree, &nodes, &labels, 0x2545f4914f6cdd1d + index as u64 * 0x9e3779b97f4a7c15))
+    }).collect();
+    let sink = workers.into_iter().fold(0, |sink, worker| sink ^ worker.join().unwrap());
+
+    let elapsed = start.elapsed();
+    let seconds = elapsed.as_secs() as f64 + elapsed.subsec_nanos() as f64 * 1e-9;
+    if sink == usize::max_value() {
+        println!("checksum {}", sink);
+    }
+    (threads * calls) as f64 / seconds
+}
+
+fn main() {
+    let cores = thread::available_parallelism().map(|cores| cores.get()).unwrap_or(1);
+    let mut counts = vec![1, 2, 4, 8];
+    if cores > 8 {
+        counts.push(cores);
+    }
+
+    println!("{:>8} {:>16} {:>16} {:>16}", "threads", "repeat unions/s", "fresh unions/s", "shared fresh/s");
+    for &threads in counts.iter() {
+        let hits = run(threads, CALLS, repeat, false);
+        let misses = run(threads, CALLS / 10, fresh, false);
+        let shared = run(threads, CALLS / 10, fresh, true);
+        println!("{:>8} {:>16.0} {:>16.0} {:>16.0}", threads, hits, misses, shared);
+    }
+}
@@ -0,0 +1,74 @@
+// Union throughput: the memoized union_c against the old find/or/insert path.
+// Run with `cargo bench --bench union`.
+extern crate tool;
+extern crate bit_vec;
+
+use std::time::Instant;
+use bit_vec::BitVec;
+use tool::*;
+
+const SOURCES: usize = 64;
+const CALLS: usize = 1_000_000;
+
+fn setup() -> (Box<Tree>, Box<Table>, Vec<usize>) {
+    let mut tree = Box::new(Tree::new());
+    let mut nodes = Box::new(Table::new());
+    let mut labels = Vec::new();
+
+    insert(&mut tree, &mut BitVec::new(), &mut nodes);
+    for source in 0..SOURCES {
+        let mut vector = BitVec::from_elem(source, false);
+        vector.push(true);
+        labels.push(insert(&mut tree, &mut vector, &mut nodes).unwrap());
+    }
+    (tree, nodes, labels)
+}
+
+// Deterministic operand stream drawn from a small working set, like the unions of one hot loop.
+fn operands(labels: &[usize], count: usize) -> Vec<(u32, u32)> {
+    let mut state: u64 = 0x2545f4914f6cdd1d;
+    let mut pairs = Vec::with_capacity(count);
+    for _ in 0..count {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        let a = labels[(state % 8) as usize];
+        let b = labels[((state >> 8) % labels.len() as u64) as usize];
+        pairs.push((a as u32, b as u32));
+    }
+    pairs
+}
+
+fn report(name: &str, calls: usize, start: Instant) {
+    let elapsed = start.elapsed();
+    let seconds = elapsed.as_secs() as f64 + elapsed.subsec_nanos() as f64 * 1e-9;
+    println!("{:<24} {:>12.0} calls/s", name, calls as f64 / seconds);
+}
+
+fn main() {
+    let (mut tree, mut nodes, labels) = setup();
+    let pairs = operands(&labels, CALLS);
+
+    let uncached_calls = CALLS / 10;
+    let start = Instant::now();
+    let mut sink = 0;
+    for &(a, b) in pairs.iter().take(uncached_calls) {
+        sink ^= union_uncached(a as usize, b as usize, &mut nodes, &mut tree).unwrap();
+    }
+    report("union (uncached)", uncached_calls, start);
+
+    let start = Instant::now();
+    for &(a, b) in pairs.iter() {
+        sink ^= union_c(a, b, &mut *nodes, &mut *tree) as usize;
+    }
+    report("union_c (memoized)", CALLS, start);
+
+    let start = Instant::now();
+    for &(a, _) in pairs.iter() {
+        sink ^= union_c(a, a, &mut *nodes, &mut *tree) as usize;
+        sink ^= union_c(a, 0, &mut *nodes, &mut *tree) as usize;
+    }
+    report("union_c (fast path)", 2 * CALLS, start);
+
+    println!("checksum {}", sink);
+}
@@ -0,0 +1,26 @@
+// Prints a taint trace the way the runtime used to print taints at exit.
+// Usage: taint_decode [trace], taint.trace by default.
+extern crate tool;
+
+use std::env;
+use std::fs::File;
+use std::io::{self, BufReader, BufWriter};
+use std::process;
+
+fn main() {
+    let path = env::args().nth(1).unwrap_or("taint.trace".to_string());
+    let file = match File::open(&path) {
+        Ok(file) => file,
+        Err(error) => {
+            eprintln!("taint_decode: cannot open {}: {}", path, error);
+            process::exit(1);
+        }
+    };
+
+    let stdout = io::stdout();
+    let mut out = BufWriter::new(stdout.lock());
+    if let Err(error) = tool::trace::decode(&mut BufReader::new(file), &mut out) {
+        eprintln!("taint_decode: {}: {}", path, error);
+        process::exit(1);
+    }
+}
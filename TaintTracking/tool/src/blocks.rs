@@ -0,0 +1,281 @@
+// Block entry tracing for -taint-block-trace.
+//
+// Every instrumented block calls block_enter (runtime table labels) or block_enter_set (fixed-width
+// labels) with its id and label. The record goes to a fixed-size ring owned by the calling thread: one
+// producer, the thread, and one consumer, the flusher, so a push is a couple of atomic loads and a store,
+// never a lock or a system call. When the flusher falls behind and a ring is full, the record is dropped
+// and counted instead of making the program wait.
+//
+// The flusher is a background thread started with the first ring. It drains every ring into the trace
+// ($TAINT_BLOCK_TRACE, or taint.blocks in the working directory) in the format of trace.rs, defining
+// each label once, and drains them one last time at exit(). A thread that exits drains and frees its own.
+// A process forked from the program writes a block trace of its own, with its pid appended to the name. $TAINT_SAMPLE=N records only every N-th
+// block entry of each thread, to bound the cost of leaving tracing on.
+
+use std::cell::{Cell, RefCell, UnsafeCell};
+use std::collections::{HashMap, HashSet};
+use std::env;
+use std::fs::File;
+use std::io::Write;
+use std::sync::atomic::{AtomicPtr, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex, MutexGuard, Once};
+use std::thread;
+use std::time::Duration;
+use std::ptr;
+use libc::{self, uint32_t};
+use Table;
+use trace::*;
+
+const RING_ENTRIES: usize = 1 << 13;
+const FLUSH_INTERVAL_MS: u64 = 10;
+
+#[derive(Clone, Copy)]
+struct Entry {
+    block: u32,
+    // 0 for a label of the runtime table, which is then words[0]; otherwise the words of a fixed-width label.
+    width: u32,
+    words: [u64; 4],
+}
+
+struct Ring {
+    entries: Box<[UnsafeCell<Entry>]>,
+    head: AtomicUsize,
+    tail: AtomicUsize,
+    dropped: AtomicUsize,
+}
+
+// Only the owning thread writes entries, and only between tail and head + RING_ENTRIES, which the
+// flusher does not read until head has moved past them.
+unsafe impl Sync for Ring {}
+unsafe impl Send for Ring {}
+
+impl Ring {
+    fn new() -> Self {
+        let empty = Entry { block: 0, width: 0, words: [0; 4] };
+        Ring {
+            entries: (0..RING_ENTRIES).map(|_| UnsafeCell::new(empty)).collect::<Vec<_>>().into_boxed_slice(),
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+            dropped: AtomicUsize::new(0),
+        }
+    }
+
+    // Called by the owning thread only.
+    fn push(&self, entry: Entry) {
+        let head = self.head.load(Ordering::Relaxed);
+        if head - self.tail.load(Ordering::Acquire) == RING_ENTRIES {
+            self.dropped.store(self.dropped.load(Ordering::Relaxed) + 1, Ordering::Relaxed);
+            return;
+        }
+        unsafe {
+            *self.entries[head % RING_ENTRIES].get() = entry;
+        }
+        self.head.store(head + 1, Ordering::Release);
+    }
+}
+
+struct Producer {
+    ring: Arc<Ring>,
+    countdown: Cell<usize>,
+}
+
+thread_local!(static PRODUCER: Producer = Producer::register());
+// The ring of the calling thread once it has one, for a child to find after a fork.
+thread_local!(static OWN_RING: RefCell<Option<Arc<Ring>>> = RefCell::new(None));
+
+static RINGS: Mutex<Vec<Arc<Ring>>> = Mutex::new(Vec::new());
+// Records dropped by the rings of threads that have exited.
+static DROPPED: AtomicUsize = AtomicUsize::new(0);
+static START: Once = Once::new();
+static SAMPLE: AtomicUsize = AtomicUsize::new(1);
+// The table of the instrumented program, set by sources_init, to define table labels in the trace.
+pub static TABLE: AtomicPtr<Table> = AtomicPtr::new(ptr::null_mut());
+
+impl Producer {
+    fn register() -> Self {
+        START.call_once(|| {
+            let sample = env::var("TAINT_SAMPLE").ok().and_then(|rate| rate.parse().ok()).unwrap_or(1);
+            SAMPLE.store(if sample == 0 { 1 } else { sample }, Ordering::Relaxed);
+            start_flusher();
+            unsafe {
+                libc::atexit(drain_at_exit);
+                libc::pthread_atfork(Some(before_fork), Some(after_fork_parent), Some(after_fork_child));
+            }
+        });
+
+        let ring = Arc::new(Ring::new());
+        RINGS.lock().unwrap().push(ring.clone());
+        OWN_RING.with(|own| *own.borrow_mut() = Some(ring.clone()));
+        Producer { ring: ring, countdown: Cell::new(0) }
+    }
+
+    fn record(&self, entry: Entry) {
+        let countdown = self.countdown.get();
+        if countdown != 0 {
+            self.countdown.set(countdown - 1);
+            return;
+        }
+        self.countdown.set(SAMPLE.load(Ordering::Relaxed) - 1);
+        self.ring.push(entry);
+    }
+}
+
+// A thread that exits drains its ring one last time and gives it up, so a program that keeps starting
+// threads does not keep a ring for each of them.
+impl Drop for Producer {
+    fn drop(&mut self) {
+        drain(false);
+        RINGS.lock().unwrap().retain(|ring| !Arc::ptr_eq(ring, &self.ring));
+        DROPPED.fetch_add(self.ring.dropped.load(Ordering::Relaxed), Ordering::Relaxed);
+    }
+}
+
+// What the consumer side has written so far.
+struct Drain {
+    file: Option<File>,
+    bytes: Vec<u8>,
+    labels: HashSet<u32>,
+    sets: HashMap<[u64; 4], u32>,
+}
+
+static DRAIN: Mutex<Option<Drain>> = Mutex::new(None);
+
+fn drain(last: bool) {
+    let mut state = DRAIN.lock().unwrap();
+    if state.is_none() {
+        let mut bytes = Vec::new();
+        bytes.push(SAMPLE_TAG);
+        put_u32(&mut bytes, SAMPLE.load(Ordering::Relaxed) as u32);
+        *state = Some(Drain { file: create("TAINT_BLOCK_TRACE", "taint.blocks"), bytes: bytes,
+                              labels: HashSet::new(), sets: HashMap::new() });
+    }
+    let state = state.as_mut().unwrap();
+    let table = TABLE.load(Ordering::Acquire);
+
+    let rings = RINGS.lock().unwrap().clone();
+    let mut dropped = DROPPED.load(Ordering::Relaxed);
+    for ring in rings.iter() {
+        let tail = ring.tail.load(Ordering::Relaxed);
+        let head = ring.head.load(Ordering::Acquire);
+        for index in tail..head {
+            let entry = unsafe { *ring.entries[index % RING_ENTRIES].get() };
+            if entry.width == 0 {
+                let label = entry.words[0] as u32;
+                if state.labels.insert(label) {
+                    let words = if table.is_null() { &[][..] } else { unsafe { (*table).words(label as usize) } };
+                    encode_set(&mut state.bytes, LABEL_TAG, label, words);
+                }
+                encode_enter(&mut state.bytes, ENTER_TAG, entry.block, label);
+            } else {
+                let next = state.sets.len() as u32;
+                let id = *state.sets.entry(entry.words).or_insert(next);
+                if id == next {
+                    encode_set(&mut state.bytes, SET_TAG, id, &entry.words[..entry.width as usize]);
+                }
+                encode_enter(&mut state.bytes, ENTER_SET_TAG, entry.block, id);
+            }
+        }
+        ring.tail.store(head, Ordering::Release);
+        if last {
+            dropped += ring.dropped.load(Ordering::Relaxed);
+        }
+    }
+
+    if last {
+        state.bytes.push(DROPPED_TAG);
+        put_u32(&mut state.bytes, dropped as u32);
+    }
+    if let Some(ref mut file) = state.file {
+        if let Err(error) = file.write_all(&state.bytes) {
+            eprintln!("taint: cannot write block trace: {}", error);
+        }
+    }
+    state.bytes.clear();
+}
+
+extern fn drain_at_exit() {
+    drain(true);
+}
+
+fn start_flusher() {
+    thread::spawn(|| loop {
+        thread::sleep(Duration::from_millis(FLUSH_INTERVAL_MS));
+        drain(false);
+    });
+}
+
+// The thread that forks holds both locks across the fork, in the order drain takes them, so the child never
+// starts with one held by a thread it does not have.
+thread_local!(static FORK_GUARDS: RefCell<Option<(MutexGuard<'static, Option<Drain>>,
+                                                  MutexGuard<'static, Vec<Arc<Ring>>>)>> = RefCell::new(None));
+
+extern fn before_fork() {
+    let guards = (DRAIN.lock().unwrap(), RINGS.lock().unwrap());
+    FORK_GUARDS.with(|held| *held.borrow_mut() = Some(guards));
+}
+
+extern fn after_fork_parent() {
+    FORK_GUARDS.with(|held| held.borrow_mut().take());
+}
+
+// The child keeps only the ring of the thread that forked, empty, since the parent writes out what was in
+// them, starts a block trace of its own (see output_path) and a flusher for it.
+extern fn after_fork_child() {
+    forked();
+    let own = OWN_RING.with(|own| own.borrow().clone());
+    if let Some((mut state, mut rings)) = FORK_GUARDS.with(|held| held.borrow_mut().take()) {
+        *state = None;
+        rings.retain(|ring| own.as_ref().map_or(false, |own| Arc::ptr_eq(ring, own)));
+        for ring in rings.iter() {
+            ring.tail.store(ring.head.load(Ordering::Relaxed), Ordering::Relaxed);
+            ring.dropped.store(0, Ordering::Relaxed);
+        }
+    }
+    DROPPED.store(0, Ordering::Relaxed);
+    start_flusher();
+}
+
+#[no_mangle]
+pub extern fn block_enter(block_c: uint32_t, label_c: uint32_t) {
+    let _ = PRODUCER.try_with(|producer| {
+        producer.record(Entry { block: block_c, width: 0, words: [label_c as u64, 0, 0, 0] })
+    });
+}
+
+#[no_mangle]
+pub extern fn block_enter_set(block_c: uint32_t, width_c: uint32_t, word0: u64, word1: u64, word2: u64, word3: u64) {
+    let _ = PRODUCER.try_with(|producer| {
+        producer.record(Entry { block: block_c, width: width_c, words: [word0, word1, word2, word3] })
+    });
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_ring() {
+        let ring = Ring::new();
+        for block in 0..RING_ENTRIES + 5 {
+            ring.push(Entry { block: block as u32, width: 0, words: [0; 4] });
+        }
+        assert_eq!(ring.head.load(Ordering::Relaxed), RING_ENTRIES);
+        assert_eq!(ring.dropped.load(Ordering::Relaxed), 5);
+
+        // Once the consumer has caught up, pushes land again, wrapping around.
+        ring.tail.store(RING_ENTRIES, Ordering::Relaxed);
+        ring.push(Entry { block: 7, width: 0, words: [0; 4] });
+        assert_eq!(unsafe { (*ring.entries[0].get()).block }, 7);
+        assert_eq!(ring.head.load(Ordering::Relaxed), RING_ENTRIES + 1);
+    }
+
+    #[test]
+    fn test_thread_exit() {
+        env::set_var("TAINT_BLOCK_TRACE", "/dev/null");
+        let threads: Vec<_> = (0..4).map(|block| thread::spawn(move || block_enter(block, 0))).collect();
+        for thread in threads {
+            thread.join().unwrap();
+        }
+        assert!(RINGS.lock().unwrap().is_empty());
+    }
+}
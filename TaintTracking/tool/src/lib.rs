@@ -1,172 +1,746 @@
 extern crate libc;
 extern crate bit_vec;
 
+pub mod blocks;
+pub mod shadow;
+pub mod shared;
+pub mod stats;
+pub mod trace;
+
+use std::cell::RefCell;
+use std::collections::HashMap;
+use std::env;
+use std::hash::{BuildHasherDefault, Hasher};
+use std::io;
 use std::ptr;
+use std::slice;
+use std::sync::Mutex;
+use std::thread;
+use std::sync::atomic::{AtomicPtr, AtomicUsize, Ordering};
 use libc::uint32_t;
 use bit_vec::BitVec;
+use shared::Shared;
 
+// Labels are hash-consed bitsets of taint sources. The Table owns the bitsets, the Tree is the
+// index that maps a bitset back to its label, so the same set always gets the same label.
+//
+// Both are shared by every thread of the instrumented program. The bitset of a label is a run
+// of words that never moves or changes once written, and the label's entry points at it, so
+// reading a label takes no lock. Interning a new set locks only the one of SHARDS index shards
+// its hash falls in. Union results are memoized per thread, so a union that hits the memo
+// writes nothing shared at all.
+//
+// Labels are never freed: a label may still sit in a register or a stack slot the runtime cannot
+// see. Instead the table can be given a budget. Once growing it would go over, a set that is not
+// in the table yet gets a coarse overflow label, a superset of it (see coarse), so taint is
+// over-approximated but never lost, and there are only a handful of those.
+//
+// A lazy table (TAINT_LAZY_LABELS) does not build the set of a union at all: a union the memo has not
+// seen gets a new label whose entry points at the pair of labels it joins, tagged in its low bit, so the
+// labels form an append-only DAG and a union is a push. The set is only built when something reads the
+// words of the label; the pair's entry is then pointed at them, so it is built once. Such a set is not
+// interned, so in a lazy table two labels may stand for the same set.
+//
+// A shared table (TAINT_SHARED_LABELS) keeps its labels, sets and index in a region that processes forked
+// after it was made all map, so they hand out labels from one numbering; see shared.rs. Its budget is the
+// size of the region, and it is never lazy.
 pub struct Table {
-    record: Vec<*const Node>,
+    // Bucket b holds the entries of ENTRY_CHUNK << b labels, allocated on first use.
+    buckets: [AtomicPtr<AtomicPtr<u64>>; BUCKETS],
+    next: AtomicUsize,
+    arenas: Vec<Mutex<Arena>>,
+    id: usize,
+    // Bytes allocated for entries, words and the index, and the most it may grow to, 0 for no limit.
+    bytes: AtomicUsize,
+    budget: usize,
+    overflows: AtomicUsize,
+    // The source count from init_sources, 0 if the sources were interned some other way.
+    sources: AtomicUsize,
+    lazy: bool,
+    shared: Option<Shared>,
+}
+
+// What label_stats reports, to size the budget.
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, PartialEq)]
+pub struct LabelStats {
+    pub labels: u64,
+    pub bytes: u64,
+    pub budget: u64,
+    pub overflows: u64,
+}
+
+// Word storage of one shard. Each bitset is stored as its length followed by its words, and
+// trailing zero words are never stored, so equal sets have equal word slices and the empty
+// set has length 0. Chunks are only freed with the table.
+struct Arena {
+    chunks: Vec<(*mut u64, usize)>,
+    used: usize,
 }
 
+// The chunks are only written under the arena's lock, and only where no label points yet.
+unsafe impl Send for Arena {}
+
 pub struct Tree {
-    root: Link,
+    shards: Vec<Mutex<Shard>>,
+}
+
+// Open addressing over label numbers; the bitsets themselves stay in the table.
+struct Shard {
+    slots: Vec<u32>,
+    count: usize,
 }
 
-type Link = Option<Box<Node>>;
+const SHARD_BITS: usize = 4;
+const SHARDS: usize = 1 << SHARD_BITS;
+const BUCKETS: usize = 32;
+// Chunk sizes of the arenas, so filling them costs a handful of allocations instead of one per label.
+const WORD_CHUNK: usize = 1 << 14;
+const ENTRY_CHUNK_SHIFT: usize = 14;
+const ENTRY_CHUNK: usize = 1 << ENTRY_CHUNK_SHIFT;
+const EMPTY_SLOT: u32 = u32::max_value();
+// Marks an entry that points at the two labels of a union whose set is not built yet.
+const DEFERRED: usize = 1;
+// Entries a thread's union memo may hold before it starts over.
+const MEMO_LIMIT: usize = 1 << 18;
+
+static NEXT_TABLE: AtomicUsize = AtomicUsize::new(0);
 
-pub struct Node {
-    left: Link,
-    right: Link,
-    parent: *const Node,
-    label: Option<usize>,
-    pos: Option<bool>, // true means right child of parent while false means left child.
+// Union results memoized by unordered label pair, so a repeated union is one hash probe
+// instead of an OR of both bitsets and an index lookup.
+type UnionMemo = HashMap<u64, usize, BuildHasherDefault<PairHasher>>;
+
+// What a thread keeps to itself: the memo of the table it last used and a scratch bitset.
+struct Local {
+    table: usize,
+    memo: UnionMemo,
+    scratch: Vec<u64>,
 }
 
-impl Table {
-    pub fn new() -> Self {
-        Table {
-            record: Vec::new(),
+thread_local!(static LOCAL: RefCell<Local> = RefCell::new(Local {
+    table: usize::max_value(),
+    memo: UnionMemo::default(),
+    scratch: Vec::new(),
+}));
+
+impl Local {
+    fn memo(&mut self, nodes: &Table) -> &mut UnionMemo {
+        if self.table != nodes.id {
+            self.memo.clear();
+            self.table = nodes.id;
         }
+        &mut self.memo
     }
 }
 
-impl Tree {
-    pub fn new() -> Self {
-        Tree { root: Some(Box::new(Node::new())), }
+// The keys are two packed 32-bit labels, so a multiplicative hash is plenty
+// and far cheaper than the default SipHash.
+#[derive(Default)]
+pub struct PairHasher {
+    hash: u64,
+}
+
+impl Hasher for PairHasher {
+    fn finish(&self) -> u64 {
+        self.hash
+    }
+
+    fn write(&mut self, bytes: &[u8]) {
+        for byte in bytes {
+            self.write_u64(*byte as u64);
+        }
+    }
+
+    fn write_u64(&mut self, value: u64) {
+        self.hash = (self.hash.rotate_left(5) ^ value).wrapping_mul(0x517cc1b727220a95);
     }
 }
 
-impl Node {
-    pub fn new() -> Self {
-        Node {
-            label: None,
-            left: None,
-            right: None,
-            parent: ptr::null(),
-            pos: None,
+fn memo_key(label1: usize, label2: usize) -> u64 {
+    if label1 < label2 {
+        ((label1 as u64) << 32) | label2 as u64
+    } else {
+        ((label2 as u64) << 32) | label1 as u64
+    }
+}
+
+// The multiply only carries low bits upwards, and the index takes its slot from the low bits, so the
+// high half is folded back in; otherwise sets that differ only in high bits would share a probe chain.
+fn hash_words(words: &[u64]) -> u64 {
+    let mut hasher = PairHasher::default();
+    for word in words {
+        hasher.write_u64(*word);
+    }
+    let hash = hasher.finish();
+    hash ^ (hash >> 32)
+}
+
+fn trim(words: &mut Vec<u64>) {
+    while words.last() == Some(&0) {
+        words.pop();
+    }
+}
+
+// Bucket b starts at label (ENTRY_CHUNK << b) - ENTRY_CHUNK.
+fn locate(label: usize) -> (usize, usize) {
+    let position = label + ENTRY_CHUNK;
+    let bucket = 63 - (position as u64).leading_zeros() as usize - ENTRY_CHUNK_SHIFT;
+    (bucket, position - (ENTRY_CHUNK << bucket))
+}
+
+impl Arena {
+    fn new() -> Self {
+        Arena {
+            chunks: Vec::new(),
+            used: 0,
+        }
+    }
+
+    // Bytes a new chunk for a run of length words would take, 0 if the current one has room.
+    fn growth(&self, length: usize) -> usize {
+        let need = length + 1;
+        match self.chunks.last() {
+            Some(&(_, size)) if size - self.used >= need => 0,
+            _ => need.max(WORD_CHUNK) * 8,
+        }
+    }
+
+    fn store(&mut self, words: &[u64], bytes: &AtomicUsize) -> *mut u64 {
+        let need = words.len() + 1;
+        if self.growth(words.len()) != 0 {
+            let size = need.max(WORD_CHUNK);
+            let chunk = Box::into_raw(vec![0u64; size].into_boxed_slice()) as *mut u64;
+            self.chunks.push((chunk, size));
+            self.used = 0;
+            bytes.fetch_add(size * 8, Ordering::Relaxed);
+        }
+
+        let (chunk, _) = *self.chunks.last().unwrap();
+        unsafe {
+            let run = chunk.offset(self.used as isize);
+            *run = words.len() as u64;
+            ptr::copy_nonoverlapping(words.as_ptr(), run.offset(1), words.len());
+            self.used += need;
+            run
         }
     }
 }
 
-pub fn insert(root: &mut Tree, vector: &mut BitVec, nodes: &mut Table) -> Option<usize> {
-    insert_vector(&mut root.root, vector, &mut nodes.record)
+impl Drop for Arena {
+    fn drop(&mut self) {
+        for &(chunk, size) in self.chunks.iter() {
+            unsafe {
+                drop(Box::from_raw(slice::from_raw_parts_mut(chunk, size) as *mut [u64]));
+            }
+        }
+    }
 }
 
-fn insert_vector(root: &mut Link, vector: &mut BitVec, nodes: &mut Vec<*const Node>) -> Option<usize> {
-    let len = vector.len();
-    let mut pos = len;
+impl Table {
+    pub fn new() -> Self {
+        Table::with_budget(0)
+    }
 
-    let root_node = root.as_mut().unwrap();
-    let root_point: *const Node = & **root_node;
+    // A table that stops growing at about budget bytes, counting the index that goes with it.
+    pub fn with_budget(budget: usize) -> Self {
+        Table {
+            buckets: Default::default(),
+            next: AtomicUsize::new(0),
+            arenas: (0..SHARDS).map(|_| Mutex::new(Arena::new())).collect(),
+            id: NEXT_TABLE.fetch_add(1, Ordering::Relaxed),
+            bytes: AtomicUsize::new(0),
+            budget: budget,
+            overflows: AtomicUsize::new(0),
+            sources: AtomicUsize::new(0),
+            lazy: false,
+            shared: None,
+        }
+    }
 
-    vector.iter().rfind(|x| {
-        if !*x {
-            pos = pos - 1;
+    // A table whose unions are only built when read; it has no budget.
+    pub fn lazy() -> Self {
+        let mut table = Table::new();
+        table.lazy = true;
+        table
+    }
+
+    // A table in a fresh shared region of about size bytes, which every process forked from this one shares.
+    pub fn shared(size: usize) -> io::Result<Self> {
+        let mut table = Table::with_budget(size);
+        table.shared = Some(Shared::new(size)?);
+        Ok(table)
+    }
+
+    pub fn stats(&self, tree: &Tree) -> LabelStats {
+        let (bytes, overflows) = match self.shared {
+            Some(ref shared) => (shared.memory_bytes(), shared.overflows()),
+            None => (self.memory_bytes() + tree.memory_bytes(), self.overflows.load(Ordering::Relaxed)),
+        };
+        LabelStats {
+            labels: self.len() as u64,
+            bytes: bytes as u64,
+            budget: self.budget as u64,
+            overflows: overflows as u64,
         }
-        *x
-    });
-    vector.truncate(pos);
+    }
 
-    if vector.is_empty() {
-        if root_node.label.is_none() {
-            root_node.label = Some(nodes.len());
-            let raw_node: *const _ = & **root_node;
-            nodes.push(raw_node);
+    // Labels handed out so far; with inserts in flight on other threads the newest may not be readable yet.
+    pub fn len(&self) -> usize {
+        match self.shared {
+            Some(ref shared) => shared.len(),
+            None => self.next.load(Ordering::Acquire),
         }
-        return root_node.label;
     }
 
-    let mut child;
-    if vector[0] == false {
-        child = &mut root_node.left;
-    } else {
-        child = &mut root_node.right;
+    // The bitset of a label, bit i of the set is bit i % 64 of word i / 64.
+    pub fn words(&self, label: usize) -> &[u64] {
+        if let Some(ref shared) = self.shared {
+            return shared.words(label);
+        }
+        let mut run = self.entry(label).load(Ordering::Acquire);
+        assert!(!run.is_null());
+        if run as usize & DEFERRED != 0 {
+            self.resolve(label);
+            run = self.entry(label).load(Ordering::Acquire);
+        }
+        unsafe {
+            slice::from_raw_parts(run.offset(1), *run as usize)
+        }
     }
 
-    if child.is_none() {
-        let mut new_node = Box::new(Node::new());
-        new_node.pos = Some(vector[0] == true);
-        new_node.parent = root_point;
-        if vector.len() == 1 {
-            new_node.label = Some(nodes.len());
-            let raw_node: *const _ = & *new_node;
-            nodes.push(raw_node);
+    // Whether the label is the empty set, without building it: a deferred union never is.
+    pub fn is_empty(&self, label: usize) -> bool {
+        if let Some(ref shared) = self.shared {
+            return shared.words(label).is_empty();
         }
-        *child = Some(new_node);
+        let run = self.entry(label).load(Ordering::Acquire);
+        run as usize & DEFERRED == 0 && unsafe { *run == 0 }
     }
 
-    if vector.len() == 1 {
-        let child_node = child.as_mut().unwrap();
-        if child_node.label.is_none() {
-            child_node.label = Some(nodes.len());
-            let raw_node: *const _ = & **child_node;
-            nodes.push(raw_node);
+    // Whether the label has been handed out and its entry stored, so reading it cannot fail. A label below
+    // len may not be: push counts it before it stores the entry, and a shared table may leave holes.
+    pub fn is_published(&self, label: usize) -> bool {
+        if let Some(ref shared) = self.shared {
+            return shared.try_words(label).is_some();
         }
-        return child_node.label;
-    } else {
-        let mut vector_new = BitVec::new();
-        let mut iter = vector.iter().skip(1);
-        while let Some(bit) = iter.next() {
-            vector_new.push(bit);
+        if label >= self.len() {
+            return false;
         }
+        let (bucket, offset) = locate(label);
+        let entries = self.buckets[bucket].load(Ordering::Acquire);
+        !entries.is_null() && unsafe { !(*entries.offset(offset as isize)).load(Ordering::Acquire).is_null() }
+    }
 
-        return insert_vector(&mut child, &mut vector_new, nodes);
+    // Whether reading the label would build its set first.
+    pub fn is_deferred(&self, label: usize) -> bool {
+        self.shared.is_none() && self.entry(label).load(Ordering::Acquire) as usize & DEFERRED != 0
+    }
 
-        // I cannot use vector.split_off(1)
-        // I cannot use vector.iter().skip(0).collect()
-        // So stupid container the BitVec is!
-        // The resulting problem is that a useless bitvec left at each recursion
+    // Whether source id is in the set of a label. That is one word of its run, so it takes the same time however
+    // many sources the set holds; a deferred label is built the first time, as by words.
+    pub fn has_source(&self, label: usize, id: usize) -> bool {
+        self.words(label).get(id / 64).map_or(false, |word| word >> (id % 64) & 1 != 0)
     }
 
-}
+    // Whether the set of a label holds any source of mask, which is a set of sources laid out like words.
+    pub fn intersects(&self, label: usize, mask: &[u64]) -> bool {
+        self.words(label).iter().zip(mask.iter()).any(|(word, bits)| word & bits != 0)
+    }
 
-pub fn find(label: usize, nodes: &Table) -> BitVec {
-    assert!(label < nodes.record.len());
+    // A new label for the union of two others, whose set is built when first read.
+    fn defer(&self, label1: usize, label2: usize) -> usize {
+        let shard = (memo_key(label1, label2).wrapping_mul(0x9e3779b97f4a7c15) >> (64 - SHARD_BITS)) as usize;
+        self.push(shard, &[label1 as u64, label2 as u64], DEFERRED)
+    }
 
-    let mut node: & Node;
-    unsafe {
-        node = &*(nodes.record[label]);
+    // Builds the sets of a label and every deferred label under it, children first and without
+    // recursing, since a loop that keeps adding to one label makes a chain as long as the loop ran.
+    // Two threads may build the same set at once; both store equal words, and either pointer does.
+    fn resolve(&self, label: usize) {
+        let mut stack = vec![label];
+        let mut scratch = Vec::new();
+        while let Some(&top) = stack.last() {
+            let run = self.entry(top).load(Ordering::Acquire) as usize;
+            if run & DEFERRED == 0 {
+                stack.pop();
+                continue;
+            }
+            let pair = unsafe { slice::from_raw_parts(((run & !DEFERRED) as *const u64).offset(1), 2) };
+            let (left, right) = (pair[0] as usize, pair[1] as usize);
+            let ready = !self.is_deferred(left) && !self.is_deferred(right);
+            if !ready {
+                for &child in [left, right].iter() {
+                    if self.is_deferred(child) {
+                        stack.push(child);
+                    }
+                }
+                continue;
+            }
+
+            scratch.clear();
+            {
+                let (short, long) = if self.words(left).len() < self.words(right).len() {
+                    (self.words(left), self.words(right))
+                } else {
+                    (self.words(right), self.words(left))
+                };
+                scratch.extend_from_slice(long);
+                for (word, other) in scratch.iter_mut().zip(short.iter()) {
+                    *word |= *other;
+                }
+            }
+            let words = self.arenas[top % SHARDS].lock().unwrap().store(&scratch, &self.bytes);
+            self.entry(top).store(words, Ordering::Release);
+            stack.pop();
+        }
     }
 
-    let mut vector_rev = BitVec::new();
+    // Entries of the calling thread's union memo for this table.
+    pub fn memo_len(&self) -> usize {
+        LOCAL.with(|local| {
+            let local = local.borrow();
+            if local.table == self.id { local.memo.len() } else { 0 }
+        })
+    }
 
-    while !node.parent.is_null() {
-        vector_rev.push(node.pos.unwrap());
+    // Bytes held by the shared arenas, for sizing.
+    pub fn memory_bytes(&self) -> usize {
+        if let Some(ref shared) = self.shared {
+            return shared.memory_bytes();
+        }
+        let entries: usize = (0..BUCKETS)
+            .filter(|bucket| !self.buckets[*bucket].load(Ordering::Acquire).is_null())
+            .map(|bucket| (ENTRY_CHUNK << bucket) * 8)
+            .sum();
+        let words: usize = self.arenas.iter()
+            .map(|arena| arena.lock().unwrap().chunks.iter().map(|&(_, size)| size * 8).sum::<usize>())
+            .sum();
+        entries + words
+    }
+
+    fn entry(&self, label: usize) -> &AtomicPtr<u64> {
+        let (bucket, offset) = locate(label);
+        let entries = self.buckets[bucket].load(Ordering::Acquire);
+        assert!(!entries.is_null());
         unsafe {
-            node = &*(node.parent);
+            &*entries.offset(offset as isize)
+        }
+    }
+
+    // Whether a new label of length words, plus index bytes more for the index, stays in the budget.
+    // Other shards may grow at the same time, so the budget can be overrun by a chunk or so.
+    fn fits(&self, shard: usize, length: usize, index: usize) -> bool {
+        if self.budget == 0 {
+            return true;
+        }
+        let mut need = index + self.arenas[shard].lock().unwrap().growth(length);
+        let (bucket, _) = locate(self.next.load(Ordering::Acquire));
+        if self.buckets[bucket].load(Ordering::Acquire).is_null() {
+            need += (ENTRY_CHUNK << bucket) * 8;
+        }
+        self.bytes.load(Ordering::Relaxed) + need <= self.budget
+    }
+
+    // The overflow label stands for every source, if the set can only hold sources of init_sources,
+    // otherwise for every source up to the end of its last word. Either way it is a superset of words,
+    // and there are only as many of them as word lengths.
+    fn coarse(&self, words: &[u64]) -> Vec<u64> {
+        let sources = self.sources.load(Ordering::Relaxed);
+        let end = match words.last() {
+            Some(last) => (words.len() - 1) * 64 + 64 - last.leading_zeros() as usize,
+            None => return Vec::new(),
+        };
+        let bits = if end <= sources { sources } else { words.len() * 64 };
+        let mut coarse = vec![!0u64; bits / 64];
+        if bits % 64 != 0 {
+            coarse.push((1 << (bits % 64)) - 1);
         }
+        coarse
     }
 
-    let mut vector = BitVec::new();
-    let mut iter = vector_rev.iter();
+    // Interning a set calls this with its index shard locked, so that arena lock is not contended there.
+    // defer calls it with no lock held and resolve stores into the arenas directly, so in a lazy table
+    // threads can wait on an arena mutex. Tag is DEFERRED for the pair of a lazy union, 0 for a set.
+    fn push(&self, shard: usize, words: &[u64], tag: usize) -> usize {
+        let run = self.arenas[shard].lock().unwrap().store(words, &self.bytes);
+        let label = self.next.fetch_add(1, Ordering::AcqRel);
+        assert!(label < EMPTY_SLOT as usize);
 
-    while let Some(bit) = iter.next_back() {
-        vector.push(bit);
+        let (bucket, offset) = locate(label);
+        unsafe {
+            (*self.bucket(bucket).offset(offset as isize)).store((run as usize | tag) as *mut u64, Ordering::Release);
+        }
+        label
     }
 
-    return vector;
+    // Two threads may both find a bucket missing; the one that loses the race frees its copy.
+    fn bucket(&self, bucket: usize) -> *mut AtomicPtr<u64> {
+        let entries = self.buckets[bucket].load(Ordering::Acquire);
+        if !entries.is_null() {
+            return entries;
+        }
+
+        let size = ENTRY_CHUNK << bucket;
+        let fresh: Vec<AtomicPtr<u64>> = (0..size).map(|_| AtomicPtr::new(ptr::null_mut())).collect();
+        let fresh = Box::into_raw(fresh.into_boxed_slice()) as *mut AtomicPtr<u64>;
+        match self.buckets[bucket].compare_exchange(ptr::null_mut(), fresh, Ordering::AcqRel, Ordering::Acquire) {
+            Ok(_) => {
+                self.bytes.fetch_add(size * 8, Ordering::Relaxed);
+                fresh
+            }
+            Err(winner) => {
+                unsafe {
+                    drop(Box::from_raw(slice::from_raw_parts_mut(fresh, size) as *mut [AtomicPtr<u64>]));
+                }
+                winner
+            }
+        }
+    }
 }
 
-pub fn union(label1: usize, label2: usize, nodes: &mut Table, root: &mut Tree) -> Option<usize> {
-    let mut vector1 = find(label1, &*nodes);
-    let mut vector2 = find(label2, &*nodes);
-    let len1 = vector1.len();
-    let len2 = vector2.len();
+impl Drop for Table {
+    fn drop(&mut self) {
+        for bucket in 0..BUCKETS {
+            let entries = self.buckets[bucket].load(Ordering::Acquire);
+            if !entries.is_null() {
+                unsafe {
+                    drop(Box::from_raw(slice::from_raw_parts_mut(entries, ENTRY_CHUNK << bucket) as *mut [AtomicPtr<u64>]));
+                }
+            }
+        }
+    }
+}
 
-    if len1 < len2 {
-        vector1.grow(len2-len1, false);
-    } else {
-        vector2.grow(len1-len2, false);
+impl Shard {
+    // The slot holding the label of words, or the empty slot where it would go.
+    fn find(&self, hash: u64, words: &[u64], nodes: &Table) -> usize {
+        let mask = self.slots.len() - 1;
+        let mut slot = hash as usize & mask;
+        let mut probes = 1;
+        loop {
+            let label = self.slots[slot];
+            if label == EMPTY_SLOT || nodes.words(label as usize) == words {
+                stats::probed(probes);
+                return slot;
+            }
+            slot = (slot + 1) & mask;
+            probes += 1;
+        }
+    }
+
+    fn grow(&mut self, nodes: &Table) {
+        let mut slots = vec![EMPTY_SLOT; self.slots.len() * 2];
+        let mask = slots.len() - 1;
+        for label in self.slots.iter().filter(|label| **label != EMPTY_SLOT) {
+            let mut slot = hash_words(nodes.words(*label as usize)) as usize & mask;
+            while slots[slot] != EMPTY_SLOT {
+                slot = (slot + 1) & mask;
+            }
+            slots[slot] = *label;
+        }
+        nodes.bytes.fetch_add((slots.len() - self.slots.len()) * 4, Ordering::Relaxed);
+        self.slots = slots;
+    }
+}
+
+impl Tree {
+    pub fn new() -> Self {
+        Tree {
+            shards: (0..SHARDS).map(|_| Mutex::new(Shard { slots: vec![EMPTY_SLOT; 64], count: 0 })).collect(),
+        }
+    }
+
+    pub fn memory_bytes(&self) -> usize {
+        self.shards.iter().map(|shard| shard.lock().unwrap().slots.capacity() * 4).sum()
+    }
+
+    // The label of a set, or its overflow label if it is new and the table has no room for it.
+    fn intern(&self, words: &[u64], nodes: &Table) -> usize {
+        match self.probe(words, nodes, true) {
+            Some(label) => label,
+            None => {
+                match nodes.shared {
+                    Some(ref shared) => shared.overflowed(),
+                    None => { nodes.overflows.fetch_add(1, Ordering::Relaxed); }
+                }
+                self.probe(&nodes.coarse(words), nodes, false).unwrap()
+            }
+        }
+    }
+
+    // The high bits of the hash pick the shard, the low bits the slot within it. A new set is only
+    // added if it fits in the budget or bounded is false.
+    fn probe(&self, words: &[u64], nodes: &Table, bounded: bool) -> Option<usize> {
+        if let Some(ref shared) = nodes.shared {
+            return shared.probe(words, bounded);
+        }
+        let hash = hash_words(words);
+        let shard = (hash >> (64 - SHARD_BITS)) as usize;
+        let mut index = self.shards[shard].lock().unwrap();
+        let mut slot = index.find(hash, words, nodes);
+        if index.slots[slot] != EMPTY_SLOT {
+            return Some(index.slots[slot] as usize);
+        }
+
+        let grow = (index.count + 1) * 2 > index.slots.len();
+        if bounded && !nodes.fits(shard, words.len(), if grow { index.slots.len() * 4 } else { 0 }) {
+            return None;
+        }
+        if grow {
+            index.grow(nodes);
+            slot = index.find(hash, words, nodes);
+        }
+        let label = nodes.push(shard, words, 0);
+        index.slots[slot] = label as u32;
+        index.count += 1;
+        Some(label)
     }
-    vector1.union(&vector2);
+}
 
-    insert_vector(&mut root.root, &mut vector1, &mut nodes.record)
+// Interns the set of a vector. Like before, the vector is truncated after its last set bit.
+pub fn insert(root: &Tree, vector: &mut BitVec, nodes: &Table) -> Option<usize> {
+    let len = vector.iter().enumerate().filter(|&(_, bit)| bit).last().map_or(0, |(last, _)| last + 1);
+    vector.truncate(len);
+
+    let mut words = vec![0u64; (len + 63) / 64];
+    for (index, bit) in vector.iter().enumerate() {
+        if bit {
+            words[index / 64] |= 1 << (index % 64);
+        }
+    }
+    Some(root.intern(&words, nodes))
+}
+
+pub fn find(label: usize, nodes: &Table) -> BitVec {
+    assert!(label < nodes.len());
+    bits_of(nodes.words(label))
+}
+
+// The set of a label's words, up to its last set bit.
+pub fn bits_of(words: &[u64]) -> BitVec {
+    let len = match words.last() {
+        Some(last) => (words.len() - 1) * 64 + 64 - last.leading_zeros() as usize,
+        None => 0,
+    };
+    BitVec::from_fn(len, |index| words[index / 64] & (1 << (index % 64)) != 0)
+}
+
+// A fixed-width label from the pass: bit i of the set is bit i % 64 of words[i / 64].
+pub fn bitset_find(words: &[u64], total_bits: usize) -> BitVec {
+    let len = total_bits.min(words.len() * 64);
+    let mut result = BitVec::from_fn(len, |index| words[index / 64] & (1 << (index % 64)) != 0);
+    if len < total_bits {
+        result.grow(total_bits - len, false);
+    }
+    result
+}
+
+// The label of source id. The pass numbers sources at compile time and emits this as a constant, which holds
+// because init_sources fills a fresh table with the empty set (label 0) and then every singleton in order.
+// Must agree with sourceLabel in TaintTracking.cpp.
+pub fn source_label(id: usize) -> usize {
+    id + 1
+}
+
+// The sources always get their labels, whatever the budget.
+pub fn init_sources(root: &Tree, nodes: &Table, count: usize) {
+    assert_eq!(nodes.len(), 0);
+    nodes.sources.store(count, Ordering::Relaxed);
+    root.probe(&[], nodes, false);
+    for id in 0..count {
+        let mut words = vec![0u64; id / 64 + 1];
+        words[id / 64] = 1 << (id % 64);
+        assert_eq!(root.probe(&words, nodes, false), Some(source_label(id)));
+    }
+    // With a budget, the label every overflow of a set of sources falls back to is there from the start,
+    // so falling back never grows the table.
+    if nodes.budget != 0 {
+        root.probe(&nodes.coarse(&[1]), nodes, false);
+    }
+}
+
+fn is_empty_label(label: usize, nodes: &Table) -> bool {
+    nodes.is_empty(label)
+}
+
+// Builds the sets of many labels at once, the labels split over every core. Labels that share
+// deferred unions share the work too: whichever thread reaches one first builds it.
+pub fn resolve_all(labels: &[u32], nodes: &Table) {
+    let pending: Vec<u32> = labels.iter().cloned().filter(|label| nodes.is_deferred(*label as usize)).collect();
+    if pending.is_empty() {
+        return;
+    }
+    let cores = thread::available_parallelism().map(|cores| cores.get()).unwrap_or(1);
+    let chunk = (pending.len() + cores - 1) / cores;
+    thread::scope(|scope| {
+        for part in pending.chunks(chunk) {
+            scope.spawn(move || {
+                for label in part {
+                    nodes.words(*label as usize);
+                }
+            });
+        }
+    });
+}
+
+pub fn union(label1: usize, label2: usize, nodes: &Table, root: &Tree) -> Option<usize> {
+    if label1 == label2 || is_empty_label(label2, nodes) {
+        return Some(label1);
+    }
+    if is_empty_label(label1, nodes) {
+        return Some(label2);
+    }
+
+    let key = memo_key(label1, label2);
+    let cached = LOCAL.with(|local| local.borrow_mut().memo(nodes).get(&key).cloned());
+    stats::memo(cached.is_some());
+    if cached.is_some() {
+        return cached;
+    }
+
+    let result = if nodes.lazy { Some(nodes.defer(label1, label2)) } else { union_uncached(label1, label2, nodes, root) };
+    if let Some(label) = result {
+        LOCAL.with(|local| {
+            let mut local = local.borrow_mut();
+            let memo = local.memo(nodes);
+            if memo.len() >= MEMO_LIMIT {
+                memo.clear();
+            }
+            memo.insert(key, label);
+        });
+    }
+    result
+}
+
+// ORs both bitsets word by word and interns the result; only reached on a memo miss.
+pub fn union_uncached(label1: usize, label2: usize, nodes: &Table, root: &Tree) -> Option<usize> {
+    LOCAL.with(|local| {
+        let mut local = local.borrow_mut();
+        let scratch = &mut local.scratch;
+        scratch.clear();
+        {
+            let (short, long) = if nodes.words(label1).len() < nodes.words(label2).len() {
+                (nodes.words(label1), nodes.words(label2))
+            } else {
+                (nodes.words(label2), nodes.words(label1))
+            };
+            scratch.extend_from_slice(long);
+            for (word, other) in scratch.iter_mut().zip(short.iter()) {
+                *word |= *other;
+            }
+        }
+        trim(scratch);
+
+        Some(root.intern(scratch, nodes))
+    })
 }
 
 #[cfg(test)]
 mod test {
 
+    use std::sync::Arc;
+    use std::sync::atomic::AtomicU32;
+    use std::thread;
     use bit_vec::BitVec;
     use super::*;
 
@@ -232,6 +806,374 @@ mod test {
 
     }
 
+    #[test]
+    fn test_union_memo() {
+        let mut tree = Tree::new();
+        let mut nodes = Table::new();
+        let mut bv0 = BitVec::new();
+        let mut bv1 = BitVec::from_elem(1, true);
+        let mut bv2 = BitVec::from_bytes(&[0b01000000]);
+        let mut bv3 = BitVec::from_bytes(&[0b00100000]);
+
+        insert(&mut tree, &mut bv0, &mut nodes);
+        insert(&mut tree, &mut bv1, &mut nodes);
+        insert(&mut tree, &mut bv2, &mut nodes);
+        insert(&mut tree, &mut bv3, &mut nodes);
+
+        // Empty and identical operands never reach the memo.
+        assert_eq!(union(0, 2, &mut nodes, &mut tree), Some(2));
+        assert_eq!(union(3, 0, &mut nodes, &mut tree), Some(3));
+        assert_eq!(union(1, 1, &mut nodes, &mut tree), Some(1));
+        assert_eq!(nodes.memo_len(), 0);
+
+        let label = union(1, 2, &mut nodes, &mut tree);
+        assert_eq!(label, Some(4));
+        assert_eq!(nodes.memo_len(), 1);
+        assert_eq!(union(2, 1, &mut nodes, &mut tree), label);
+        assert_eq!(nodes.memo_len(), 1);
+
+        assert_eq!(union(4, 3, &mut nodes, &mut tree), union_uncached(4, 3, &mut nodes, &mut tree));
+        assert_eq!(find(5, &nodes), BitVec::from_elem(3, true));
+    }
+
+    #[test]
+    fn test_init_sources() {
+        let tree = Tree::new();
+        let nodes = Table::new();
+        init_sources(&tree, &nodes, 130);
+
+        assert_eq!(nodes.len(), 131);
+        assert_eq!(find(0, &nodes), BitVec::new());
+        for id in [0, 63, 64, 129].iter() {
+            let mut vector = BitVec::from_elem(id + 1, false);
+            vector.set(*id, true);
+            assert_eq!(find(source_label(*id), &nodes), vector);
+            assert_eq!(insert(&tree, &mut vector, &nodes), Some(source_label(*id)));
+        }
+        let both = union(source_label(0), source_label(129), &nodes, &tree).unwrap();
+        assert_eq!(find(both, &nodes).iter().filter(|bit| *bit).count(), 2);
+    }
+
+    #[test]
+    fn test_bitset_find() {
+        let mut expected = BitVec::from_elem(70, false);
+        expected.set(0, true);
+        expected.set(65, true);
+        assert_eq!(bitset_find(&[1, 2], 70), expected);
+        assert_eq!(bitset_find(&[0b101], 3), BitVec::from_fn(3, |index| index != 1));
+        assert_eq!(bitset_find(&[1, 0, 0, 0], 300).len(), 300);
+    }
+
+    #[test]
+    fn test_wide_labels() {
+        let mut tree = Tree::new();
+        let mut nodes = Table::new();
+        let mut bv0 = BitVec::new();
+        let mut bv1 = BitVec::from_elem(130, false);
+        bv1.set(129, true);
+        let mut bv2 = BitVec::from_elem(70, false);
+        bv2.set(3, true);
+        bv2.set(64, true);
+
+        insert(&mut tree, &mut bv0, &mut nodes);
+        insert(&mut tree, &mut bv1, &mut nodes);
+        insert(&mut tree, &mut bv2, &mut nodes);
+        assert_eq!(find(1, &nodes), bv1);
+        assert_eq!(find(2, &nodes), bv2);
+        assert_eq!(nodes.words(2), &[1 << 3, 1]);
+
+        // Every label lives in the one arena, however many are interned.
+        for source in 0..5000 {
+            let mut vector = BitVec::from_elem(source + 1, false);
+            vector.set(source, true);
+            insert(&mut tree, &mut vector, &mut nodes);
+        }
+        assert_eq!(union(1, 2, &mut nodes, &mut tree), union(2, 1, &mut nodes, &mut tree));
+        let label = union(1, 2, &mut nodes, &mut tree).unwrap();
+        let mut expected = BitVec::from_elem(130, false);
+        expected.set(3, true);
+        expected.set(64, true);
+        expected.set(129, true);
+        assert_eq!(find(label, &nodes), expected);
+        assert_eq!(union_uncached(label, 1, &mut nodes, &mut tree), Some(label));
+    }
+
+    #[test]
+    fn test_concurrent_unions() {
+        let tree = Arc::new(Tree::new());
+        let nodes = Arc::new(Table::new());
+        insert(&tree, &mut BitVec::new(), &nodes);
+        let sources: Vec<usize> = (0..64).map(|source| {
+            let mut vector = BitVec::from_elem(source + 1, false);
+            vector.set(source, true);
+            insert(&tree, &mut vector, &nodes).unwrap()
+        }).collect();
+
+        // Every thread builds the same sets at the same time, so they must agree on every label.
+        let threads: Vec<_> = (0..8).map(|_| {
+            let (tree, nodes, sources) = (tree.clone(), nodes.clone(), sources.clone());
+            thread::spawn(move || {
+                let mut label = 0;
+                sources.iter().map(|source| {
+                    label = union(label, *source, &nodes, &tree).unwrap();
+                    label
+                }).collect::<Vec<usize>>()
+            })
+        }).collect();
+        let results: Vec<Vec<usize>> = threads.into_iter().map(|thread| thread.join().unwrap()).collect();
+
+        for result in results.iter() {
+            assert_eq!(result, &results[0]);
+        }
+        for (count, label) in results[0].iter().enumerate() {
+            assert_eq!(find(*label, &nodes), BitVec::from_elem(count + 1, true));
+        }
+        assert_eq!(nodes.len(), 1 + 64 + 63);
+        assert_eq!(nodes.memo_len(), 0);
+    }
+
+    #[test]
+    fn test_budget() {
+        let tree = Tree::new();
+        let nodes = Table::with_budget(5 << 19);
+        init_sources(&tree, &nodes, 100);
+
+        // Triples of sources until the table is full; every union still holds all of its sources.
+        let mut labels = Vec::new();
+        'fill: for first in 0..100 {
+            for second in first + 1..100 {
+                for third in second + 1..100 {
+                    let pair = union(source_label(first), source_label(second), &nodes, &tree).unwrap();
+                    let label = union(pair, source_label(third), &nodes, &tree).unwrap();
+                    let bits = find(label, &nodes);
+                    assert!(bits.get(first) == Some(true) && bits.get(third) == Some(true));
+                    labels.push(label);
+                    if nodes.stats(&tree).overflows > 100 {
+                        break 'fill;
+                    }
+                }
+            }
+        }
+        let stats = nodes.stats(&tree);
+        assert!(stats.overflows > 0);
+        assert!(stats.bytes <= stats.budget, "{:?}", stats);
+        assert_eq!(stats.labels as usize, nodes.len());
+
+        // Overflowed unions all share the label of every source, and sets already there are still found.
+        let full = *labels.last().unwrap();
+        assert_eq!(find(full, &nodes), BitVec::from_elem(100, true));
+        assert_eq!(union(labels[0], source_label(2), &nodes, &tree), Some(labels[0]));
+        assert_eq!(union(full, labels[0], &nodes, &tree), Some(full));
+        assert_eq!(parse_bytes("64m"), Some(64 << 20));
+        assert_eq!(parse_bytes("4096"), Some(4096));
+        assert_eq!(parse_bytes("lots"), None);
+    }
+
+    #[test]
+    fn test_lazy_unions() {
+        let tree = Tree::new();
+        let nodes = Table::lazy();
+        init_sources(&tree, &nodes, 130);
+        let index = tree.memory_bytes();
+
+        // A loop adding one source after another: each union is a new deferred label, nothing is built.
+        let mut label = source_label(0);
+        let mut chain = Vec::new();
+        for id in 1..130 {
+            label = union(label, source_label(id), &nodes, &tree).unwrap();
+            chain.push(label as u32);
+        }
+        assert!(nodes.is_deferred(label) && !nodes.is_empty(label));
+        // Without the sets a union cannot see that one side already holds the other, but the memo still answers it.
+        let again = union(label, source_label(5), &nodes, &tree);
+        assert!(again != Some(label) && union(source_label(5), label, &nodes, &tree) == again);
+        assert_eq!(union(label, 0, &nodes, &tree), Some(label));
+        assert_eq!(tree.memory_bytes(), index);
+
+        // Reading the last label builds the whole chain under it, once.
+        assert_eq!(find(label, &nodes), BitVec::from_elem(130, true));
+        assert!(chain.iter().all(|label| !nodes.is_deferred(*label as usize)));
+        assert_eq!(find(chain[1] as usize, &nodes), BitVec::from_fn(3, |_| true));
+
+        // Labels that share deferred unions, built on every core.
+        let pair = union(source_label(3), source_label(100), &nodes, &tree).unwrap();
+        let labels: Vec<u32> = (0..64).map(|id| union(pair, source_label(id + 10), &nodes, &tree).unwrap() as u32)
+            .collect();
+        resolve_all(&labels, &nodes);
+        for (id, label) in labels.iter().enumerate() {
+            assert!(!nodes.is_deferred(*label as usize));
+            let bits = find(*label as usize, &nodes);
+            assert_eq!(bits.iter().filter(|bit| *bit).count(), if id + 10 == 100 { 2 } else { 3 });
+            assert!(bits.get(3) == Some(true) && bits.get(100) == Some(true) && bits.get(id + 10) == Some(true));
+        }
+    }
+
+    // Workers forked after the table was made all union the same sources at once, and some of their own;
+    // they must agree on every label, and the parent must be able to read the sets of labels it never made.
+    #[test]
+    fn test_shared_fork() {
+        const WORKERS: usize = 8;
+        const STEPS: usize = 4000;
+        const SOURCES: usize = 200;
+        let tree = Tree::new();
+        let nodes = Table::shared(64 << 20).unwrap();
+        init_sources(&tree, &nodes, SOURCES);
+
+        // Every worker's labels, then the flag that starts them all at once.
+        let bytes = (WORKERS * STEPS * 2 + 1) * 4;
+        let results = unsafe {
+            libc::mmap(ptr::null_mut(), bytes, libc::PROT_READ | libc::PROT_WRITE,
+                       libc::MAP_SHARED | libc::MAP_ANONYMOUS, -1, 0) as *mut u32
+        };
+        assert!(results as *mut libc::c_void != libc::MAP_FAILED);
+        let results = unsafe { slice::from_raw_parts_mut(results, WORKERS * STEPS * 2 + 1) };
+        let start = unsafe { &*(&results[WORKERS * STEPS * 2] as *const u32 as *const AtomicU32) };
+
+        // The common sets come from the same seed in every worker, the own ones from the worker's.
+        let sets = |seed: u64| {
+            let mut state = seed;
+            let mut running = 0;
+            (0..STEPS).map(move |step| {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                if step % 16 == 0 {
+                    running = 0;
+                }
+                running |= 1u64 << (state % 64);
+                (source_label((state % 64) as usize), running)
+            })
+        };
+        let fold = |seed: u64, row: &mut [u32]| {
+            let mut label = 0;
+            for (step, (source, expected)) in sets(seed).enumerate() {
+                label = if step % 16 == 0 { source } else { union(label, source, &nodes, &tree).unwrap() };
+                assert_eq!(nodes.words(label), &[expected]);
+                row[step] = label as u32;
+            }
+        };
+
+        let mut children = Vec::new();
+        for worker in 0..WORKERS {
+            match unsafe { libc::fork() } {
+                0 => {
+                    let row = &mut results[worker * STEPS * 2..(worker + 1) * STEPS * 2];
+                    let ok = ::std::panic::catch_unwind(::std::panic::AssertUnwindSafe(|| {
+                        while start.load(Ordering::Acquire) == 0 {}
+                        let (common, own) = row.split_at_mut(STEPS);
+                        fold(0x2545f4914f6cdd1d, common);
+                        fold(worker as u64 + 1, own);
+                    })).is_ok();
+                    unsafe { libc::_exit(if ok { 0 } else { 1 }) };
+                }
+                child => {
+                    assert!(child > 0);
+                    children.push(child);
+                }
+            }
+        }
+        start.store(1, Ordering::Release);
+        for child in children {
+            let mut status = 0;
+            unsafe { libc::waitpid(child, &mut status, 0) };
+            assert!(libc::WIFEXITED(status) && libc::WEXITSTATUS(status) == 0);
+        }
+
+        for worker in 0..WORKERS {
+            let row = &results[worker * STEPS * 2..(worker + 1) * STEPS * 2];
+            assert_eq!(&row[..STEPS], &results[..STEPS]);
+            for (label, (_, expected)) in row[STEPS..].iter().zip(sets(worker as u64 + 1)) {
+                assert_eq!(nodes.words(*label as usize), &[expected]);
+            }
+        }
+        assert!(nodes.len() > 1 + SOURCES + STEPS / 2);
+        unsafe { libc::munmap(results.as_mut_ptr() as *mut libc::c_void, bytes) };
+    }
+
+    #[test]
+    fn test_queries() {
+        for nodes in [Table::new(), Table::lazy()].iter() {
+            let tree = Tree::new();
+            init_sources(&tree, nodes, 130);
+            let label = union(source_label(3), source_label(129), nodes, &tree).unwrap();
+            let table = nodes as *const Table as *mut Table;
+            assert_eq!(label_is_clean(table, 0), 1);
+            assert_eq!(label_is_clean(table, label as u32), 0);
+            assert_eq!(label_has_source(table, label as u32, 3), 1);
+            assert_eq!(label_has_source(table, label as u32, 129), 1);
+            assert_eq!(label_has_source(table, label as u32, 4), 0);
+            assert_eq!(label_has_source(table, label as u32, 1000), 0);
+            assert_eq!(label_has_source(table, 0, 3), 0);
+            let mask = [1u64 << 4, 0, 1 << 1];
+            assert_eq!(label_intersects(table, label as u32, mask.as_ptr(), 3), 1);
+            assert_eq!(label_intersects(table, label as u32, mask.as_ptr(), 2), 0);
+            assert_eq!(label_intersects(table, source_label(4) as u32, mask.as_ptr(), 1), 1);
+            assert_eq!(label_intersects(table, 0, mask.as_ptr(), 3), 0);
+            assert_eq!(label_is_clean(table, nodes.len() as u32), -1);
+            assert_eq!(label_has_source(table, nodes.len() as u32, 3), -1);
+
+            // A label push has counted but not stored yet.
+            let pending = nodes.next.fetch_add(1, Ordering::AcqRel);
+            assert_eq!(label_is_clean(table, pending as u32), -1);
+            assert_eq!(label_has_source(table, pending as u32, 3), -1);
+            assert_eq!(label_intersects(table, pending as u32, mask.as_ptr(), 3), -1);
+        }
+        let nodes = Table::shared(256 << 10).unwrap();
+        let tree = Tree::new();
+        init_sources(&tree, &nodes, 130);
+        let table = &nodes as *const Table as *mut Table;
+        let hole = nodes.shared.as_ref().unwrap().hole() as u32;
+        assert_eq!(label_is_clean(table, 0), 1);
+        assert_eq!(label_has_source(table, source_label(3) as u32, 3), 1);
+        assert_eq!(label_is_clean(table, hole), -1);
+        assert_eq!(label_has_source(table, hole, 3), -1);
+        assert_eq!(label_intersects(table, hole, [1u64].as_ptr(), 1), -1);
+        assert_eq!(label_is_clean(table, nodes.len() as u32), -1);
+
+        // A program with fixed-width labels has no table to ask.
+        assert!(blocks::TABLE.load(Ordering::Acquire).is_null());
+        assert_eq!(label_is_clean(ptr::null_mut(), 0), -1);
+        assert_eq!(label_has_source(ptr::null_mut(), 1, 0), -1);
+        assert_eq!(label_intersects(ptr::null_mut(), 1, ptr::null(), 0), -1);
+    }
+
+    #[test]
+    fn test_shared_full() {
+        let tree = Tree::new();
+        let nodes = Table::shared(256 << 10).unwrap();
+        init_sources(&tree, &nodes, 100);
+
+        // Pairs of sources until the region is full; after that a union gets the label of every source.
+        let mut last = 0;
+        'fill: for first in 0..100 {
+            for second in first + 1..100 {
+                last = union(source_label(first), source_label(second), &nodes, &tree).unwrap();
+                if nodes.stats(&tree).overflows > 0 {
+                    break 'fill;
+                }
+            }
+        }
+        let stats = nodes.stats(&tree);
+        assert!(stats.overflows > 0 && stats.bytes <= stats.budget, "{:?}", stats);
+        assert_eq!(find(last, &nodes), BitVec::from_elem(100, true));
+        assert_eq!(union(source_label(0), source_label(1), &nodes, &tree), union(source_label(1), source_label(0), &nodes, &tree));
+
+        // Inserts that keep failing take nothing from the room left for overflow labels.
+        let (labels, bytes) = (nodes.len(), nodes.memory_bytes());
+        for first in 0..100 {
+            for second in 0..100 {
+                assert!(union(source_label(first), source_label(second), &nodes, &tree).unwrap() < labels);
+            }
+        }
+        assert_eq!((nodes.len(), nodes.memory_bytes()), (labels, bytes));
+
+        // Every label below len has been written; one thread leaves no holes.
+        let shared = nodes.shared.as_ref().unwrap();
+        for label in 0..nodes.len() {
+            assert!(shared.try_words(label).is_some(), "label {} of {}", label, nodes.len());
+        }
+    }
+
 }
 
 #[no_mangle]
@@ -239,21 +1181,46 @@ pub extern fn tree_new() -> *mut Tree {
     Box::into_raw(Box::new(Tree::new()))
 }
 
+// A number of bytes with an optional k, m or g suffix, as in TAINT_LABEL_MEMORY=64m.
+pub fn parse_bytes(text: &str) -> Option<usize> {
+    let text = text.trim();
+    let (digits, shift) = match text.chars().last().map(|unit| unit.to_ascii_lowercase()) {
+        Some('k') => (&text[..text.len() - 1], 10),
+        Some('m') => (&text[..text.len() - 1], 20),
+        Some('g') => (&text[..text.len() - 1], 30),
+        _ => (text, 0),
+    };
+    digits.parse::<usize>().ok().map(|count| count << shift)
+}
+
+// The table of the instrumented program: shared with the processes it forks in a region of
+// $TAINT_SHARED_LABELS bytes if set, otherwise bounded by $TAINT_LABEL_MEMORY if set, and otherwise lazy
+// if TAINT_LAZY_LABELS is set.
 #[no_mangle]
 pub extern fn table_new() -> *mut Table {
-    Box::into_raw(Box::new(Table::new()))
+    if let Some(size) = env::var("TAINT_SHARED_LABELS").ok().and_then(|text| parse_bytes(&text)) {
+        match Table::shared(size) {
+            Ok(table) => return Box::into_raw(Box::new(table)),
+            Err(error) => eprintln!("taint: cannot map {} bytes of shared labels, labels stay private: {}", size, error),
+        }
+    }
+    let budget = env::var("TAINT_LABEL_MEMORY").ok().and_then(|text| parse_bytes(&text)).unwrap_or(0);
+    if budget == 0 && env::var_os("TAINT_LAZY_LABELS").is_some() {
+        return Box::into_raw(Box::new(Table::lazy()));
+    }
+    Box::into_raw(Box::new(Table::with_budget(budget)))
 }
 
 #[no_mangle]
 pub extern fn insert_c(tree_ptr: *mut Tree, vector_ptr: *mut BitVec, table_ptr: *mut Table) -> uint32_t {
     let tree = unsafe {
         assert!(!tree_ptr.is_null());
-        &mut *tree_ptr
+        &*tree_ptr
     };
 
     let table = unsafe {
         assert!(!table_ptr.is_null());
-        &mut *table_ptr
+        &*table_ptr
     };
 
     let vector = unsafe {
@@ -264,16 +1231,91 @@ pub extern fn insert_c(tree_ptr: *mut Tree, vector_ptr: *mut BitVec, table_ptr:
     insert(tree, vector, table).unwrap() as uint32_t
 }
 
+#[no_mangle]
+pub extern fn sources_init(tree_ptr: *mut Tree, table_ptr: *mut Table, count_c: uint32_t) {
+    let tree = unsafe {
+        assert!(!tree_ptr.is_null());
+        &*tree_ptr
+    };
+
+    let table = unsafe {
+        assert!(!table_ptr.is_null());
+        &*table_ptr
+    };
+
+    init_sources(tree, table, count_c as usize);
+    blocks::TABLE.store(table_ptr, Ordering::Release);
+    if env::var_os("TAINT_LABEL_STATS").is_some() {
+        TREE.store(tree_ptr, Ordering::Release);
+        unsafe {
+            libc::atexit(print_stats);
+        }
+    }
+}
+
+// The tree of the instrumented program, for print_stats.
+static TREE: AtomicPtr<Tree> = AtomicPtr::new(ptr::null_mut());
+
+extern fn print_stats() {
+    let (table, tree) = (blocks::TABLE.load(Ordering::Acquire), TREE.load(Ordering::Acquire));
+    let stats = unsafe { (*table).stats(&*tree) };
+    eprintln!("taint: {} labels in {} bytes (budget {}), {} unions overflowed",
+              stats.labels, stats.bytes, stats.budget, stats.overflows);
+}
+
+#[no_mangle]
+pub extern fn label_stats(table_ptr: *mut Table, tree_ptr: *mut Tree, stats_ptr: *mut LabelStats) {
+    assert!(!table_ptr.is_null() && !tree_ptr.is_null() && !stats_ptr.is_null());
+    unsafe {
+        *stats_ptr = (*table_ptr).stats(&*tree_ptr);
+    }
+}
+
+// Membership queries on the labels of a table: the labels insert_c, union_c and the source singletons hand
+// out. A null table is the one the program's sources are in, which only a program built with
+// -taint-fixed-labels=false or more than 256 sources has; without it, or for a label whose entry is not
+// published yet (or ever, for a hole in a shared table), they return -1. label_is_clean reads the label's entry only, the others one or a few words of its set,
+// which a lazy table builds on the first query of a deferred union.
+fn query<F: FnOnce(&Table, usize) -> bool>(table_ptr: *mut Table, label_c: uint32_t, answer: F) -> libc::c_int {
+    let table = if table_ptr.is_null() { blocks::TABLE.load(Ordering::Acquire) } else { table_ptr };
+    if table.is_null() {
+        return -1;
+    }
+    let table = unsafe { &*table };
+    let label = label_c as usize;
+    if !table.is_published(label) {
+        return -1;
+    }
+    answer(table, label) as libc::c_int
+}
+
+#[no_mangle]
+pub extern fn label_has_source(table_ptr: *mut Table, label_c: uint32_t, source_c: uint32_t) -> libc::c_int {
+    query(table_ptr, label_c, |table, label| table.has_source(label, source_c as usize))
+}
+
+#[no_mangle]
+pub extern fn label_is_clean(table_ptr: *mut Table, label_c: uint32_t) -> libc::c_int {
+    query(table_ptr, label_c, |table, label| table.is_empty(label))
+}
+
+#[no_mangle]
+pub extern fn label_intersects(table_ptr: *mut Table, label_c: uint32_t, mask_ptr: *const u64, mask_words_c: uint32_t) -> libc::c_int {
+    assert!(!mask_ptr.is_null() || mask_words_c == 0);
+    let mask = if mask_words_c == 0 { &[][..] } else { unsafe { slice::from_raw_parts(mask_ptr, mask_words_c as usize) } };
+    query(table_ptr, label_c, |table, label| table.intersects(label, mask))
+}
+
 #[no_mangle]
 pub extern fn union_c(label1_c: uint32_t, label2_c: uint32_t, table_ptr: *mut Table, tree_ptr: *mut Tree) -> uint32_t {
     let tree = unsafe {
         assert!(!tree_ptr.is_null());
-        &mut *tree_ptr
+        &*tree_ptr
     };
 
     let table = unsafe {
         assert!(!table_ptr.is_null());
-        &mut *table_ptr
+        &*table_ptr
     };
 
     let label1 = label1_c as usize;
@@ -282,6 +1324,12 @@ pub extern fn union_c(label1_c: uint32_t, label2_c: uint32_t, table_ptr: *mut Ta
     union(label1, label2, table, tree).unwrap() as uint32_t
 }
 
+// Under -taint-dual the pass turns every call into a store to the calling thread's tracking flag. This
+// definition is only reached from code built without it, which always tracks.
+#[no_mangle]
+pub extern fn taint_tracking(_on: libc::c_int) {
+}
+
 #[no_mangle]
 pub extern fn tree_free(tree_ptr: *mut Tree) {
     if tree_ptr.is_null() { return; }
@@ -333,12 +1381,25 @@ pub extern fn bitvec_print(table_ptr: *mut Table, label_number_c: uint32_t, tota
 
     assert!(!table_ptr.is_null());
     let table = unsafe {
-        &mut *table_ptr
+        &*table_ptr
     };
 
+    // Functions instrumented before main do not know the final source count yet.
     let mut result = find(label_number, table);
     let len = result.len();
-    result.grow(total_bits - len, false);
+    if len < total_bits {
+        result.grow(total_bits - len, false);
+    }
 
     println!("Basic Block #{}'s Taints: {:?}", bb_number, result);
 }
+
+#[no_mangle]
+pub extern fn bitset_print(words_ptr: *const u64, word_count_c: uint32_t, total_bits_c: uint32_t, bb_number_c: uint32_t) {
+    assert!(!words_ptr.is_null());
+    let words = unsafe {
+        std::slice::from_raw_parts(words_ptr, word_count_c as usize)
+    };
+
+    println!("Basic Block #{}'s Taints: {:?}", bb_number_c, bitset_find(words, total_bits_c as usize));
+}
@@ -0,0 +1,288 @@
+// Direct-mapped shadow memory for -taint-shadow-memory.
+//
+// Every granule of application memory, 4 bytes or with -taint-shadow-granule=1 a single byte, owns one
+// 32-bit label at
+//     SHADOW_BASE + (((addr & APP_MASK) >> shift) << LABEL_SHIFT)
+// where shift is the log2 of the granule, handed over by shadow_init. The instrumented code computes that
+// address inline, so these constants must agree with kShadowBase, kShadowAppMask and kLabelShift in
+// TaintTracking.cpp. The labels of a granule's neighbours are its neighbours in the shadow, so the labels of
+// a value are one contiguous run the pass reads and writes as a vector.
+//
+// The range kernels below serve the library functions the pass models (memcpy, memset, strlen and so on):
+// each moves the labels of a whole byte range at once, so a copy of a buffer costs about a memmove of its
+// shadow. A range covers every granule it touches, and a size of u64::MAX stands for the C string at the
+// start of the range, terminator included.
+
+use std::ptr;
+use std::slice;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use libc::{self, uint32_t};
+use {Table, Tree, union};
+
+pub const SHADOW_BASE: usize = 0x1000_0000_0000;
+// Folds the stack and shared library range (0x7f..) onto the low application range (0x0..).
+pub const APP_MASK: usize = !0x7000_0000_0000;
+pub const WORD_GRANULE_SHIFT: usize = 2;
+pub const BYTE_GRANULE_SHIFT: usize = 0;
+pub const LABEL_SHIFT: usize = 2;
+// Reserved for byte granules either way; 4-byte granules use the first quarter of it.
+pub const SHADOW_SIZE: usize = ((0x0fff_ffff_ffff >> BYTE_GRANULE_SHIFT) + 1) << LABEL_SHIFT;
+
+static MAPPED: AtomicBool = AtomicBool::new(false);
+static GRANULE_SHIFT: AtomicUsize = AtomicUsize::new(WORD_GRANULE_SHIFT);
+
+pub fn shadow_at(addr: usize, shift: usize) -> *mut u32 {
+    (SHADOW_BASE + (((addr & APP_MASK) >> shift) << LABEL_SHIFT)) as *mut u32
+}
+
+pub fn shadow_for(addr: usize) -> *mut u32 {
+    shadow_at(addr, GRANULE_SHIFT.load(Ordering::Relaxed))
+}
+
+// Reserve the whole shadow range up front. MAP_NORESERVE keeps it from being charged
+// against memory; pages only materialize when a label is first written to them.
+#[no_mangle]
+pub extern fn shadow_init(granule_shift: uint32_t) {
+    GRANULE_SHIFT.store(granule_shift as usize, Ordering::Relaxed);
+    if MAPPED.swap(true, Ordering::SeqCst) {
+        return;
+    }
+
+    let addr = unsafe {
+        libc::mmap(SHADOW_BASE as *mut libc::c_void, SHADOW_SIZE, libc::PROT_READ | libc::PROT_WRITE,
+                   libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_NORESERVE, -1, 0)
+    };
+
+    // Without MAP_FIXED the base is only a hint; anything else means the range is taken.
+    if addr != SHADOW_BASE as *mut libc::c_void {
+        eprintln!("taint: cannot reserve shadow memory at {:#x}", SHADOW_BASE);
+        unsafe {
+            if addr != libc::MAP_FAILED {
+                libc::munmap(addr, SHADOW_SIZE);
+            }
+            libc::abort();
+        }
+    }
+}
+
+#[no_mangle]
+pub extern fn shadow_label(addr: usize) -> u32 {
+    unsafe { *shadow_for(addr) }
+}
+
+// Labels are checked this many at a time for one that is neither empty nor already in the union, an or over
+// the chunk the compiler vectorizes.
+const SCAN_CHUNK: usize = 16;
+
+// The labels of the granules under [addr, addr + size) for granules of 1 << shift bytes.
+pub unsafe fn shadow_range_at<'a>(addr: usize, size: u64, shift: usize) -> &'a mut [u32] {
+    let size = if size == u64::MAX { libc::strlen(addr as *const libc::c_char) + 1 } else { size as usize };
+    if size == 0 {
+        return &mut [];
+    }
+    let granules = ((addr + size - 1) >> shift) - (addr >> shift) + 1;
+    slice::from_raw_parts_mut(shadow_at(addr, shift), granules)
+}
+
+unsafe fn shadow_range<'a>(addr: usize, size: u64) -> &'a mut [u32] {
+    shadow_range_at(addr, size, GRANULE_SHIFT.load(Ordering::Relaxed))
+}
+
+fn union_labels(label1: u32, label2: u32, nodes: &Table, root: &Tree) -> u32 {
+    union(label1 as usize, label2 as usize, nodes, root).unwrap() as u32
+}
+
+// The range at dst takes the labels of the range at src, which may overlap it.
+#[no_mangle]
+pub extern fn shadow_copy(dst: usize, src: usize, size: u64) {
+    unsafe {
+        let to = shadow_range(dst, size);
+        let from = shadow_for(src);
+        ptr::copy(from, to.as_mut_ptr(), to.len());
+    }
+}
+
+#[no_mangle]
+pub extern fn shadow_fill(dst: usize, size: u64, label: u32) {
+    fill_labels(unsafe { shadow_range(dst, size) }, label);
+}
+
+pub fn fill_labels(to: &mut [u32], label: u32) {
+    for slot in to.iter_mut() {
+        *slot = label;
+    }
+}
+
+// Every label of the range is unioned with label. Runs of equal labels, the common case after a copy,
+// cost one union, and a chunk of them is written in one vectorized pass.
+#[no_mangle]
+pub extern fn shadow_union_range(dst: usize, size: u64, label: u32, table_ptr: *mut Table, tree_ptr: *mut Tree) {
+    if label == 0 {
+        return;
+    }
+    let (nodes, root) = unsafe { (&*table_ptr, &*tree_ptr) };
+    union_into_labels(unsafe { shadow_range(dst, size) }, label, nodes, root);
+}
+
+pub fn union_into_labels(to: &mut [u32], label: u32, nodes: &Table, root: &Tree) {
+    let (mut last, mut last_union) = (0, label);
+    let mut with_label = |old: u32| {
+        if old != last {
+            last = old;
+            last_union = union_labels(old, label, nodes, root);
+        }
+        last_union
+    };
+    for chunk in to.chunks_mut(SCAN_CHUNK) {
+        let first = chunk[0];
+        if chunk.iter().fold(true, |same, slot| same & (*slot == first)) {
+            let new = with_label(first);
+            for slot in chunk.iter_mut() {
+                *slot = new;
+            }
+            continue;
+        }
+        for slot in chunk.iter_mut() {
+            *slot = with_label(*slot);
+        }
+    }
+}
+
+// The union of every label in the range.
+#[no_mangle]
+pub extern fn shadow_range_label(addr: usize, size: u64, table_ptr: *mut Table, tree_ptr: *mut Tree) -> u32 {
+    let (nodes, root) = unsafe { (&*table_ptr, &*tree_ptr) };
+    labels_union(unsafe { shadow_range(addr, size) }, nodes, root)
+}
+
+pub fn labels_union(from: &[u32], nodes: &Table, root: &Tree) -> u32 {
+    let mut label = 0;
+    for chunk in from.chunks(SCAN_CHUNK) {
+        if chunk.iter().fold(false, |new, slot| new | ((*slot != 0) & (*slot != label))) == false {
+            continue;
+        }
+        for slot in chunk {
+            if *slot != 0 && *slot != label {
+                label = union_labels(label, *slot, nodes, root);
+            }
+        }
+    }
+    label
+}
+
+#[cfg(test)]
+mod test {
+
+    use super::*;
+
+    #[test]
+    fn test_shadow_aliasing() {
+        shadow_init(WORD_GRANULE_SHIFT as u32);
+        shadow_init(WORD_GRANULE_SHIFT as u32);
+
+        let mut words = [0u32; 4];
+        let base = &mut words[0] as *mut u32 as usize;
+
+        // Two different pointers to the same granule see the same label.
+        unsafe {
+            *shadow_for(base + 4) = 7;
+        }
+        assert_eq!(shadow_label(base + 4), 7);
+        assert_eq!(shadow_label(base + 6), 7);
+        assert_eq!(shadow_label(base), 0);
+        assert_eq!(shadow_label(base + 8), 0);
+    }
+
+    #[test]
+    fn test_shadow_ranges() {
+        use {init_sources, source_label};
+        shadow_init(WORD_GRANULE_SHIFT as u32);
+        let tree = Tree::new();
+        let nodes = Table::new();
+        init_sources(&tree, &nodes, 3);
+        let (table_ptr, tree_ptr) = (&nodes as *const Table as *mut Table, &tree as *const Tree as *mut Tree);
+        let (first, second) = (source_label(0) as u32, source_label(1) as u32);
+
+        let src = [0u8; 64];
+        let dst = [0u8; 64];
+        let (src, dst) = (src.as_ptr() as usize, dst.as_ptr() as usize);
+        shadow_fill(src, 64, 0);
+        shadow_fill(dst, 64, 0);
+        shadow_fill(src + 8, 16, first);
+        assert_eq!(shadow_label(src + 4), 0);
+        assert_eq!(shadow_label(src + 8), first);
+        assert_eq!(shadow_label(src + 23), first);
+        assert_eq!(shadow_label(src + 24), 0);
+
+        shadow_copy(dst, src, 64);
+        assert_eq!(shadow_label(dst + 12), first);
+        assert_eq!(shadow_label(dst + 40), 0);
+        assert_eq!(shadow_range_label(dst, 64, table_ptr, tree_ptr), first);
+        assert_eq!(shadow_range_label(dst, 8, table_ptr, tree_ptr), 0);
+
+        // A tainted length reaches every byte copied, on top of what the bytes carried.
+        shadow_union_range(dst, 32, second, table_ptr, tree_ptr);
+        let both = union(first as usize, second as usize, &nodes, &tree).unwrap() as u32;
+        assert_eq!(shadow_label(dst), second);
+        assert_eq!(shadow_label(dst + 8), both);
+        assert_eq!(shadow_label(dst + 40), 0);
+        assert_eq!(shadow_range_label(dst, 64, table_ptr, tree_ptr), both);
+
+        // u64::MAX measures the C string, terminator included.
+        let text = b"taint\0";
+        let text = text.as_ptr() as usize;
+        shadow_fill(text, 8, 0);
+        shadow_fill(text, u64::MAX, second);
+        assert_eq!(shadow_label(text + 5), second);
+        assert_eq!(shadow_range_label(text, u64::MAX, table_ptr, tree_ptr), second);
+    }
+
+    #[test]
+    fn test_shadow_bytes() {
+        use {init_sources, source_label};
+        shadow_init(WORD_GRANULE_SHIFT as u32);
+        let tree = Tree::new();
+        let nodes = Table::new();
+        init_sources(&tree, &nodes, 2);
+        let (first, second) = (source_label(0) as u32, source_label(1) as u32);
+
+        // A struct { char tag; char flags; short length; int value; }, its fields written one at a time.
+        let record = [0u32; 2];
+        let base = record.as_ptr() as usize;
+        let bytes = unsafe { shadow_range_at(base, 8, BYTE_GRANULE_SHIFT) };
+        assert_eq!(bytes.len(), 8);
+        fill_labels(bytes, 0);
+        fill_labels(unsafe { shadow_range_at(base + 1, 1, BYTE_GRANULE_SHIFT) }, first);
+        fill_labels(unsafe { shadow_range_at(base + 4, 4, BYTE_GRANULE_SHIFT) }, second);
+
+        // Every byte keeps its own label, where a 4-byte granule would merge tag, flags and length.
+        let label = |addr, size| labels_union(unsafe { shadow_range_at(addr, size, BYTE_GRANULE_SHIFT) }, &nodes, &tree);
+        assert_eq!(label(base, 1), 0);
+        assert_eq!(label(base + 1, 1), first);
+        assert_eq!(label(base + 2, 2), 0);
+        assert_eq!(label(base + 4, 4), second);
+        let both = union(first as usize, second as usize, &nodes, &tree).unwrap() as u32;
+        assert_eq!(label(base, 8), both);
+
+        union_into_labels(unsafe { shadow_range_at(base + 2, 2, BYTE_GRANULE_SHIFT) }, second, &nodes, &tree);
+        assert_eq!(label(base + 1, 1), first);
+        assert_eq!(label(base + 3, 1), second);
+        assert_eq!(unsafe { shadow_range_at(base + 3, 2, WORD_GRANULE_SHIFT) }.len(), 2);
+    }
+
+    #[test]
+    fn test_shadow_stack_and_heap_disjoint() {
+        shadow_init(WORD_GRANULE_SHIFT as u32);
+
+        let stack = 0u64;
+        let heap = Box::new(0u64);
+        let stack_shadow = shadow_for(&stack as *const u64 as usize) as usize;
+        let heap_shadow = shadow_for(&*heap as *const u64 as usize) as usize;
+
+        assert!(stack_shadow != heap_shadow);
+        assert!(stack_shadow >= SHADOW_BASE && stack_shadow < SHADOW_BASE + SHADOW_SIZE);
+        assert!(heap_shadow >= SHADOW_BASE && heap_shadow < SHADOW_BASE + SHADOW_SIZE);
+        let stack_end = shadow_at(&stack as *const u64 as usize + 7, BYTE_GRANULE_SHIFT) as usize;
+        assert!(stack_end >= SHADOW_BASE && stack_end < SHADOW_BASE + SHADOW_SIZE);
+    }
+}
@@ -0,0 +1,262 @@
+// A label store every process forked from the one that made it shares, for TAINT_SHARED_LABELS.
+//
+// The private table keeps its index behind mutexes and its sets on the heap of the process, so after a
+// fork every worker grows its own copy and a label one worker makes means nothing to another. This store
+// lives in a single memfd mapped MAP_SHARED, so a fork maps the same pages and every process draws labels
+// from one numbering. Nothing in it is a pointer: entries and index slots hold offsets into the region,
+// so it reads the same wherever a process maps it. The region is
+//     Header | entries: u64 per label | index: u32 per slot | words
+// The entry of a label is 1 + the offset of its run in the words, 0 while it is being written, or for good
+// if it is a hole (see append); a run is the length of the set followed by its words, as in the private
+// arenas. try_words reads either kind of 0 entry as no set. An index slot holds 1 + a label,
+// 0 if empty, so a fresh region is all zeroes and only the pages labels are written to are ever touched.
+//
+// Appending is lock-free: a label number and a run are claimed with a compare-and-swap each, the run is
+// written, then published by its entry, and the label takes an index slot with one more compare-and-swap.
+// Two processes interning the same set at once race for the same empty slot; the loser finds the winner's
+// set there and uses its label, and the number it claimed is left unused. Union memos stay per thread, so
+// a repeated union touches nothing shared, as before. Inserts stop short of the end of the region; what is
+// left there is for the overflow labels, so an overflow still always finds its label.
+
+use std::io;
+use std::ptr;
+use std::slice;
+use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+use libc;
+use {hash_words, stats};
+
+#[repr(C)]
+struct Header {
+    // Labels handed out and words used, and how many inserts fell back to an overflow label.
+    next: AtomicU64,
+    used: AtomicU64,
+    overflows: AtomicU64,
+    // The capacities of the three arrays; the index has a power of two slots, twice the labels.
+    labels: u64,
+    slots: u64,
+    words: u64,
+}
+
+pub struct Shared {
+    base: *mut u8,
+    size: usize,
+}
+
+// The region is only written through atomics or where no label points yet.
+unsafe impl Send for Shared {}
+unsafe impl Sync for Shared {}
+
+// An insert that is not an overflow leaves this fraction of the labels and words to overflows.
+const RESERVE_SHIFT: u32 = 4;
+const HEADER_BYTES: usize = 64;
+
+impl Shared {
+    // Maps a fresh region of about size bytes, split so the index stays at most half full.
+    pub fn new(size: usize) -> io::Result<Shared> {
+        let mut slots = 1usize;
+        while slots * 2 * 4 <= size / 8 && slots * 2 <= u32::max_value() as usize {
+            slots *= 2;
+        }
+        let labels = slots / 2;
+        let fixed = HEADER_BYTES + labels * 8 + slots * 4;
+        if size < fixed + 8 * 64 {
+            return Err(io::Error::new(io::ErrorKind::InvalidInput, "shared label region too small"));
+        }
+
+        let base = unsafe {
+            let fd = libc::memfd_create(b"taint-labels\0".as_ptr() as *const libc::c_char, libc::MFD_CLOEXEC);
+            if fd < 0 {
+                return Err(io::Error::last_os_error());
+            }
+            if libc::ftruncate(fd, size as libc::off_t) != 0 {
+                let error = io::Error::last_os_error();
+                libc::close(fd);
+                return Err(error);
+            }
+            let base = libc::mmap(ptr::null_mut(), size, libc::PROT_READ | libc::PROT_WRITE,
+                                  libc::MAP_SHARED | libc::MAP_NORESERVE, fd, 0);
+            libc::close(fd);
+            if base == libc::MAP_FAILED {
+                return Err(io::Error::last_os_error());
+            }
+            base as *mut u8
+        };
+
+        let shared = Shared { base: base, size: size };
+        let header = shared.header() as *const Header as *mut Header;
+        unsafe {
+            (*header).labels = labels as u64;
+            (*header).slots = slots as u64;
+            (*header).words = ((size - fixed) / 8) as u64;
+        }
+        Ok(shared)
+    }
+
+    fn header(&self) -> &Header {
+        unsafe { &*(self.base as *const Header) }
+    }
+
+    fn entries(&self) -> &[AtomicU64] {
+        unsafe { slice::from_raw_parts(self.base.offset(HEADER_BYTES as isize) as *const AtomicU64,
+                                       self.header().labels as usize) }
+    }
+
+    fn index(&self) -> &[AtomicU32] {
+        let header = self.header();
+        unsafe { slice::from_raw_parts(self.base.offset((HEADER_BYTES + header.labels as usize * 8) as isize)
+                                       as *const AtomicU32, header.slots as usize) }
+    }
+
+    fn run(&self, offset: usize) -> *mut u64 {
+        let header = self.header();
+        let words = HEADER_BYTES + header.labels as usize * 8 + header.slots as usize * 4;
+        unsafe { (self.base.offset(words as isize) as *mut u64).offset(offset as isize) }
+    }
+
+    pub fn size(&self) -> usize {
+        self.size
+    }
+
+    pub fn len(&self) -> usize {
+        (self.header().next.load(Ordering::Acquire) as usize).min(self.header().labels as usize)
+    }
+
+    // Bytes the labels handed out so far take, holes included: their entries, two index slots each and their runs.
+    pub fn memory_bytes(&self) -> usize {
+        HEADER_BYTES + self.len() * 16 + self.header().used.load(Ordering::Relaxed) as usize * 8
+    }
+
+    pub fn overflowed(&self) {
+        self.header().overflows.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn overflows(&self) -> usize {
+        self.header().overflows.load(Ordering::Relaxed) as usize
+    }
+
+    pub fn words(&self, label: usize) -> &[u64] {
+        self.try_words(label).expect("taint: shared label not written")
+    }
+
+    // The set of a label, or None if its entry is not published: being written, a hole, or never claimed.
+    pub fn try_words(&self, label: usize) -> Option<&[u64]> {
+        let entry = self.entries().get(label)?.load(Ordering::Acquire) as usize;
+        if entry == 0 {
+            return None;
+        }
+        unsafe {
+            let run = self.run(entry - 1);
+            Some(slice::from_raw_parts(run.offset(1), *run as usize))
+        }
+    }
+
+    // Claims a label number and never writes it, as an append whose words ran out after another label was
+    // claimed does.
+    #[cfg(test)]
+    pub fn hole(&self) -> usize {
+        self.header().next.fetch_add(1, Ordering::AcqRel) as usize
+    }
+
+    // Adds amount to counter unless that would take it past limit, and returns where it was.
+    fn claim(counter: &AtomicU64, amount: u64, limit: u64) -> Option<u64> {
+        let mut current = counter.load(Ordering::Relaxed);
+        loop {
+            if current + amount > limit {
+                return None;
+            }
+            match counter.compare_exchange_weak(current, current + amount, Ordering::AcqRel, Ordering::Relaxed) {
+                Ok(_) => return Some(current),
+                Err(actual) => current = actual,
+            }
+        }
+    }
+
+    // A new label for words that no index slot points at yet. The label number is claimed before the run:
+    // once the labels run out a bounded insert fails without touching the words, so failing inserts never eat
+    // into the reserve. If the words run out instead, the number goes back unless another label was claimed
+    // after it, in which case it stays a hole whose entry is 0 and that no index slot points at. A hole is
+    // below len and its entry counts in memory_bytes, but it is never readable.
+    fn append(&self, words: &[u64], bounded: bool) -> Option<usize> {
+        let header = self.header();
+        let reserve = |capacity: u64| if bounded { capacity - (capacity >> RESERVE_SHIFT) } else { capacity };
+        let label = Shared::claim(&header.next, 1, reserve(header.labels))?;
+        let offset = match Shared::claim(&header.used, words.len() as u64 + 1, reserve(header.words)) {
+            Some(offset) => offset,
+            None => {
+                let _ = header.next.compare_exchange(label + 1, label, Ordering::AcqRel, Ordering::Relaxed);
+                return None;
+            }
+        };
+        unsafe {
+            let run = self.run(offset as usize);
+            *run = words.len() as u64;
+            ptr::copy_nonoverlapping(words.as_ptr(), run.offset(1), words.len());
+        }
+        self.entries()[label as usize].store(offset + 1, Ordering::Release);
+        Some(label as usize)
+    }
+
+    // The label of a set, added if it is new and there is room for it, or bounded is false.
+    pub fn probe(&self, words: &[u64], bounded: bool) -> Option<usize> {
+        let index = self.index();
+        let mask = index.len() - 1;
+        let mut slot = hash_words(words) as usize & mask;
+        let mut probes = 1;
+        let mut fresh = None;
+        loop {
+            let mut current = index[slot].load(Ordering::Acquire);
+            if current == 0 {
+                let label = match fresh {
+                    Some(label) => label,
+                    None => {
+                        let label = self.append(words, bounded);
+                        // The reserve holds every overflow label unless sets keep growing past the sources.
+                        assert!(label.is_some() || bounded, "taint: shared label region is full");
+                        fresh = label;
+                        label?
+                    }
+                };
+                match index[slot].compare_exchange(0, label as u32 + 1, Ordering::AcqRel, Ordering::Acquire) {
+                    Ok(_) => {
+                        stats::probed(probes);
+                        return Some(label);
+                    }
+                    Err(winner) => current = winner,
+                }
+            }
+            if self.words(current as usize - 1) == words {
+                stats::probed(probes);
+                return Some(current as usize - 1);
+            }
+            slot = (slot + 1) & mask;
+            probes += 1;
+        }
+    }
+}
+
+impl Drop for Shared {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.base as *mut libc::c_void, self.size);
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_holes() {
+        let shared = Shared::new(64 << 10).unwrap();
+        let first = shared.probe(&[1], true).unwrap();
+        let hole = shared.hole();
+        let last = shared.probe(&[2], true).unwrap();
+        assert_eq!((first, hole, last, shared.len()), (0, 1, 2, 3));
+        assert_eq!(shared.try_words(first), Some(&[1u64][..]));
+        assert_eq!(shared.try_words(hole), None);
+        assert_eq!(shared.try_words(last), Some(&[2u64][..]));
+        assert_eq!(shared.try_words(shared.len()), None);
+        assert_eq!(shared.try_words(usize::max_value()), None);
+    }
+}
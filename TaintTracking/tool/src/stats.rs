@@ -0,0 +1,315 @@
+// Per-site counters for -taint-site-stats.
+//
+// The pass numbers every union and label load or store it emits and calls site_enter with the number
+// right before it runs; sites_init hands over what each number stands for. Every thread counts into its
+// own array, written by that thread only, so counting takes no lock and no atomic read-modify-write.
+// A union that reaches the runtime also counts a memo hit or a miss against the site entered last, and
+// a miss the probes the index took. The report lists the sites by calls, busiest first, at exit and
+// whenever the program gets SIGUSR1; it goes to $TAINT_SITE_STATS, or stderr if that is not set.
+// TAINT_SITE_STATS_SIGNAL picks another signal (a number, or USR1 or USR2), or none when empty or 0. A
+// signal the program already handles is left alone, and the report then comes at exit only. A process
+// forked from the program counts from zero and writes its own report, to $TAINT_SITE_STATS with its pid
+// appended.
+
+use std::cell::{Cell, RefCell};
+use std::env;
+use std::ffi::CStr;
+use std::fs::File;
+use std::io::{self, Write};
+use std::mem;
+use std::sync::atomic::{AtomicBool, AtomicPtr, AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex, MutexGuard, Once};
+use std::thread;
+use std::time::Duration;
+use std::ptr;
+use libc::{self, c_char, c_int, uint32_t};
+use trace::{forked, output_path};
+
+const CALLS: usize = 0;
+const HITS: usize = 1;
+const MISSES: usize = 2;
+const PROBES: usize = 3;
+const NO_SITE: usize = usize::max_value();
+const SIGNAL_POLL_MS: u64 = 100;
+
+// One entry of the table the pass emits; must agree with site_type in TaintTracking.cpp.
+#[repr(C)]
+pub struct Site {
+    pub kind: *const c_char,
+    pub function: *const c_char,
+    pub block: uint32_t,
+    pub line: uint32_t,
+}
+
+type Counters = Box<[[AtomicU64; 4]]>;
+
+static SITES: AtomicPtr<Site> = AtomicPtr::new(ptr::null_mut());
+static COUNT: AtomicUsize = AtomicUsize::new(0);
+static THREADS: Mutex<Vec<Arc<Counters>>> = Mutex::new(Vec::new());
+static SIGNALLED: AtomicBool = AtomicBool::new(false);
+static POLLING: AtomicBool = AtomicBool::new(false);
+static START: Once = Once::new();
+
+struct Local {
+    counters: RefCell<Option<Arc<Counters>>>,
+    current: Cell<usize>,
+}
+
+thread_local!(static LOCAL: Local = Local { counters: RefCell::new(None), current: Cell::new(NO_SITE) });
+
+impl Local {
+    // Adds to one counter of the current site; the calling thread is the only writer.
+    fn add(&self, counter: usize, amount: u64) {
+        let site = self.current.get();
+        if site == NO_SITE {
+            return;
+        }
+        let mut counters = self.counters.borrow_mut();
+        if counters.is_none() {
+            let fresh: Vec<[AtomicU64; 4]> = (0..COUNT.load(Ordering::Acquire)).map(|_| Default::default()).collect();
+            let fresh = Arc::new(fresh.into_boxed_slice());
+            THREADS.lock().unwrap().push(fresh.clone());
+            *counters = Some(fresh);
+        }
+        let count = &counters.as_ref().unwrap()[site][counter];
+        count.store(count.load(Ordering::Relaxed) + amount, Ordering::Relaxed);
+    }
+}
+
+fn enabled() -> bool {
+    COUNT.load(Ordering::Relaxed) != 0
+}
+
+// Called by union on a memo lookup, and by the index with the probes a new set took.
+pub fn memo(hit: bool) {
+    if enabled() {
+        let _ = LOCAL.try_with(|local| local.add(if hit { HITS } else { MISSES }, 1));
+    }
+}
+
+pub fn probed(probes: usize) {
+    if enabled() {
+        let _ = LOCAL.try_with(|local| local.add(PROBES, probes as u64));
+    }
+}
+
+fn text(name: *const c_char) -> String {
+    if name.is_null() {
+        return String::new();
+    }
+    unsafe { CStr::from_ptr(name).to_string_lossy().into_owned() }
+}
+
+pub fn report(out: &mut dyn Write) -> io::Result<()> {
+    let count = COUNT.load(Ordering::Acquire);
+    let sites = SITES.load(Ordering::Acquire);
+    let mut totals = vec![[0u64; 4]; count];
+    for counters in THREADS.lock().unwrap().iter() {
+        for (total, counts) in totals.iter_mut().zip(counters.iter()) {
+            for counter in 0..4 {
+                total[counter] += counts[counter].load(Ordering::Relaxed);
+            }
+        }
+    }
+
+    let mut order: Vec<usize> = (0..count).filter(|site| totals[*site][CALLS] != 0).collect();
+    order.sort_by(|a, b| totals[*b][CALLS].cmp(&totals[*a][CALLS]).then(a.cmp(b)));
+    writeln!(out, "{:>12} {:>12} {:>12} {:>12} {:>8} {:>6}  {:<6} {}", "calls", "inline", "hits", "misses",
+             "probes", "site", "kind", "function:block line")?;
+    for site in order {
+        let [calls, hits, misses, probes] = totals[site];
+        let info = unsafe { &*sites.offset(site as isize) };
+        let kind = text(info.kind);
+        // Unions the inline fast paths decided never reach the memo; loads and stores never do.
+        let inline = if kind == "union" { calls.saturating_sub(hits + misses).to_string() } else { "-".to_string() };
+        let per_miss = if misses == 0 { 0.0 } else { probes as f64 / misses as f64 };
+        writeln!(out, "{:>12} {:>12} {:>12} {:>12} {:>8.2} {:>6}  {:<6} {}:{} {}", calls, inline, hits, misses,
+                 per_miss, site, kind, text(info.function), info.block, info.line)?;
+    }
+    Ok(())
+}
+
+fn dump() {
+    let result = match env::var("TAINT_SITE_STATS") {
+        Ok(_) => File::create(output_path("TAINT_SITE_STATS", "")).and_then(|mut file| report(&mut file)),
+        Err(_) => report(&mut io::stderr()),
+    };
+    if let Err(error) = result {
+        eprintln!("taint: cannot write site stats: {}", error);
+    }
+}
+
+extern fn dump_at_exit() {
+    dump();
+}
+
+// Only flags the signal; writing the report is left to a thread that is allowed to allocate.
+extern fn on_signal(_: c_int) {
+    SIGNALLED.store(true, Ordering::Relaxed);
+}
+
+fn report_signal() -> Option<c_int> {
+    let name = match env::var("TAINT_SITE_STATS_SIGNAL") {
+        Ok(name) => name,
+        Err(_) => return Some(libc::SIGUSR1),
+    };
+    match name.strip_prefix("SIG").unwrap_or(&name) {
+        "" | "0" => None,
+        "USR1" => Some(libc::SIGUSR1),
+        "USR2" => Some(libc::SIGUSR2),
+        number => match number.parse::<c_int>() {
+            Ok(signal) if signal > 0 => Some(signal),
+            _ => {
+                eprintln!("taint: TAINT_SITE_STATS_SIGNAL={} is not a signal", name);
+                None
+            }
+        },
+    }
+}
+
+// Installs on_signal unless the program has a handler of its own for the signal; true if it did.
+fn install(signal: c_int) -> bool {
+    unsafe {
+        let mut action: libc::sigaction = mem::zeroed();
+        if libc::sigaction(signal, ptr::null(), &mut action) != 0 {
+            return false;
+        }
+        if action.sa_sigaction != libc::SIG_DFL {
+            eprintln!("taint: signal {} already has a handler; site stats are written at exit only", signal);
+            return false;
+        }
+        action.sa_sigaction = on_signal as extern fn(c_int) as libc::sighandler_t;
+        action.sa_flags = libc::SA_RESTART;
+        libc::sigemptyset(&mut action.sa_mask);
+        libc::sigaction(signal, &action, ptr::null_mut()) == 0
+    }
+}
+
+fn start_polling() {
+    POLLING.store(true, Ordering::Relaxed);
+    thread::spawn(|| loop {
+        thread::sleep(Duration::from_millis(SIGNAL_POLL_MS));
+        if SIGNALLED.swap(false, Ordering::Relaxed) {
+            dump();
+        }
+    });
+}
+
+// The thread that forks holds THREADS across the fork, so the child never starts with it locked by the
+// poll thread, which the child does not have.
+thread_local!(static FORK_GUARD: RefCell<Option<MutexGuard<'static, Vec<Arc<Counters>>>>> = RefCell::new(None));
+
+extern fn before_fork() {
+    let guard = THREADS.lock().unwrap();
+    FORK_GUARD.with(|held| *held.borrow_mut() = Some(guard));
+}
+
+extern fn after_fork_parent() {
+    FORK_GUARD.with(|held| held.borrow_mut().take());
+}
+
+// The child keeps only the counters of the thread that forked, zeroed, so its report covers what it ran.
+extern fn after_fork_child() {
+    forked();
+    let own = LOCAL.try_with(|local| local.counters.borrow().clone()).unwrap_or(None);
+    if let Some(mut threads) = FORK_GUARD.with(|held| held.borrow_mut().take()) {
+        threads.retain(|counters| own.as_ref().map_or(false, |own| Arc::ptr_eq(counters, own)));
+        for counts in threads.iter().flat_map(|counters| counters.iter()) {
+            for count in counts.iter() {
+                count.store(0, Ordering::Relaxed);
+            }
+        }
+    }
+    SIGNALLED.store(false, Ordering::Relaxed);
+    if POLLING.load(Ordering::Relaxed) {
+        start_polling();
+    }
+}
+
+#[no_mangle]
+pub extern fn sites_init(sites_ptr: *const Site, count_c: uint32_t) {
+    if count_c == 0 {
+        return;
+    }
+    SITES.store(sites_ptr as *mut Site, Ordering::Release);
+    COUNT.store(count_c as usize, Ordering::Release);
+    START.call_once(|| {
+        unsafe {
+            libc::atexit(dump_at_exit);
+            libc::pthread_atfork(Some(before_fork), Some(after_fork_parent), Some(after_fork_child));
+        }
+        if report_signal().map_or(false, install) {
+            start_polling();
+        }
+    });
+}
+
+#[no_mangle]
+pub extern fn site_enter(site_c: uint32_t) {
+    let site = site_c as usize;
+    if site >= COUNT.load(Ordering::Relaxed) {
+        return;
+    }
+    let _ = LOCAL.try_with(|local| {
+        local.current.set(site);
+        local.add(CALLS, 1);
+    });
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_site_report() {
+        let sites = [
+            Site { kind: b"union\0".as_ptr() as *const c_char, function: b"main\0".as_ptr() as *const c_char, block: 2, line: 7 },
+            Site { kind: b"load\0".as_ptr() as *const c_char, function: b"f\0".as_ptr() as *const c_char, block: 0, line: 3 },
+            Site { kind: b"store\0".as_ptr() as *const c_char, function: b"f\0".as_ptr() as *const c_char, block: 1, line: 0 },
+        ];
+        SITES.store(sites.as_ptr() as *mut Site, Ordering::Release);
+        COUNT.store(sites.len(), Ordering::Release);
+
+        site_enter(1);
+        site_enter(0);
+        memo(true);
+        site_enter(0);
+        memo(false);
+        probed(3);
+        site_enter(0);
+        site_enter(7);
+
+        let mut out = Vec::new();
+        report(&mut out).unwrap();
+        let out = String::from_utf8(out).unwrap();
+        let lines: Vec<Vec<&str>> = out.lines().skip(1).map(|line| line.split_whitespace().collect()).collect();
+        assert_eq!(lines, vec![vec!["3", "1", "1", "1", "3.00", "0", "union", "main:2", "7"],
+                               vec!["1", "-", "0", "0", "0.00", "1", "load", "f:0", "3"]]);
+        COUNT.store(0, Ordering::Release);
+    }
+
+    #[test]
+    fn test_report_signal() {
+        env::set_var("TAINT_SITE_STATS_SIGNAL", "SIGUSR2");
+        assert_eq!(report_signal(), Some(libc::SIGUSR2));
+        env::set_var("TAINT_SITE_STATS_SIGNAL", "SIGSIGUSR1");
+        assert_eq!(report_signal(), None);
+        env::set_var("TAINT_SITE_STATS_SIGNAL", "10");
+        assert_eq!(report_signal(), Some(10));
+        env::set_var("TAINT_SITE_STATS_SIGNAL", "0");
+        assert_eq!(report_signal(), None);
+        env::remove_var("TAINT_SITE_STATS_SIGNAL");
+        assert_eq!(report_signal(), Some(libc::SIGUSR1));
+
+        extern fn own(_: c_int) {}
+        unsafe {
+            libc::signal(libc::SIGUSR2, own as extern fn(c_int) as libc::sighandler_t);
+        }
+        assert!(!install(libc::SIGUSR2));
+        let mut action: libc::sigaction = unsafe { mem::zeroed() };
+        unsafe {
+            libc::sigaction(libc::SIGUSR2, ptr::null(), &mut action);
+        }
+        assert_eq!(action.sa_sigaction, own as extern fn(c_int) as libc::sighandler_t);
+    }
+}
@@ -0,0 +1,621 @@
+// Binary taint trace, written in place of printing every block's taints to stdout.
+//
+// The file is MAGIC and VERSION followed by records, each a tag byte and little-endian fields:
+//     LABEL_TAG   label: u32, words: u32, then that many u64 words of the set
+//     SET_TAG     id: u32, words: u32, then that many u64 words of the set
+//     BLOCK_TAG   block: u32, label: u32, total_bits: u32
+//     BITSET_TAG  block: u32, id: u32, total_bits: u32
+//     ENTER_TAG   block: u32, label: u32
+//     ENTER_SET_TAG  block: u32, id: u32
+//     SAMPLE_TAG  rate: u32
+//     DROPPED_TAG records: u32
+//     SINK_TAG    site: u32, arg: u32, label: u32, then the sink's name as a u32 length and its bytes
+//     SINK_SET_TAG  site: u32, arg: u32, id: u32, name as for SINK_TAG
+// BLOCK_TAG and ENTER_TAG refer to a label of the runtime table, BITSET_TAG and ENTER_SET_TAG to a
+// fixed-width label from the pass, which gets its id here. The ENTER records come from -taint-block-trace
+// and go to a file of their own, see blocks.rs. The SINK records come from the sinks of a -taint-policy file, one
+// for every tainted argument a sink is called with. Each thread defines a label in its own stream before
+// its first block record that uses it, so a set is written once per thread however many blocks carry it.
+// A label whose set a lazy table has not built yet is defined at the end of the stream instead, once the
+// thread flushes for the last time, all of them built together; version 2 allows those late definitions.
+// The main thread builds them at exit(), together with those of every thread that exited before it.
+//
+// Records go to a buffer of the thread that made them, which takes no lock. A full buffer is
+// appended to the file in one piece, under the file's lock, so the streams of different threads never
+// interleave within a buffer. A thread flushes what is left when it exits, the main thread at exit().
+// The file is $TAINT_TRACE, or taint.trace in the working directory; a forked child writes its own, with its
+// pid appended, and drops what the parent had not written out when it forked. taint_decode turns it back into
+// the text the runtime used to print.
+
+use std::cell::RefCell;
+use std::ffi::CStr;
+use std::collections::{BTreeMap, HashMap, HashSet};
+use std::env;
+use std::fs::File;
+use std::io::{self, Read, Write};
+use std::mem;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::{Mutex, MutexGuard, Once};
+use libc::{self, c_char, uint32_t};
+use bit_vec::BitVec;
+use std::ptr;
+use {Table, bits_of, bitset_find, resolve_all};
+use blocks::TABLE;
+
+pub const MAGIC: &'static [u8; 4] = b"TTRC";
+pub const VERSION: u32 = 2;
+pub const LABEL_TAG: u8 = 1;
+pub const SET_TAG: u8 = 2;
+pub const BLOCK_TAG: u8 = 3;
+pub const BITSET_TAG: u8 = 4;
+pub const ENTER_TAG: u8 = 5;
+pub const ENTER_SET_TAG: u8 = 6;
+pub const SAMPLE_TAG: u8 = 7;
+pub const DROPPED_TAG: u8 = 8;
+pub const SINK_TAG: u8 = 9;
+pub const SINK_SET_TAG: u8 = 10;
+
+const BUFFER_BYTES: usize = 1 << 16;
+
+struct Buffer {
+    bytes: Vec<u8>,
+    labels: HashSet<u32>,
+    sets: HashMap<Vec<u64>, u32>,
+    // Labels used but not defined yet, and their table.
+    pending: Vec<u32>,
+    table: *const Table,
+}
+
+impl Buffer {
+    fn define_pending(&mut self) {
+        if self.pending.is_empty() {
+            return;
+        }
+        define_labels(&mut self.bytes, unsafe { &*self.table }, &self.pending);
+        self.pending.clear();
+    }
+}
+
+// A thread that exits leaves the labels it has not defined to flush_at_exit, since building them may start
+// threads, which a thread-local destructor must not do.
+impl Drop for Buffer {
+    fn drop(&mut self) {
+        if !self.pending.is_empty() {
+            ORPHANS.lock().unwrap().push((self.table as usize, mem::replace(&mut self.pending, Vec::new())));
+        }
+        flush(&mut self.bytes);
+    }
+}
+
+fn define_labels(bytes: &mut Vec<u8>, table: &Table, labels: &[u32]) {
+    resolve_all(labels, table);
+    for &label in labels {
+        encode_set(bytes, LABEL_TAG, label, table.words(label as usize));
+    }
+}
+
+thread_local!(static BUFFER: RefCell<Buffer> = RefCell::new(Buffer {
+    bytes: Vec::with_capacity(BUFFER_BYTES),
+    labels: HashSet::new(),
+    sets: HashMap::new(),
+    pending: Vec::new(),
+    table: ptr::null(),
+}));
+
+static FILE: Mutex<Option<File>> = Mutex::new(None);
+// The labels threads that have exited still had to define, and the address of their table.
+static ORPHANS: Mutex<Vec<(usize, Vec<u32>)>> = Mutex::new(Vec::new());
+static FORKED: AtomicBool = AtomicBool::new(false);
+
+// The locks of the trace, held by the thread that forks from right before the fork until right after, so the
+// child never starts with one locked by a thread it does not have.
+thread_local!(static FORK_GUARDS: RefCell<Option<(MutexGuard<'static, Option<File>>,
+                                                  MutexGuard<'static, Vec<(usize, Vec<u32>)>>)>> = RefCell::new(None));
+
+extern fn before_fork() {
+    let guards = (FILE.lock().unwrap(), ORPHANS.lock().unwrap());
+    FORK_GUARDS.with(|held| *held.borrow_mut() = Some(guards));
+}
+
+extern fn after_fork_parent() {
+    FORK_GUARDS.with(|held| held.borrow_mut().take());
+}
+
+// The child starts a trace of its own, without the records the parent had not written out yet.
+extern fn after_fork_child() {
+    forked();
+    if let Some((mut file, mut orphans)) = FORK_GUARDS.with(|held| held.borrow_mut().take()) {
+        *file = None;
+        orphans.clear();
+    }
+    let _ = BUFFER.try_with(|buffer| {
+        let mut buffer = buffer.borrow_mut();
+        buffer.bytes.clear();
+        buffer.labels.clear();
+        buffer.sets.clear();
+        buffer.pending.clear();
+    });
+}
+static AT_EXIT: Once = Once::new();
+// Ids of fixed-width sets, shared so two threads never give different sets the same id.
+static NEXT_SET: AtomicUsize = AtomicUsize::new(0);
+
+pub fn put_u32(bytes: &mut Vec<u8>, value: u32) {
+    bytes.extend_from_slice(&value.to_le_bytes());
+}
+
+pub fn encode_set(bytes: &mut Vec<u8>, tag: u8, id: u32, words: &[u64]) {
+    bytes.push(tag);
+    put_u32(bytes, id);
+    put_u32(bytes, words.len() as u32);
+    for word in words {
+        bytes.extend_from_slice(&word.to_le_bytes());
+    }
+}
+
+pub fn encode_block(bytes: &mut Vec<u8>, tag: u8, block: u32, label: u32, total_bits: u32) {
+    bytes.push(tag);
+    put_u32(bytes, block);
+    put_u32(bytes, label);
+    put_u32(bytes, total_bits);
+}
+
+pub fn encode_enter(bytes: &mut Vec<u8>, tag: u8, block: u32, label: u32) {
+    bytes.push(tag);
+    put_u32(bytes, block);
+    put_u32(bytes, label);
+}
+
+pub fn encode_sink(bytes: &mut Vec<u8>, tag: u8, site: u32, arg: u32, label: u32, name: &[u8]) {
+    bytes.push(tag);
+    put_u32(bytes, site);
+    put_u32(bytes, arg);
+    put_u32(bytes, label);
+    put_u32(bytes, name.len() as u32);
+    bytes.extend_from_slice(name);
+}
+
+// The file named by the environment variable var, or default. A process forked from the program writes its
+// own, named with its pid appended, so it neither truncates nor interleaves with the parent's.
+pub fn output_path(var: &str, default: &str) -> String {
+    let path = env::var(var).unwrap_or(default.to_string());
+    if FORKED.load(Ordering::Relaxed) {
+        format!("{}.{}", path, unsafe { libc::getpid() })
+    } else {
+        path
+    }
+}
+
+pub fn forked() {
+    FORKED.store(true, Ordering::Relaxed);
+}
+
+// Creates the trace at output_path and writes the header.
+pub fn create(var: &str, default: &str) -> Option<File> {
+    let path = output_path(var, default);
+    let mut header = MAGIC.to_vec();
+    put_u32(&mut header, VERSION);
+    match File::create(&path).and_then(|mut file| file.write_all(&header).map(|_| file)) {
+        Ok(file) => Some(file),
+        Err(error) => {
+            eprintln!("taint: cannot create trace {}: {}", path, error);
+            None
+        }
+    }
+}
+
+fn flush(bytes: &mut Vec<u8>) {
+    if bytes.is_empty() {
+        return;
+    }
+    let mut file = FILE.lock().unwrap();
+    if file.is_none() {
+        *file = create("TAINT_TRACE", "taint.trace");
+    }
+    if let Some(ref mut file) = *file {
+        if let Err(error) = file.write_all(bytes) {
+            eprintln!("taint: cannot write trace: {}", error);
+        }
+    }
+    bytes.clear();
+}
+
+extern fn flush_at_exit() {
+    let _ = BUFFER.try_with(|buffer| {
+        let mut buffer = buffer.borrow_mut();
+        buffer.define_pending();
+        flush(&mut buffer.bytes);
+    });
+    let orphans = mem::replace(&mut *ORPHANS.lock().unwrap(), Vec::new());
+    let mut bytes = Vec::new();
+    for (table, labels) in orphans {
+        define_labels(&mut bytes, unsafe { &*(table as *const Table) }, &labels);
+    }
+    flush(&mut bytes);
+}
+
+fn record<F: FnOnce(&mut Buffer)>(write: F) {
+    AT_EXIT.call_once(|| unsafe {
+        libc::atexit(flush_at_exit);
+        libc::pthread_atfork(Some(before_fork), Some(after_fork_parent), Some(after_fork_child));
+    });
+    BUFFER.with(|buffer| {
+        let mut buffer = buffer.borrow_mut();
+        write(&mut buffer);
+        if buffer.bytes.len() >= BUFFER_BYTES {
+            flush(&mut buffer.bytes);
+        }
+    });
+}
+
+// Defines a table label in this thread's stream the first time it is used there, or leaves that for the end
+// if its set is not built yet.
+fn define_label(buffer: &mut Buffer, nodes: &Table, label: u32) {
+    if !buffer.labels.insert(label) {
+        return;
+    }
+    if nodes.is_deferred(label as usize) {
+        buffer.pending.push(label);
+        buffer.table = nodes;
+    } else {
+        encode_set(&mut buffer.bytes, LABEL_TAG, label, nodes.words(label as usize));
+    }
+}
+
+pub fn trace_table_label(nodes: &Table, label: u32, total_bits: u32, block: u32) {
+    record(|buffer| {
+        define_label(buffer, nodes, label);
+        encode_block(&mut buffer.bytes, BLOCK_TAG, block, label, total_bits);
+    });
+}
+
+pub fn trace_fixed_label(words: &[u64], total_bits: u32, block: u32) {
+    record(|buffer| {
+        let id = set_id(buffer, words);
+        encode_block(&mut buffer.bytes, BITSET_TAG, block, id, total_bits);
+    });
+}
+
+// The id of a fixed-width set in this thread's stream, defining it first if it is new there.
+fn set_id(buffer: &mut Buffer, words: &[u64]) -> u32 {
+    match buffer.sets.get(words) {
+        Some(id) => *id,
+        None => {
+            let id = NEXT_SET.fetch_add(1, Ordering::Relaxed) as u32;
+            buffer.sets.insert(words.to_vec(), id);
+            encode_set(&mut buffer.bytes, SET_TAG, id, words);
+            id
+        }
+    }
+}
+
+pub fn trace_table_sink(nodes: &Table, label: u32, site: u32, arg: u32, name: &[u8]) {
+    record(|buffer| {
+        define_label(buffer, nodes, label);
+        encode_sink(&mut buffer.bytes, SINK_TAG, site, arg, label, name);
+    });
+}
+
+pub fn trace_fixed_sink(words: &[u64], site: u32, arg: u32, name: &[u8]) {
+    record(|buffer| {
+        let id = set_id(buffer, words);
+        encode_sink(&mut buffer.bytes, SINK_SET_TAG, site, arg, id, name);
+    });
+}
+
+fn read_u32<R: Read>(reader: &mut R) -> io::Result<u32> {
+    let mut bytes = [0u8; 4];
+    reader.read_exact(&mut bytes)?;
+    Ok(u32::from_le_bytes(bytes))
+}
+
+fn read_words<R: Read>(reader: &mut R) -> io::Result<Vec<u64>> {
+    let count = read_u32(reader)? as usize;
+    let mut words = Vec::with_capacity(count);
+    let mut bytes = [0u8; 8];
+    for _ in 0..count {
+        reader.read_exact(&mut bytes)?;
+        words.push(u64::from_le_bytes(bytes));
+    }
+    Ok(words)
+}
+
+fn invalid(message: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, message.to_string())
+}
+
+// What the ENTER records of one block add up to.
+#[derive(Default)]
+struct Entries {
+    count: u64,
+    tainted: u64,
+    taints: Vec<u64>,
+}
+
+impl Entries {
+    fn add(&mut self, words: &[u64]) {
+        self.count += 1;
+        // Fixed-width labels come with their zero words, table labels without.
+        let len = words.iter().rposition(|word| *word != 0).map_or(0, |last| last + 1);
+        if len != 0 {
+            self.tainted += 1;
+        }
+        if self.taints.len() < len {
+            self.taints.resize(len, 0);
+        }
+        for (taint, word) in self.taints.iter_mut().zip(words) {
+            *taint |= *word;
+        }
+    }
+}
+
+// A record that refers to a label or set, kept until every definition has been read.
+enum Use {
+    Block(u8, u32, u32, u32),
+    Enter(u8, u32, u32),
+    Sink(u8, u32, u32, u32, Vec<u8>),
+}
+
+// Expands a trace into the lines bitvec_print and bitset_print used to print, in the order they ran.
+// Block entries are summed up per block instead and printed at the end. The whole trace is read before
+// anything is printed, since a label may be defined after the records that use it.
+pub fn decode<R: Read, W: Write>(reader: &mut R, out: &mut W) -> io::Result<()> {
+    let mut header = [0u8; 4];
+    reader.read_exact(&mut header)?;
+    let version = if &header == MAGIC { read_u32(reader)? } else { 0 };
+    if version == 0 || version > VERSION {
+        return Err(invalid("not a taint trace"));
+    }
+
+    let mut labels: HashMap<u32, Vec<u64>> = HashMap::new();
+    let mut sets: HashMap<u32, Vec<u64>> = HashMap::new();
+    let mut uses = Vec::new();
+    let mut sample = 0;
+    let mut dropped = 0;
+    let mut tag = [0u8; 1];
+    loop {
+        match reader.read(&mut tag)? {
+            0 => break,
+            _ => {}
+        }
+        match tag[0] {
+            LABEL_TAG | SET_TAG => {
+                let id = read_u32(reader)?;
+                let words = read_words(reader)?;
+                if tag[0] == LABEL_TAG { labels.insert(id, words); } else { sets.insert(id, words); }
+            }
+            BLOCK_TAG | BITSET_TAG => {
+                let block = read_u32(reader)?;
+                let id = read_u32(reader)?;
+                uses.push(Use::Block(tag[0], block, id, read_u32(reader)?));
+            }
+            ENTER_TAG | ENTER_SET_TAG => {
+                let block = read_u32(reader)?;
+                uses.push(Use::Enter(tag[0], block, read_u32(reader)?));
+            }
+            SINK_TAG | SINK_SET_TAG => {
+                let site = read_u32(reader)?;
+                let arg = read_u32(reader)?;
+                let id = read_u32(reader)?;
+                let mut name = vec![0u8; read_u32(reader)? as usize];
+                reader.read_exact(&mut name)?;
+                uses.push(Use::Sink(tag[0], site, arg, id, name));
+            }
+            SAMPLE_TAG => sample = read_u32(reader)?,
+            DROPPED_TAG => dropped += read_u32(reader)? as u64,
+            _ => return Err(invalid("unknown record")),
+        }
+    }
+
+    let mut entries: BTreeMap<u32, Entries> = BTreeMap::new();
+    for record in uses {
+        match record {
+            Use::Block(tag, block, id, total_bits) => {
+                let total_bits = total_bits as usize;
+                let taints = if tag == BLOCK_TAG {
+                    let words = labels.get(&id).ok_or_else(|| invalid("block uses an undefined label"))?;
+                    let mut bits: BitVec = bits_of(words);
+                    let len = bits.len();
+                    if len < total_bits {
+                        bits.grow(total_bits - len, false);
+                    }
+                    bits
+                } else {
+                    let words = sets.get(&id).ok_or_else(|| invalid("block uses an undefined set"))?;
+                    bitset_find(words, total_bits)
+                };
+                writeln!(out, "Basic Block #{}'s Taints: {:?}", block, taints)?;
+            }
+            Use::Enter(tag, block, id) => {
+                let words = if tag == ENTER_TAG { labels.get(&id) } else { sets.get(&id) };
+                let words = words.ok_or_else(|| invalid("block entry uses an undefined label"))?;
+                entries.entry(block).or_insert_with(Entries::default).add(words);
+            }
+            Use::Sink(tag, site, arg, id, name) => {
+                let words = if tag == SINK_TAG { labels.get(&id) } else { sets.get(&id) };
+                let words = words.ok_or_else(|| invalid("sink uses an undefined label"))?;
+                writeln!(out, "{}", sink_line(site, arg, &name, words))?;
+            }
+        }
+    }
+
+    if sample != 0 {
+        writeln!(out, "Block entries, 1 in {} recorded, {} dropped", sample, dropped)?;
+    }
+    for (block, entries) in entries.iter() {
+        writeln!(out, "Block #{} entered {} times, {} under taint, taints {:?}",
+                 block, entries.count, entries.tainted, bits_of(&entries.taints))?;
+    }
+    Ok(())
+}
+
+#[no_mangle]
+pub extern fn trace_label(table_ptr: *mut Table, label_number_c: uint32_t, total_bits_c: uint32_t, bb_number_c: uint32_t) {
+    assert!(!table_ptr.is_null());
+    let table = unsafe {
+        &*table_ptr
+    };
+
+    trace_table_label(table, label_number_c, total_bits_c, bb_number_c);
+}
+
+#[no_mangle]
+pub extern fn trace_bitset(words_ptr: *const u64, word_count_c: uint32_t, total_bits_c: uint32_t, bb_number_c: uint32_t) {
+    assert!(!words_ptr.is_null());
+    let words = unsafe {
+        ::std::slice::from_raw_parts(words_ptr, word_count_c as usize)
+    };
+
+    trace_fixed_label(words, total_bits_c, bb_number_c);
+}
+
+// What a sink check does with a tainted argument besides recording it, as -taint-sink-action picks it.
+pub const SINK_TRACE: u32 = 0;
+pub const SINK_LOG: u32 = 1;
+pub const SINK_ABORT: u32 = 2;
+
+// The line taint_decode prints for a sink record, and -taint-sink-action=log prints as it happens.
+pub fn sink_line(site: u32, arg: u32, name: &[u8], words: &[u64]) -> String {
+    let len = words.iter().rposition(|word| *word != 0).map_or(0, |last| last + 1);
+    format!("Sink #{} ({}) argument {}'s Taints: {:?}", site, String::from_utf8_lossy(name), arg, bits_of(&words[..len]))
+}
+
+// Aborting writes out what this thread has recorded first, so the trace ends with the offending sink.
+fn sink_act(action: u32, site: u32, arg: u32, name: &[u8], words: &[u64]) {
+    if action == SINK_TRACE {
+        return;
+    }
+    eprintln!("taint: {}", sink_line(site, arg, name, words));
+    if action == SINK_ABORT {
+        flush_at_exit();
+        unsafe {
+            libc::abort();
+        }
+    }
+}
+
+// Called right before a sink, with the label of one of its arguments. Only tainted arguments are recorded;
+// the pass already skips the call for an empty label.
+#[no_mangle]
+pub extern fn sink_check(name_ptr: *const c_char, site_c: uint32_t, arg_c: uint32_t, label_c: uint32_t, action_c: uint32_t) {
+    let table = TABLE.load(Ordering::Acquire);
+    if label_c == 0 || table.is_null() {
+        return;
+    }
+    let name = unsafe { CStr::from_ptr(name_ptr) };
+    let table = unsafe { &*table };
+    trace_table_sink(table, label_c, site_c, arg_c, name.to_bytes());
+    if action_c != SINK_TRACE {
+        sink_act(action_c, site_c, arg_c, name.to_bytes(), table.words(label_c as usize));
+    }
+}
+
+#[no_mangle]
+pub extern fn sink_check_set(name_ptr: *const c_char, site_c: uint32_t, arg_c: uint32_t, width_c: uint32_t,
+                             word0: u64, word1: u64, word2: u64, word3: u64, action_c: uint32_t) {
+    let words = [word0, word1, word2, word3];
+    let words = &words[..width_c as usize];
+    if words.iter().all(|word| *word == 0) {
+        return;
+    }
+    let name = unsafe { CStr::from_ptr(name_ptr) };
+    trace_fixed_sink(words, site_c, arg_c, name.to_bytes());
+    sink_act(action_c, site_c, arg_c, name.to_bytes(), words);
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use {Tree, init_sources, source_label, union};
+
+    #[test]
+    fn test_decode() {
+        let tree = Tree::new();
+        let nodes = Table::new();
+        init_sources(&tree, &nodes, 3);
+        let both = union(source_label(0), source_label(2), &nodes, &tree).unwrap() as u32;
+
+        let mut bytes = MAGIC.to_vec();
+        put_u32(&mut bytes, VERSION);
+        encode_set(&mut bytes, LABEL_TAG, 0, nodes.words(0));
+        encode_block(&mut bytes, BLOCK_TAG, 0, 0, 3);
+        encode_set(&mut bytes, LABEL_TAG, both, nodes.words(both as usize));
+        encode_block(&mut bytes, BLOCK_TAG, 1, both, 3);
+        encode_block(&mut bytes, BLOCK_TAG, 2, both, 3);
+        encode_set(&mut bytes, SET_TAG, 7, &[0b10]);
+        encode_block(&mut bytes, BITSET_TAG, 3, 7, 4);
+
+        let mut out = Vec::new();
+        decode(&mut &bytes[..], &mut out).unwrap();
+        assert_eq!(String::from_utf8(out).unwrap(),
+                   "Basic Block #0's Taints: 000\nBasic Block #1's Taints: 101\n\
+                    Basic Block #2's Taints: 101\nBasic Block #3's Taints: 0100\n");
+
+        // Entries are counted per block and printed after the rest.
+        let mut entries = MAGIC.to_vec();
+        put_u32(&mut entries, VERSION);
+        entries.push(SAMPLE_TAG);
+        put_u32(&mut entries, 4);
+        encode_set(&mut entries, LABEL_TAG, 0, nodes.words(0));
+        encode_enter(&mut entries, ENTER_TAG, 2, 0);
+        encode_set(&mut entries, LABEL_TAG, both, nodes.words(both as usize));
+        encode_enter(&mut entries, ENTER_TAG, 2, both);
+        encode_set(&mut entries, SET_TAG, 0, &[0b100, 0]);
+        encode_enter(&mut entries, ENTER_SET_TAG, 1, 0);
+        entries.push(DROPPED_TAG);
+        put_u32(&mut entries, 3);
+        let mut out = Vec::new();
+        decode(&mut &entries[..], &mut out).unwrap();
+        assert_eq!(String::from_utf8(out).unwrap(),
+                   "Block entries, 1 in 4 recorded, 3 dropped\n\
+                    Block #1 entered 1 times, 1 under taint, taints 001\n\
+                    Block #2 entered 2 times, 1 under taint, taints 101\n");
+
+        // Sinks print their tainted arguments as they were called.
+        let mut sinks = MAGIC.to_vec();
+        put_u32(&mut sinks, VERSION);
+        encode_set(&mut sinks, LABEL_TAG, both, nodes.words(both as usize));
+        encode_sink(&mut sinks, SINK_TAG, 4, 1, both, b"printf");
+        encode_set(&mut sinks, SET_TAG, 0, &[0b10, 0]);
+        encode_sink(&mut sinks, SINK_SET_TAG, 0, 0, 0, b"system");
+        let mut out = Vec::new();
+        decode(&mut &sinks[..], &mut out).unwrap();
+        assert_eq!(String::from_utf8(out).unwrap(),
+                   "Sink #4 (printf) argument 1's Taints: 101\nSink #0 (system) argument 0's Taints: 01\n");
+
+        // A lazy table's labels are defined at the end of the stream, after the records that use them.
+        let mut late = MAGIC.to_vec();
+        put_u32(&mut late, VERSION);
+        encode_sink(&mut late, SINK_TAG, 2, 0, both, b"puts");
+        encode_block(&mut late, BLOCK_TAG, 5, both, 3);
+        encode_set(&mut late, LABEL_TAG, both, nodes.words(both as usize));
+        let mut out = Vec::new();
+        decode(&mut &late[..], &mut out).unwrap();
+        assert_eq!(String::from_utf8(out).unwrap(),
+                   "Sink #2 (puts) argument 0's Taints: 101\nBasic Block #5's Taints: 101\n");
+
+        // A block whose label was never defined is a broken trace, not an empty set.
+        let mut broken = MAGIC.to_vec();
+        put_u32(&mut broken, VERSION);
+        encode_block(&mut broken, BLOCK_TAG, 0, 5, 3);
+        assert!(decode(&mut &broken[..], &mut Vec::new()).is_err());
+    }
+
+    #[test]
+    fn test_orphans() {
+        env::set_var("TAINT_TRACE", "/dev/null");
+        let tree = Tree::new();
+        let nodes = Table::lazy();
+        init_sources(&tree, &nodes, 3);
+        let both = union(source_label(0), source_label(2), &nodes, &tree).unwrap() as u32;
+        let table = &nodes as *const Table as usize;
+        ::std::thread::spawn(move || {
+            trace_table_sink(unsafe { &*(table as *const Table) }, both, 0, 0, b"printf");
+        }).join().unwrap();
+
+        // The thread left its label to exit instead of building it on the way out.
+        assert!(nodes.is_deferred(both as usize));
+        flush_at_exit();
+        assert!(!nodes.is_deferred(both as usize));
+    }
+}
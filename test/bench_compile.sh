@@ -0,0 +1,51 @@
+#!/bin/sh
+# Instruments generated modules of growing size and prints how long the pass takes, on one thread and on all
+# cores, then a single function of ever deeper nested ifs and switches. Run from the top directory after
+# building (see README).
+PASS=build/TaintTracking/libLLVMPassTaintTracking.so
+gen() {
+    echo "#include <stdio.h>"
+    echo "int g;"
+    i=0
+    while [ $i -lt $1 ]; do
+        echo "int f$i(int a) { int s = 0; for (int i = 0; i < a; i++) { if (i % 3 == g) s += i; else s -= a; } g = s; return s; }"
+        i=$((i + 1))
+    done
+    echo "int main() { int x = 0; int s = 0; scanf(\"%d\", &x);"
+    i=0
+    while [ $i -lt $1 ]; do
+        echo "s += f$i(x);"
+        i=$((i + 1))
+    done
+    printf '%s\n' 'printf("%d\n", s); return 0; }'
+}
+# One function, every level an if on the input around a switch on it.
+gen_nested() {
+    echo "#include <stdio.h>"
+    echo "int main() { int x = 0; int s = 0; scanf(\"%d\", &x);"
+    i=0
+    while [ $i -lt $1 ]; do
+        echo "if (x > $i) { switch ((x + $i) % 4) { case 0: s += $i; break; case 1: s -= x; break; case 2: s ^= $i; break; }"
+        i=$((i + 1))
+    done
+    i=0
+    while [ $i -lt $1 ]; do
+        echo "}"
+        i=$((i + 1))
+    done
+    printf '%s\n' 'printf("%d\n", s); return 0; }'
+}
+for n in 100 1000 5000; do
+    gen $n > /tmp/bench_compile_$n.c
+    for threads in 1 0; do
+        printf "%5d functions, -taint-threads=%d: " $n $threads
+        clang -O0 -w -Xclang -load -Xclang $PASS -mllvm -taint-time-report -mllvm -taint-threads=$threads \
+            -c /tmp/bench_compile_$n.c -o /tmp/bench_compile_$n.o 2>&1 | sed 's/^TaintTracking: //'
+    done
+done
+for depth in 25 50 100 200; do
+    gen_nested $depth > /tmp/bench_nested_$depth.c
+    printf "%5d levels deep: " $depth
+    clang -O0 -w -fbracket-depth=1024 -Xclang -load -Xclang $PASS -mllvm -taint-time-report \
+        -c /tmp/bench_nested_$depth.c -o /tmp/bench_nested_$depth.o 2>&1 | sed 's/^TaintTracking: //'
+done
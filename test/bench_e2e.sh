@@ -0,0 +1,65 @@
+#!/bin/sh
+# Compiles every workload with and without the pass and prints, as CSV, how long it runs, how large its code
+# is and how much memory it peaks at, so regressions show up in a diff. Run from the top directory after
+# building (see README), or through the bench_e2e target. Every workload is built at each level in LEVELS, and
+# the slowdown is against the plain build at the same level. PASS, TOOL, RUNS and LEVELS override the defaults.
+PASS=${PASS:-build/TaintTracking/libLLVMPassTaintTracking.so}
+TOOL=${TOOL:-TaintTracking/tool/target/release}
+RUNS=${RUNS:-5}
+LEVELS=${LEVELS:-"-O0 -O2"}
+OUT=${TMPDIR:-/tmp}/taint_bench
+mkdir -p $OUT
+
+# Seconds for RUNS runs of a binary on an input, divided by RUNS.
+seconds() {
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt $RUNS ]; do
+        echo "$2" | LD_LIBRARY_PATH=$TOOL TAINT_TRACE=$OUT/taint.trace $1 > /dev/null
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    awk "BEGIN { printf \"%.6f\", ($end - $start) / 1e9 / $RUNS }"
+}
+
+text() {
+    size $1 | awk 'NR == 2 { print $1 }'
+}
+
+# Peak resident set in kilobytes, empty without GNU time.
+rss() {
+    [ -x /usr/bin/time ] || return
+    { echo "$2" | LD_LIBRARY_PATH=$TOOL TAINT_TRACE=$OUT/taint.trace /usr/bin/time -f %M $1 > /dev/null; } 2>&1 | tail -n 1
+}
+
+# optimization level, workload, input, then a variant name and its pass flags for every instrumented variant.
+run() {
+    level=$1
+    name=$2
+    input=$3
+    shift 3
+    clang $level -w -c test/$name.c -o $OUT/$name.plain.o && cc -no-pie $OUT/$name.plain.o -o $OUT/$name.plain || return
+    base=$(seconds $OUT/$name.plain "$input")
+    base_text=$(text $OUT/$name.plain.o)
+    echo "$name,$level,plain,$base,1.00,$base_text,1.00,$(rss $OUT/$name.plain "$input")"
+    while [ $# -gt 0 ]; do
+        variant=$1
+        flags=$2
+        shift 2
+        clang $level -w -Xclang -load -Xclang $PASS $flags -c test/$name.c -o $OUT/$name.$variant.o &&
+            cc -no-pie $OUT/$name.$variant.o $TOOL/libtool.so -o $OUT/$name.$variant || continue
+        time=$(seconds $OUT/$name.$variant "$input")
+        size=$(text $OUT/$name.$variant.o)
+        echo "$name,$level,$variant,$time,$(awk "BEGIN { printf \"%.2f\", $time / $base }"),$size,$(awk "BEGIN { printf \"%.2f\", $size / $base_text }"),$(rss $OUT/$name.$variant "$input")"
+    done
+}
+
+VARIANTS="taint '' shadow '-mllvm -taint-shadow-memory' bytes '-mllvm -taint-shadow-memory -mllvm -taint-shadow-granule=1' \
+          dual '-mllvm -taint-dual'"
+echo "workload,opt,variant,seconds,slowdown,text_bytes,text_ratio,max_rss_kb"
+for level in $LEVELS; do
+    for workload in "test|1 2 3 4" "test3|1 5" "test4|1 5" "test5|7" "test6|7" "test7|3" \
+                    "loop1|64 3" "loop2|999" "mem1|262144 3"; do
+        eval run $level ${workload%%|*} "'${workload#*|}'" $VARIANTS
+    done
+done
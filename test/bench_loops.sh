@@ -0,0 +1,16 @@
+#!/bin/sh
+# Times the loop programs with and without the pass. Run from the top directory after building (see README).
+PASS=build/TaintTracking/libLLVMPassTaintTracking.so
+TOOL=TaintTracking/tool/target/release
+run() {
+    name=$1
+    input=$2
+    clang -O0 -w -o /tmp/$name.plain test/$name.c
+    clang -O0 -w -Xclang -load -Xclang $PASS -c test/$name.c -o /tmp/$name.o
+    cc -no-pie /tmp/$name.o $TOOL/libtool.so -o /tmp/$name.taint
+    plain=$( { /usr/bin/time -f %e sh -c "echo $input | /tmp/$name.plain > /dev/null"; } 2>&1 )
+    taint=$( { /usr/bin/time -f %e sh -c "echo $input | LD_LIBRARY_PATH=$TOOL /tmp/$name.taint > /dev/null"; } 2>&1 )
+    echo "$name: ${plain}s plain, ${taint}s tainted, $(awk "BEGIN { printf \"%.2f\", $taint / $plain }")x"
+}
+run loop1 "64 3"
+run loop2 "999"
@@ -0,0 +1,25 @@
+#include <stdio.h>
+// Matrix product whose size and contents come from the input.
+int a[64][64], b[64][64], c[64][64];
+int main(){
+    int n = 0;
+    int seed = 0;
+    int i, j, k, r;
+    scanf("%d", &n);
+    scanf("%d", &seed);
+    if (n > 64) n = 64;
+    for (i = 0; i < n; i++)
+        for (j = 0; j < n; j++) {
+            a[i][j] = (i * seed + j) % 7;
+            b[i][j] = (j * seed + i) % 5;
+        }
+    for (r = 0; r < 20; r++)
+        for (i = 0; i < n; i++)
+            for (j = 0; j < n; j++) {
+                int sum = 0;
+                for (k = 0; k < n; k++) sum += a[i][k] * b[k][j];
+                c[i][j] = sum;
+            }
+    printf("%d\n", c[n - 1][n - 1]);
+    return 0;
+}
@@ -0,0 +1,20 @@
+#include <stdio.h>
+// Scans a buffer over and over and stops at the first element equal to the key.
+int buf[4096];
+int main(){
+    int key = 0;
+    int i, r;
+    int found = 0;
+    scanf("%d", &key);
+    for (i = 0; i < 4096; i++) buf[i] = i % 1000;
+    for (r = 0; r < 2000; r++) {
+        for (i = 0; i < 4096; i++) {
+            if (buf[i] == key) {
+                found += i;
+                break;
+            }
+        }
+    }
+    printf("%d\n", found);
+    return 0;
+}
@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// Pointer chasing and buffer copies over heap memory whose size and contents come from the input.
+struct node { struct node *next; int value; };
+int main(){
+    int n = 0;
+    int seed = 0;
+    int i, r;
+    scanf("%d", &n);
+    scanf("%d", &seed);
+    if (n < 2 || n > 1 << 20) n = 1 << 16;
+    struct node *nodes = malloc(n * sizeof(struct node));
+    int *buffer = malloc(n * sizeof(int));
+    int *copy = malloc(n * sizeof(int));
+    for (i = 0; i < n; i++) {
+        nodes[i].next = &nodes[(i * 7919 + seed) % n];
+        nodes[i].value = i ^ seed;
+    }
+    long sum = 0;
+    struct node *p = nodes;
+    for (r = 0; r < 4 * n; r++) {
+        buffer[r % n] = p->value;
+        sum += p->value;
+        p = p->next;
+    }
+    for (r = 0; r < 16; r++) {
+        memcpy(copy, buffer, n * sizeof(int));
+        memset(buffer, 0, n / 2 * sizeof(int));
+        sum += copy[(r * 31 + seed) % n];
+    }
+    printf("%ld\n", sum);
+    free(copy);
+    free(buffer);
+    free(nodes);
+    return 0;
+}
@@ -0,0 +1,16 @@
+//
+// Two different pointers to the same int: only shadow memory sees that they alias.
+//
+#include <stdio.h>
+int main() {
+    int a[4] = {0, 0, 0, 0};
+    int i = 0;
+    int *p = a;
+    scanf("%d", &a[1]);
+    p = p + 1;
+    if (*p > 0) {
+        i = 1;
+    }
+    printf("%d\n", i);
+    return 0;
+}
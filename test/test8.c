@@ -0,0 +1,25 @@
+//
+// A switch on one input and an if on the other nested under one of its cases: only that case's
+// blocks depend on both, and the code after the switch depends on neither.
+//
+#include <stdio.h>
+int main() {
+    int op, x;
+    int r = 0, done = 0;
+    scanf("%d %d", &op, &x);
+    switch (op) {
+    case 1:
+        r = 10;
+        break;
+    case 2:
+        if (x > 0) {
+            r = 20;
+        }
+        break;
+    default:
+        break;
+    }
+    done = 1;
+    printf("%d %d\n", r, done);
+    return 0;
+}
@@ -0,0 +1,28 @@
+//
+// Calls through function pointers: the input picks which function runs and gives it its arguments, so the
+// result is tainted whichever one it was. report is only ever called through a pointer, and its branch still
+// sees the taint of its argument. The call with constant arguments stays clean.
+//
+#include <stdio.h>
+static int add(int a, int b) {
+    return a + b;
+}
+static int mul(int a, int b) {
+    return a * b;
+}
+static void report(int r) {
+    if (r > 10) {
+        printf("big\n");
+    }
+}
+int main() {
+    int (*ops[2])(int, int) = {add, mul};
+    void (*done)(int) = report;
+    int op, x;
+    scanf("%d %d", &op, &x);
+    int r = ops[op & 1](x, 2);
+    int c = ops[0](3, 4);
+    done(r);
+    printf("%d %d\n", r, c);
+    return 0;
+}